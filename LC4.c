@@ -1,5 +1,10 @@
 // LC4.c: Defines simulator functions for executing instructions
 #include "LC4.h"
+#include "tracewriter.h"
+#include "profile.h"
+#include "devices.h"
+#include "hle.h"
+#include "debug.h"
 #include <stdio.h>
 void PrintBinary(MachineState* CPU, FILE* output);
 
@@ -49,6 +54,46 @@ void Reset(MachineState* CPU)
      }
     
      ClearSignals(CPU); // Clear control signals
+     DefaultMemoryMap(CPU); // Standard memory map
+}
+
+
+/*
+ * Install the standard LC4 memory map.
+ */
+void DefaultMemoryMap(MachineState* CPU)
+{
+    unsigned char pages[256];
+    int page = 0;
+
+    for (page = 0; page < 256; page++) {
+        if (page < 0x20 || (page >= 0x80 && page < 0xA0)) { // user and OS code
+            pages[page] = PERM_ANY(PERM_EXEC);
+        } else if (page < 0x80) { // user data
+            pages[page] = PERM_ANY(PERM_READ | PERM_WRITE);
+        } else { // OS data
+            pages[page] = (PERM_READ | PERM_WRITE) << PERM_OS_SHIFT;
+        }
+    }
+    SetMemoryMap(CPU, pages);
+}
+
+
+/*
+ * Install a memory map.
+ */
+void SetMemoryMap(MachineState* CPU, const unsigned char* pages)
+{
+    if (memcmp(CPU -> pagePerm, pages, sizeof(CPU -> pagePerm)) == 0) {
+        return;
+    }
+    memcpy(CPU -> pagePerm, pages, sizeof(CPU -> pagePerm));
+
+    // Decoding and block formation looked at the old permissions
+    memset(CPU -> decoded, 0, sizeof(CPU -> decoded));
+    memset(CPU -> blockLength, 0, sizeof(CPU -> blockLength));
+    memset(CPU -> blockPage, 0, sizeof(CPU -> blockPage));
+    CPU -> blockFlushes++;
 }
 
 
@@ -77,6 +122,38 @@ void ClearSignals(MachineState* CPU)
  */
 void WriteOut(MachineState* CPU, FILE* output)
 {
+    TraceRecord record; // packed copy of the line for CPU -> trace
+
+    if (output == NULL) { // untraced run
+        return;
+    }
+
+    if (CPU -> trace != NULL) {
+        record.pc = CPU -> PC;
+        record.insn = CPU -> memory[CPU -> PC];
+        record.flags = 0;
+        record.reg = 0;
+        record.regValue = 0;
+        record.nzp = 0;
+        if (CPU -> regFile_WE == 1) {
+            record.flags |= TRACE_REG_WE;
+            record.reg = CPU -> regInputVal;
+            record.regValue = CPU -> R[CPU -> regInputVal]; // same read as the text line
+        }
+        if (CPU -> NZP_WE == 1) {
+            record.flags |= TRACE_NZP_WE;
+            record.nzp = CPU -> NZPVal;
+        }
+        if (CPU -> DATA_WE == 1) {
+            record.flags |= TRACE_DATA_WE;
+        }
+        record.dmemAddr = CPU -> dmemAddr;
+        record.dmemValue = CPU -> dmemValue;
+        record.reserved = 0;
+        TraceAppend(CPU -> trace, &record);
+        return;
+    }
+
     fprintf(output, "%04X ", CPU -> PC);
     PrintBinary(CPU, output); // print out binary
     
@@ -105,329 +182,649 @@ void WriteOut(MachineState* CPU, FILE* output)
 }
 
 
+/*
+ * Decode the instruction word found at address pc.
+ */
+void DecodeInsn(unsigned short pc, unsigned short word, DecodedInsn* insn)
+{
+    unsigned short opcode = INSN_OP(word); // Get Opcode
+    unsigned short subOp = 0; // sub-opcode, meaning depends on opcode
+    int imm = 0; // raw immediate before sign extension
+
+    insn -> rd = INSN_11_9(word); // I[11:9]
+    insn -> rs = INSN_8_6(word); // I[8:6]
+    insn -> rt = INSN_2_0(word); // I[2:0]
+    insn -> imm = 0;
+    insn -> target = 0;
+
+    if (opcode == 0) { // branch
+        imm = INSN_8_0(word); // IMM9
+        if (imm >> 8 == 1) { // Sign extend
+            imm = imm | 0xFE00;
+        }
+        insn -> handler = H_NOP + INSN_11_9(word); // NOP, BRp ... BRnzp
+        insn -> imm = imm;
+        insn -> target = pc + 1 + imm; // PC + 1 + sext(IMM9)
+
+    } else if (opcode == 1) { // arithmetic
+        subOp = INSN_5_3(word);
+        imm = INSN_4_0(word); // IMM5
+        if (imm >> 4 == 1) { // Sign extend
+            imm = imm | 0xFFE0;
+        }
+        insn -> handler = (subOp <= 3) ? H_ADD + subOp : H_ADDI;
+        insn -> imm = imm;
+
+    } else if (opcode == 2) { // comparative
+        subOp = (word >> 7) & 0x3; // I[8:7]
+        imm = INSN_6_0(word); // IMM7
+        if (subOp == 2 && imm >> 6 == 1) { // Sign extend CMPI only
+            imm = imm | 0xFF80;
+        }
+        insn -> handler = H_CMP + subOp;
+        insn -> imm = imm;
+
+    } else if (opcode == 4) { // jump subroutine
+        if (((word >> 11) & 0x1) == 1) { // Immediate
+            insn -> handler = H_JSR;
+            insn -> target = (pc & 0x8000) | INSN_10_0(word << 4);
+        } else { // Register
+            insn -> handler = H_JSRR;
+        }
+
+    } else if (opcode == 5) { // logical
+        subOp = INSN_5_3(word);
+        imm = INSN_4_0(word); // IMM5
+        if (imm >> 4 == 1) { // Sign extend
+            imm = imm | 0xFFE0;
+        }
+        insn -> handler = (subOp <= 4) ? H_AND + subOp : H_LOGIC_NONE;
+        insn -> imm = imm;
+
+    } else if (opcode == 6 || opcode == 7) { // ldr / str
+        imm = INSN_5_0(word); // IMM6
+        if (imm >> 5 == 1) { // Sign extend
+            imm = imm | 0xFFC0;
+        }
+        insn -> handler = (opcode == 6) ? H_LDR : H_STR;
+        insn -> imm = imm;
+
+    } else if (opcode == 8) { // RTI
+        insn -> handler = H_RTI;
+
+    } else if (opcode == 9) { // constant
+        imm = INSN_8_0(word); // IMM9
+        if (imm >> 8 == 1) { // Sign extend
+            imm = imm | 0xFE00;
+        }
+        insn -> handler = H_CONST;
+        insn -> imm = imm;
+
+    } else if (opcode == 10) { // shift
+        insn -> handler = H_SLL + ((word >> 4) & 0x3); // I[5:4]
+        insn -> imm = INSN_3_0(word); // UIMM4
+
+    } else if (opcode == 12) { // jump
+        if (((word >> 11) & 0x1) == 1) { // Immediate
+            insn -> handler = H_JMP;
+            insn -> target = pc + 1 + INSN_10_0(word);
+        } else { // Register
+            insn -> handler = H_JMPR;
+        }
+
+    } else if (opcode == 13) { // hi-constant
+        insn -> handler = H_HICONST;
+        insn -> imm = INSN_7_0(word) << 8; // UIMM8 << 8
+
+    } else if (opcode == 15) { // TRAP
+        insn -> handler = H_TRAP;
+        insn -> imm = INSN_7_0(word); // UIMM8
+        insn -> target = 0x8000 | INSN_7_0(word); // PC = (0x8000 | uIMM8)
+
+    } else { // Error
+        insn -> handler = H_INVALID;
+    }
+}
+
+
+/*
+ * Decode the word at pc into insn, marking it H_DATA_FETCH if no privilege
+ * may fetch from its page. Pages only one privilege may run are checked
+ * against the PSR at dispatch instead.
+ */
+static inline void DecodeWord(MachineState* CPU, unsigned short pc, DecodedInsn* insn)
+{
+    DecodeInsn(pc, CPU -> memory[pc], insn);
+    if (insn -> handler != H_INVALID && !(CPU -> pagePerm[pc >> 8] & PERM_ANY(PERM_EXEC))) {
+        insn -> handler = H_DATA_FETCH; // fetching from data memory is an error at this address
+    }
+}
+
+
+/*
+ * DecodeWord for the predecoded table: a breakpoint address gets H_BREAK
+ * instead, so only the decode on a miss looks breakpoints up.
+ */
+static inline void DecodeAt(MachineState* CPU, unsigned short pc, DecodedInsn* insn)
+{
+    DecodeWord(CPU, pc, insn);
+    if (CPU -> debugger != NULL && CPU -> debugger -> breakpoint[pc]) {
+        insn -> handler = H_BREAK; // stops the run before the instruction (see debug.h)
+    }
+}
+
+
+/*
+ * Device and watchpoint work for an LDR from a page with a load hook bit.
+ * Returns 0, 1 if a watchpoint asks to stop after the LDR, or -1 if the
+ * device would wait forever.
+ */
+static inline int LoadHook(MachineState* CPU, unsigned short address)
+{
+    unsigned char hooks = CPU -> devicePage[address >> 8];
+
+    if ((hooks & DEVICE_HOOK_LOAD) && DeviceLoad(CPU, address) != 0) {
+        return -1;
+    }
+    return (hooks & WATCH_HOOK_LOAD) ? DebugWatch(CPU, address, WATCH_READ) : 0;
+}
+
+
+/*
+ * Device and watchpoint work after an STR to a page with a store hook bit.
+ * Returns 1 if a watchpoint asks to stop after the STR, 0 otherwise.
+ */
+static inline int StoreHook(MachineState* CPU, unsigned short address)
+{
+    unsigned char hooks = CPU -> devicePage[address >> 8];
+
+    if (hooks & DEVICE_HOOK_STORE) { // device register or video memory
+        DeviceStore(CPU, address);
+    }
+    return (hooks & WATCH_HOOK_STORE) ? DebugWatch(CPU, address, WATCH_WRITE) : 0;
+}
+
+
+/*
+ * Update the PSR NZP bits from result. Matches SetNZP exactly: NZPVal only
+ * changes when the bits change, and a corrupt (non one-hot) NZP is left alone.
+ */
+static inline void UpdateNZP(MachineState* CPU, short result)
+{
+    unsigned short currNZP = INSN_2_0(CPU -> PSR); // Get current NZP value of PSR
+    unsigned short newNZP = (result < 0) ? 4 : ((result > 0) ? 1 : 2);
+
+    if (currNZP != newNZP && ((0x17 >> currNZP) & 1)) { // currNZP is 0, 1, 2 or 4
+        CPU -> PSR = CPU -> PSR - currNZP + newNZP;
+        CPU -> NZPVal = newNZP; // Set new NZPVal
+    }
+}
+
+
+/*
+ * Predecoded instruction at PC, decoding on a miss.
+ */
+static inline DecodedInsn* Decoded(MachineState* CPU)
+{
+    DecodedInsn* insn = &CPU -> decoded[CPU -> PC];
+
+    if (insn -> handler == H_UNDECODED) { // first time here (or word was overwritten)
+        DecodeAt(CPU, CPU -> PC, insn);
+    }
+    return insn;
+}
+
+
+// Run in place of an instruction on a page the current privilege cannot fetch from
+static DecodedInsn fetchFault = { .handler = H_DATA_FETCH };
+
+
+/*
+ * Return the predecoded instruction at the current PC, decoding it on first use.
+ */
+DecodedInsn* FetchDecoded(MachineState* CPU)
+{
+    return Decoded(CPU);
+}
+
+
+/*
+ * Drop every cached block that contains address.
+ */
+static void InvalidateBlocks(MachineState* CPU, unsigned short address)
+{
+    int start = address - (MAX_BLOCK_LENGTH - 1); // earliest block start that can reach address
+    int pc = 0; // candidate block start
+
+    if (start < 0) {
+        start = 0;
+    }
+
+    for (pc = start; pc <= address; pc++) {
+        if (pc + CPU -> blockLength[pc] > address) { // block covers address
+            CPU -> blockLength[pc] = 0;
+            CPU -> blockFlushes++;
+        }
+    }
+}
+
+
+/*
+ * Write a word into memory and drop its predecoded entry (and any cached block holding it).
+ */
+void StoreWord(MachineState* CPU, unsigned short address, unsigned short value)
+{
+    CPU -> memory[address] = value;
+    CPU -> decoded[address].handler = H_UNDECODED;
+
+    if (CPU -> blockPage[address >> 8]) { // only pages holding blocks need the scan
+        InvalidateBlocks(CPU, address);
+    }
+}
+
+
+/*
+ * Drop predecoded entries and cached blocks for words written directly into memory.
+ */
+void InvalidateWords(MachineState* CPU, unsigned short address, int count)
+{
+    int i = 0; // word offset
+
+    for (i = 0; i < count; i++) {
+        CPU -> decoded[(unsigned short)(address + i)].handler = H_UNDECODED;
+        if (CPU -> blockPage[(unsigned short)(address + i) >> 8]) {
+            InvalidateBlocks(CPU, address + i);
+        }
+    }
+}
+
+
+/*
+ * Form and cache the basic block starting at pc, returning its length. A block
+ * ends after a control transfer (BR, JMP, JSR, JSRR, TRAP, RTI) and before any
+ * word that cannot be executed there (invalid opcode or data memory) or the
+ * halt address, so those checks are done here once instead of per instruction.
+ * NOP never transfers control and stays inside the block.
+ */
+int FormBlock(MachineState* CPU, unsigned short pc)
+{
+    unsigned short address = pc; // address being added to the block
+    int length = 0; // instructions in the block so far
+    DecodedInsn* insn;
+
+    do {
+        insn = &CPU -> decoded[address];
+        if (insn -> handler == H_UNDECODED) {
+            DecodeAt(CPU, address, insn);
+        }
+
+        if (insn -> handler == H_INVALID || insn -> handler == H_DATA_FETCH) { // cannot run here
+            if (length == 0) {
+                return 1; // handled on its own by the normal dispatch
+            }
+            break;
+        }
+
+        length++;
+        address++;
+
+        if ((insn -> handler >= H_BRP && insn -> handler <= H_BRNZP) || insn -> handler == H_JSRR ||
+            insn -> handler == H_JSR || insn -> handler == H_RTI || insn -> handler == H_JMPR ||
+            insn -> handler == H_JMP || insn -> handler == H_TRAP) { // control transfer ends the block
+            break;
+        }
+        if ((address & 0xFF) == 0 && CPU -> pagePerm[address >> 8] != CPU -> pagePerm[pc >> 8]) {
+            break; // the fetch check at dispatch covers one set of permissions
+        }
+    } while (length < MAX_BLOCK_LENGTH && address != 0x80FF && address != 0);
+
+    CPU -> blockLength[pc] = length;
+    CPU -> blockPage[pc >> 8] = 1;
+    CPU -> blockPage[(unsigned short)(pc + length - 1) >> 8] = 1;
+    return length;
+}
+
+
 /*
  * This function should execute one LC4 datapath cycle.
  */
 int UpdateMachineState(MachineState* CPU, FILE* output)
 {
     // Consider TRAP/RTI/HICONST/CONST/LDR/STR within this function
+    DecodedInsn* insn;
+    DecodedInsn stepped; // the instruction under a breakpoint, run while the debugger is suspended
     unsigned short rs = 0;
     unsigned short rt = 0;
     unsigned short rd = 0;
-    int offset = 0;
-    int im9 = 0;
-    int uim8 = 0;
-    unsigned short opcode = INSN_OP(CPU -> memory[CPU -> PC]); // Get Opcode
-    
+    int hook = 0; // LoadHook / StoreHook result
+
     if (CPU -> PC == 0x80FF) {
         return 1;
-        
-    } else {
-        if (opcode == 0) { // branch
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                BranchOp(CPU, output); // Run Branch Parser
-                return 0;
-            }
-            
-        } else if (opcode == 1) { // arithmetic
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                ArithmeticOp(CPU, output); // Run Arithmetic Parser
-                return 0;
-            }
-            
-        } else if (opcode == 2) { // comparative
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                ComparativeOp(CPU, output); // Run Comparative Parser
-                return 0;
-            }
-            
-        } else if (opcode == 4) { // jump subroutine
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                JSROp(CPU, output); // Run Jump Subroutine Parser
-                return 0;
-            }
-            
-        } else if (opcode == 5) { // logical
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                LogicalOp(CPU, output); // Run Logical Parser
-                return 0;
-            }
-            
-        } else if (opcode == 6) { // ldr
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            rs = INSN_8_6(CPU -> memory[CPU -> PC]); // get RS
-            rd = INSN_11_9(CPU -> memory[CPU -> PC]); // get RD
-            offset = INSN_5_0(CPU -> memory[CPU -> PC]); // IMM6
-            
-            if (offset >> 5 == 1) { // Sign extend
-                offset = offset | 0xFFC0;
-            }
-            
-            if (rd > 7 | rs > 7) { // Invalid registers
-                fprintf(stderr, "error: Invalid registers\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> rdMux_CTL = 0; // set RD control signal to 0
-            CPU -> rsMux_CTL = 0; // set RS control signal to 0
-            CPU -> rtMux_CTL = 0; // set RT control signal to 0
-            CPU -> regFile_WE = 1; // set register file write enable to 0
-            CPU -> NZP_WE = 1; // set NZP write enable to 1
-            CPU -> DATA_WE = 0; // set data write enable to 0
-            
-            CPU -> dmemAddr = (short int)CPU -> R[rs] + offset;
-            
-            if (((CPU -> PSR) >> 15 != 1 && CPU -> dmemAddr >= 0xA000) || (((CPU -> PSR) >> 15 != 1) && CPU -> dmemAddr >= 0xC000) ||
-                (CPU -> dmemAddr >= 0x8000 && CPU -> dmemAddr <= 0x9FFF) || CPU -> dmemAddr < 0x2000) { // Bad values
-                fprintf(stderr, "error: Invalid Data Address\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> dmemValue = CPU -> memory[CPU -> dmemAddr];
-            
-            CPU -> R[rd] = CPU -> memory[CPU -> dmemAddr]; // Store from data to RD
-            SetNZP(CPU, CPU -> R[rd]); // Set new NZP
-            
-            CPU -> regInputVal = rd; // regInputVal = register being stored into
-            
-            WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1; // PC = PC + 1
-            return 0;
-            
-        } else if (opcode == 7) { // str
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            rs = INSN_8_6(CPU -> memory[CPU -> PC]); // get RS
-            rt = INSN_11_9(CPU -> memory[CPU -> PC]); // get RT
-            offset = INSN_5_0(CPU -> memory[CPU -> PC]); // IMM6
-            
-            if (offset >> 5 == 1) { // Sign extend
-                offset = offset | 0xFFC0;
-            }
+    }
 
-            if (rs > 7 | rt > 7) { // Invalid registers
-                fprintf(stderr, "error: Invalid registers\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> rdMux_CTL = 0; // set RD control signal to 0
-            CPU -> rsMux_CTL = 0; // set RS control signal to 0
-            CPU -> rtMux_CTL = 1; // set RT control signal to 1
-            CPU -> regFile_WE = 0; // set register file write enable to 0
-            CPU -> NZP_WE = 0; // set NZP write enable to 1
-            CPU -> DATA_WE = 1; // set data write enable to 0
-            
-            CPU -> dmemAddr = (short int)CPU ->R[rs] + offset;
-            
-            if (((CPU -> PSR) >> 15 != 1 && CPU -> dmemAddr >= 0xA000) || (((CPU -> PSR) >> 15 != 1) && CPU -> dmemAddr >= 0xC000) ||
-                (CPU -> dmemAddr >= 0x8000 && CPU -> dmemAddr <= 0x9FFF) || CPU -> dmemAddr < 0x2000) { // Bad values
-                fprintf(stderr, "error: Invalid Data Address\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> dmemValue = (short int)CPU -> R[rt];
-            CPU -> memory[CPU -> dmemAddr] = CPU -> R[rt]; // store rt in datamem
-            
-            WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+    insn = Decoded(CPU); // Get predecoded instruction
+    if (insn -> handler == H_BREAK) { // breakpoint
+        if (!CPU -> debugger -> suspended) {
+            return 2;
+        }
+        DecodeWord(CPU, CPU -> PC, &stepped);
+        insn = &stepped;
+    }
+    CPU -> instructions++;
+    if (CPU -> profile != NULL) { // --profile
+        CPU -> profile -> count[CPU -> PC]++;
+        CPU -> profile -> handlers[insn -> handler]++;
+        CPU -> profile -> last[CPU -> PC] = insn -> handler;
+    }
+
+    if (insn -> handler == H_INVALID) { // Error
+        fprintf(stderr, "error: Invalid Opcode\n");
+        CPU -> PC = 0x80FF;
+        return 0;
+    }
+
+    if (insn -> handler == H_DATA_FETCH || !PAGE_ALLOWS(CPU, CPU -> PSR, CPU -> PC, PERM_EXEC)) { // PC is in data memory
+        fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
+        CPU -> PC = 0x80FF;
+        return 0;
+    }
+
+    switch (insn -> handler) {
+    case H_NOP: case H_BRP: case H_BRZ: case H_BRZP:
+    case H_BRN: case H_BRNP: case H_BRNZ: case H_BRNZP: // branch
+        BranchOp(CPU, insn, output); // Run Branch Parser
+        return 0;
+
+    case H_ADD: case H_MUL: case H_SUB: case H_DIV: case H_ADDI: // arithmetic
+        ArithmeticOp(CPU, insn, output); // Run Arithmetic Parser
+        return 0;
+
+    case H_CMP: case H_CMPU: case H_CMPI: case H_CMPIU: // comparative
+        ComparativeOp(CPU, insn, output); // Run Comparative Parser
+        return 0;
+
+    case H_JSRR: case H_JSR: // jump subroutine
+        JSROp(CPU, insn, output); // Run Jump Subroutine Parser
+        return 0;
+
+    case H_AND: case H_NOT: case H_OR: case H_XOR: case H_ANDI: case H_LOGIC_NONE: // logical
+        LogicalOp(CPU, insn, output); // Run Logical Parser
+        return 0;
+
+    case H_LDR: // ldr
+        rs = insn -> rs; // get RS
+        rd = insn -> rd; // get RD
+
+        if (rd > 7 | rs > 7) { // Invalid registers
+            fprintf(stderr, "error: Invalid registers\n");
+            CPU -> PC = 0x80FF;
             return 0;
-            
-        } else if (opcode == 8) { // RTI
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> rdMux_CTL = 0; // set RD control signal to 0
-            CPU -> rsMux_CTL = 0; // set RS control signal to 0
-            CPU -> rtMux_CTL = 0; // set RT control signal to 0
-            CPU -> regFile_WE = 0; // set register file write enable to 0
-            CPU -> NZP_WE = 0; // set NZP write enable to 1
-            CPU -> DATA_WE = 0; // set data write enable to 0
-
-            CPU -> dmemAddr = 0; // set dmemAddr to 0
-            CPU -> dmemValue = 0; // set dmemValue to 0
-            
-            CPU -> PSR  = CPU -> PSR & (0x7FFF); // PSR[15] = 0
-            
-            WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> R[7]; // PC = R7
+        }
+
+        CPU -> rdMux_CTL = 0; // set RD control signal to 0
+        CPU -> rsMux_CTL = 0; // set RS control signal to 0
+        CPU -> rtMux_CTL = 0; // set RT control signal to 0
+        CPU -> regFile_WE = 1; // set register file write enable to 0
+        CPU -> NZP_WE = 1; // set NZP write enable to 1
+        CPU -> DATA_WE = 0; // set data write enable to 0
+
+        CPU -> dmemAddr = CPU -> R[rs] + insn -> imm; // RS + sext(IMM6)
+
+        if (!PAGE_ALLOWS(CPU, CPU -> PSR, CPU -> dmemAddr, PERM_READ)) { // Bad values
+            fprintf(stderr, "error: Invalid Data Address\n");
+            CPU -> PC = 0x80FF;
             return 0;
-            
-        } else if (opcode == 9) { // constant
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            rd = INSN_11_9(CPU -> memory[CPU -> PC]); // get rd
+        }
 
-            im9 = INSN_8_0(CPU -> memory[CPU -> PC]); // IMM9
-            
-            if (im9 >> 8 == 1) { // Sign extend
-                im9 = im9 | 0xFE00;
-            }
-            
-            if (rd > 7) { // Invalid registers
-                fprintf(stderr, "error: Invalid registers\n");
+        if (CPU -> devicePage[CPU -> dmemAddr >> 8] & (DEVICE_HOOK_LOAD | WATCH_HOOK_LOAD)) { // device register or watched page
+            hook = LoadHook(CPU, CPU -> dmemAddr);
+            if (hook < 0) { // waits forever
                 CPU -> PC = 0x80FF;
                 return 0;
             }
-            
-            CPU -> rdMux_CTL = 0; // set RD control signal to 0
-            CPU -> rsMux_CTL = 0; // set RS control signal to 0
-            CPU -> rtMux_CTL = 0; // set RT control signal to 0
-            CPU -> regFile_WE = 1; // set register file write enable to 0
-            CPU -> NZP_WE = 1; // set NZP write enable to 1
-            CPU -> DATA_WE = 0; // set data write enable to 0
-
-            CPU -> dmemAddr = 0; // set dmemAddr to 0
-            CPU -> dmemValue = 0; // set dmemValue to 0
-            
-            CPU -> R[rd] = im9; // RD = sext(IMM9)
-            CPU -> regInputVal = rd; // Store register number
-            SetNZP(CPU, CPU -> R[rd]); // Set NZP based on result
-            
-            WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+        }
+        CPU -> dmemValue = CPU -> memory[CPU -> dmemAddr];
+
+        CPU -> R[rd] = CPU -> memory[CPU -> dmemAddr]; // Store from data to RD
+        SetNZP(CPU, CPU -> R[rd]); // Set new NZP
+
+        CPU -> regInputVal = rd; // regInputVal = register being stored into
+
+        WriteOut(CPU, output); // Write output into file
+        CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+        return hook ? 2 : 0; // 2: watchpoint hit
+
+    case H_STR: // str
+        rs = insn -> rs; // get RS
+        rt = insn -> rd; // get RT
+
+        if (rs > 7 | rt > 7) { // Invalid registers
+            fprintf(stderr, "error: Invalid registers\n");
+            CPU -> PC = 0x80FF;
             return 0;
-            
-        } else if (opcode == 10) { // shift
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                ShiftModOp(CPU, output); // Run Shift Parser
-                return 0;
-            }
-            
-        } else if (opcode == 12) { // jump
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            } else {
-                JumpOp(CPU, output); // Run Jump Parser
-                return 0;
-            }
-            
-        } else if (opcode == 13) { // hi-constant
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            rd = INSN_11_9(CPU -> memory[CPU -> PC]); // get rd
+        }
 
-            uim8 = INSN_7_0(CPU -> memory[CPU -> PC]); // UIMM8
-            
-            if (rd > 7) { // Invalid registers
-                fprintf(stderr, "error: Invalid registers\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> rdMux_CTL = 0; // set RD control signal to 0
-            CPU -> rsMux_CTL = 0; // set RS control signal to 0
-            CPU -> rtMux_CTL = 0; // set RT control signal to 0
-            CPU -> regFile_WE = 1; // set register file write enable to 0
-            CPU -> NZP_WE = 1; // set NZP write enable to 1
-            CPU -> DATA_WE = 0; // set data write enable to 0
-
-            CPU -> dmemAddr = 0; // set dmemAddr to 0
-            CPU -> dmemValue = 0; // set dmemValue to 0
-            
-            CPU -> R[rd] = (CPU -> R[rd] & 0xFF) | (uim8 << 8); // RD = RD & 0xFF | UIMM8 << 8
-            CPU -> regInputVal = rd; // Store register number
-            SetNZP(CPU, CPU -> R[rd]); // Set NZP based on result
-            
-            WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+        CPU -> rdMux_CTL = 0; // set RD control signal to 0
+        CPU -> rsMux_CTL = 0; // set RS control signal to 0
+        CPU -> rtMux_CTL = 1; // set RT control signal to 1
+        CPU -> regFile_WE = 0; // set register file write enable to 0
+        CPU -> NZP_WE = 0; // set NZP write enable to 1
+        CPU -> DATA_WE = 1; // set data write enable to 0
+
+        CPU -> dmemAddr = CPU -> R[rs] + insn -> imm; // RS + sext(IMM6)
+
+        if (!PAGE_ALLOWS(CPU, CPU -> PSR, CPU -> dmemAddr, PERM_WRITE)) { // Bad values
+            fprintf(stderr, "error: Invalid Data Address\n");
+            CPU -> PC = 0x80FF;
             return 0;
-            
-        } else if (opcode == 15) { // TRAP
-            if ((CPU -> PC >= 0x2000 && CPU -> PC <= 0x7FFF) || (CPU -> PC >= 0xA000 && CPU -> PC <= 0xFFFF)) {
-                fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            rd = 0x7; // get rd = 7
-            uim8 = INSN_7_0(CPU -> memory[CPU -> PC]); // UIMM8
-            
-            if (rd > 7) { // Invalid registers
-                fprintf(stderr, "error: Invalid registers\n");
-                CPU -> PC = 0x80FF;
-                return 0;
-            }
-            
-            CPU -> rdMux_CTL = 1; // set RD control signal to 1
-            CPU -> rsMux_CTL = 0; // set RS control signal to 0
-            CPU -> rtMux_CTL = 0; // set RT control signal to 0
-            CPU -> regFile_WE = 1; // set register file write enable to 0
-            CPU -> NZP_WE = 1; // set NZP write enable to 1
-            CPU -> DATA_WE = 0; // set data write enable to 0
-
-            CPU -> dmemAddr = 0; // set dmemAddr to 0
-            CPU -> dmemValue = 0; // set dmemValue to 0
-            
-            CPU -> R[rd] = CPU -> PC + 1; // R7 = PC + 1
-            CPU -> regInputVal = rd; // Store register number
-            SetNZP(CPU, CPU -> R[rd]); // Set NZP based on result
-            
-            CPU -> PSR = CPU -> PSR | (0x8000); // PSR[15] = 1
-            
-            WriteOut(CPU, output); // Write output into file
-            CPU -> PC = (0x8000 | uim8); // PC = (0x8000 | uIMM8)
+        }
+
+        CPU -> dmemValue = CPU -> R[rt];
+        StoreWord(CPU, CPU -> dmemAddr, CPU -> R[rt]); // store rt in datamem
+        if (CPU -> devicePage[CPU -> dmemAddr >> 8] & (DEVICE_HOOK_STORE | WATCH_HOOK_STORE)) { // device, video memory or watched page
+            hook = StoreHook(CPU, CPU -> dmemAddr);
+        }
+
+        WriteOut(CPU, output); // Write output into file
+        CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+        return hook ? 2 : 0; // 2: watchpoint hit
+
+    case H_RTI: // RTI
+        CPU -> rdMux_CTL = 0; // set RD control signal to 0
+        CPU -> rsMux_CTL = 0; // set RS control signal to 0
+        CPU -> rtMux_CTL = 0; // set RT control signal to 0
+        CPU -> regFile_WE = 0; // set register file write enable to 0
+        CPU -> NZP_WE = 0; // set NZP write enable to 1
+        CPU -> DATA_WE = 0; // set data write enable to 0
+
+        CPU -> dmemAddr = 0; // set dmemAddr to 0
+        CPU -> dmemValue = 0; // set dmemValue to 0
+
+        CPU -> PSR  = CPU -> PSR & (0x7FFF); // PSR[15] = 0
+
+        WriteOut(CPU, output); // Write output into file
+        CPU -> PC = CPU -> R[7]; // PC = R7
+        return 0;
+
+    case H_CONST: // constant
+        rd = insn -> rd; // get rd
+
+        if (rd > 7) { // Invalid registers
+            fprintf(stderr, "error: Invalid registers\n");
+            CPU -> PC = 0x80FF;
             return 0;
-            
-        } else { // Error
-            fprintf(stderr, "error: Invalid Opcode\n");
+        }
+
+        CPU -> rdMux_CTL = 0; // set RD control signal to 0
+        CPU -> rsMux_CTL = 0; // set RS control signal to 0
+        CPU -> rtMux_CTL = 0; // set RT control signal to 0
+        CPU -> regFile_WE = 1; // set register file write enable to 0
+        CPU -> NZP_WE = 1; // set NZP write enable to 1
+        CPU -> DATA_WE = 0; // set data write enable to 0
+
+        CPU -> dmemAddr = 0; // set dmemAddr to 0
+        CPU -> dmemValue = 0; // set dmemValue to 0
+
+        CPU -> R[rd] = insn -> imm; // RD = sext(IMM9)
+        CPU -> regInputVal = rd; // Store register number
+        SetNZP(CPU, CPU -> R[rd]); // Set NZP based on result
+
+        WriteOut(CPU, output); // Write output into file
+        CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+        return 0;
+
+    case H_SLL: case H_SRA: case H_SRL: case H_MOD: // shift
+        ShiftModOp(CPU, insn, output); // Run Shift Parser
+        return 0;
+
+    case H_JMPR: case H_JMP: // jump
+        JumpOp(CPU, insn, output); // Run Jump Parser
+        return 0;
+
+    case H_HICONST: // hi-constant
+        rd = insn -> rd; // get rd
+
+        if (rd > 7) { // Invalid registers
+            fprintf(stderr, "error: Invalid registers\n");
             CPU -> PC = 0x80FF;
             return 0;
         }
-        
-        CPU -> PC = CPU -> PC + 1; // PC = PC + 1 by default
+
+        CPU -> rdMux_CTL = 0; // set RD control signal to 0
+        CPU -> rsMux_CTL = 0; // set RS control signal to 0
+        CPU -> rtMux_CTL = 0; // set RT control signal to 0
+        CPU -> regFile_WE = 1; // set register file write enable to 0
+        CPU -> NZP_WE = 1; // set NZP write enable to 1
+        CPU -> DATA_WE = 0; // set data write enable to 0
+
+        CPU -> dmemAddr = 0; // set dmemAddr to 0
+        CPU -> dmemValue = 0; // set dmemValue to 0
+
+        CPU -> R[rd] = (CPU -> R[rd] & 0xFF) | insn -> imm; // RD = RD & 0xFF | UIMM8 << 8
+        CPU -> regInputVal = rd; // Store register number
+        SetNZP(CPU, CPU -> R[rd]); // Set NZP based on result
+
+        WriteOut(CPU, output); // Write output into file
+        CPU -> PC = CPU -> PC + 1; // PC = PC + 1
+        return 0;
+
+    case H_TRAP: // TRAP
+        rd = 0x7; // get rd = 7
+        if (CPU -> profile != NULL) { // call edge for --profile
+            ProfileCall(CPU -> profile, CPU -> PC, insn -> target);
+        }
+
+        CPU -> rdMux_CTL = 1; // set RD control signal to 1
+        CPU -> rsMux_CTL = 0; // set RS control signal to 0
+        CPU -> rtMux_CTL = 0; // set RT control signal to 0
+        CPU -> regFile_WE = 1; // set register file write enable to 0
+        CPU -> NZP_WE = 1; // set NZP write enable to 1
+        CPU -> DATA_WE = 0; // set data write enable to 0
+
+        CPU -> dmemAddr = 0; // set dmemAddr to 0
+        CPU -> dmemValue = 0; // set dmemValue to 0
+
+        CPU -> R[rd] = CPU -> PC + 1; // R7 = PC + 1
+        CPU -> regInputVal = rd; // Store register number
+        SetNZP(CPU, CPU -> R[rd]); // Set NZP based on result
+
+        CPU -> PSR = CPU -> PSR | (0x8000); // PSR[15] = 1
+
+        WriteOut(CPU, output); // Write output into file
+        CPU -> PC = insn -> target; // PC = (0x8000 | uIMM8)
+        if (CPU -> hle) { // the routine runs natively and returns (no trace lines)
+            HleTrap(CPU);
+        }
         return 0;
     }
-    
+
+    CPU -> PC = CPU -> PC + 1; // PC = PC + 1 by default
+    return 0;
+}
+
+
+
+/*
+ * Branch condition for NZP mask against the PSR, same truth table as BranchOp.
+ */
+static inline int BranchTaken(unsigned short mask, unsigned short PSR)
+{
+    unsigned short nzp = INSN_2_0(PSR); // current NZP bits
+
+    return (mask == 7) || (((0x16 >> nzp) & 1) && (mask & nzp)); // BRnzp always, else one-hot NZP match
+}
+
+
+#if defined(__GNUC__)
+#define LC4_THREADED 1 // computed goto ("labels as values") is available
+#endif
+
+/*
+ * Threaded interpreter. Each handler dispatches straight to the next one, so
+ * control only comes back to the caller on halt or when the budget runs out.
+ */
+#define RUN_NAME RunUntilHalt
+#define RUN_BLOCK_LENGTH() 1
+#define RUN_TRACE 1
+#include "LC4_exec.h"
+#undef RUN_NAME
+#undef RUN_BLOCK_LENGTH
+#undef RUN_TRACE
+
+/*
+ * Basic-block interpreter. Same handlers, but a cached block runs start to end
+ * with its fetch checks already done when the block was formed.
+ */
+#define RUN_NAME RunBlocks
+#define RUN_BLOCK_LENGTH() (CPU -> blockLength[CPU -> PC] ? CPU -> blockLength[CPU -> PC] : FormBlock(CPU, CPU -> PC))
+#define RUN_TRACE 1
+#include "LC4_exec.h"
+#undef RUN_NAME
+#undef RUN_TRACE
+
+/*
+ * The same basic-block interpreter built without tracing (wrapped by RunUntraced).
+ */
+#define RUN_NAME RunBlocksUntraced
+#define RUN_TRACE 0
+static int RunBlocksUntraced(MachineState* CPU, FILE* output, unsigned long long budget);
+#include "LC4_exec.h"
+#undef RUN_NAME
+#undef RUN_TRACE
+#undef RUN_BLOCK_LENGTH
+
+
+/*
+ * Untraced run on the lean loop. Until the first change of the NZP bits NZPVal
+ * can still disagree with them (a state loaded by --resume-from, or a PSR
+ * written by GDB's G and P packets), and only the eager loop knows whether
+ * that change happens; so short eager runs go first until the two agree.
+ */
+int RunUntraced(MachineState* CPU, unsigned long long budget)
+{
+    unsigned long long remaining = budget; // 0 = no limit
+    unsigned long long chunk = 0; // instructions in the next eager run
+    unsigned short nzp = 0; // current NZP bits
+    int status = 0;
+
+    for (;;) {
+        nzp = INSN_2_0(CPU -> PSR);
+        if (!((0x17 >> nzp) & 1) || CPU -> NZPVal == nzp) { // corrupt NZP never changes, or in agreement
+            return RunBlocksUntraced(CPU, NULL, remaining);
+        }
+
+        chunk = (budget != 0 && remaining < 64) ? remaining : 64;
+        status = RunBlocks(CPU, NULL, chunk);
+        if (status != 0) {
+            return status;
+        }
+        if (budget != 0) {
+            remaining -= chunk;
+            if (remaining == 0) {
+                return 0;
+            }
+        }
+    }
 }
 
 
@@ -439,15 +836,17 @@ int UpdateMachineState(MachineState* CPU, FILE* output)
 /*
  * Parses rest of branch operation and updates state of machine.
  */
-void BranchOp(MachineState* CPU, FILE* output)
+void BranchOp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
     // Check what we are testing for (N, Z, P, or combination)
     // Compare with current NZP value and update PC value
-    unsigned short subOp = INSN_11_9(CPU -> memory[CPU -> PC]); // get sub-opcode
-    short offset = INSN_8_0(CPU -> memory[CPU -> PC]);
-    
-    if (offset >> 8 == 1) { // Sign extend
-        offset = offset | 0xFE00;
+    unsigned short subOp = insn -> rd; // get sub-opcode (NZP mask)
+
+    if (CPU -> profile != NULL && insn -> handler != H_NOP) { // branch counts for --profile
+        CPU -> profile -> branches[CPU -> PC]++;
+        if (BranchTaken(subOp, CPU -> PSR)) {
+            CPU -> profile -> taken[CPU -> PC]++;
+        }
     }
     
     CPU -> rdMux_CTL = 0; // set RD control signal to 0
@@ -467,7 +866,7 @@ void BranchOp(MachineState* CPU, FILE* output)
     } else if (subOp == 1) { // BRp
         if (INSN_2_0(CPU -> PSR) == 1) {
             WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1 + offset;
+            CPU -> PC = insn -> target;
         } else {
             WriteOut(CPU, output); // Write output into file
             CPU -> PC = CPU -> PC + 1;
@@ -476,7 +875,7 @@ void BranchOp(MachineState* CPU, FILE* output)
     } else if (subOp == 2) { // BRz
         if (INSN_2_0(CPU -> PSR) == 2) {
             WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1 + offset;
+            CPU -> PC = insn -> target;
         } else {
             WriteOut(CPU, output); // Write output into file
             CPU -> PC = CPU -> PC + 1;
@@ -485,7 +884,7 @@ void BranchOp(MachineState* CPU, FILE* output)
     } else if (subOp == 3) { // BRzp
         if (INSN_2_0(CPU -> PSR) == 1 || INSN_2_0(CPU -> PSR) == 2) {
             WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1 + offset;
+            CPU -> PC = insn -> target;
         } else {
             WriteOut(CPU, output); // Write output into file
             CPU -> PC = CPU -> PC + 1;
@@ -494,7 +893,7 @@ void BranchOp(MachineState* CPU, FILE* output)
     } else if (subOp == 4) { // BRn
         if (INSN_2_0(CPU -> PSR) == 4) {
             WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1 + offset;
+            CPU -> PC = insn -> target;
         } else {
             WriteOut(CPU, output); // Write output into file
             CPU -> PC = CPU -> PC + 1;
@@ -503,7 +902,7 @@ void BranchOp(MachineState* CPU, FILE* output)
     } else if (subOp == 5) { // BRnp
        if (INSN_2_0(CPU -> PSR) == 1 || INSN_2_0(CPU -> PSR) == 4) {
            WriteOut(CPU, output); // Write output into file
-           CPU -> PC = CPU -> PC + 1 + offset;
+           CPU -> PC = insn -> target;
         } else {
            WriteOut(CPU, output); // Write output into file
            CPU -> PC = CPU -> PC + 1;
@@ -512,7 +911,7 @@ void BranchOp(MachineState* CPU, FILE* output)
     } else if (subOp == 6) { // BRnz
         if (INSN_2_0(CPU -> PSR) == 2 || INSN_2_0(CPU -> PSR) == 4) {
             WriteOut(CPU, output); // Write output into file
-            CPU -> PC = CPU -> PC + 1 + offset;
+            CPU -> PC = insn -> target;
         } else {
             WriteOut(CPU, output); // Write output into file
             CPU -> PC = CPU -> PC + 1;
@@ -520,7 +919,7 @@ void BranchOp(MachineState* CPU, FILE* output)
         
     } else if (subOp == 7) { // BRnzp
         WriteOut(CPU, output); // Write output into file
-        CPU -> PC = CPU -> PC + 1 + offset;
+        CPU -> PC = insn -> target;
         
     } 
     
@@ -529,18 +928,15 @@ void BranchOp(MachineState* CPU, FILE* output)
 /*
  * Parses rest of arithmetic operation and prints out.
  */
-void ArithmeticOp(MachineState* CPU, FILE* output)
+void ArithmeticOp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
     // Determine sub-opcode
     // Update register values based on sub-opcode values
-    unsigned short subOp = INSN_5_3(CPU -> memory[CPU -> PC]); // get sub-opcode
-    unsigned short rd = INSN_11_9(CPU -> memory[CPU -> PC]); // get rd number
-    unsigned short rs = INSN_8_6(CPU -> memory[CPU -> PC]); // get rs number
-    unsigned short rt = INSN_2_0(CPU -> memory[CPU -> PC]); // get rt number
-    short imm5 = INSN_4_0(CPU -> memory[CPU -> PC]); // get imm5
-    if (imm5 >> 4 == 1) {
-        imm5 = imm5 | 0xFFE0;
-    }
+    unsigned short subOp = insn -> handler - H_ADD; // get sub-opcode
+    unsigned short rd = insn -> rd; // get rd number
+    unsigned short rs = insn -> rs; // get rs number
+    unsigned short rt = insn -> rt; // get rt number
+    short imm5 = insn -> imm; // get sext(imm5)
     
     if (rd > 7 | rs > 7 | rt > 7) { // Invalid registers
         fprintf(stderr, "error: Invalid registers\n");
@@ -584,21 +980,17 @@ void ArithmeticOp(MachineState* CPU, FILE* output)
 /*
  * Parses rest of comparative operation and prints out.
  */
-void ComparativeOp(MachineState* CPU, FILE* output)
+void ComparativeOp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
     // Determine sub-opcode and set NZP value based on contents
-    unsigned short subOp = ((CPU -> memory[CPU -> PC]) >> 7) & 0x3; // Get I[8:7]
-    unsigned short rs = INSN_11_9(CPU -> memory[CPU -> PC]); // Get rs
-    unsigned short rt = INSN_2_0(CPU -> memory[CPU -> PC]); // Get rt
-    short imm7 = INSN_6_0(CPU -> memory[CPU -> PC]); // Get IMM7
-    unsigned short uimm7 = INSN_6_0(CPU -> memory[CPU -> PC]); // Get UIMM7
+    unsigned short subOp = insn -> handler - H_CMP; // Get I[8:7]
+    unsigned short rs = insn -> rd; // Get rs (I[11:9])
+    unsigned short rt = insn -> rt; // Get rt
+    short imm7 = insn -> imm; // Get sext(IMM7)
+    unsigned short uimm7 = insn -> imm; // Get UIMM7
     unsigned int uRS = CPU -> R[rs]; // unsigned RS value
     unsigned int uRT = CPU -> R[rt]; // unsigned RT value
     
-    if (imm7 >> 6 == 1) { // Sign Extend
-        imm7 = imm7 | 0xFF80;
-    }
-    
     if (rs > 7 | rt > 7) { // Invalid registers
         fprintf(stderr, "error: Invalid registers\n");
         CPU -> PC = 0x80FF;
@@ -638,18 +1030,15 @@ void ComparativeOp(MachineState* CPU, FILE* output)
 /*
  * Parses rest of logical operation and prints out.
  */
-void LogicalOp(MachineState* CPU, FILE* output)
+void LogicalOp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
     // Determine sub-opcode
     // Set specified register based on contents and operation
-    unsigned short subOp = INSN_5_3(CPU -> memory[CPU -> PC]); // get sub-opcode
-    unsigned short rd = INSN_11_9(CPU -> memory[CPU -> PC]); // get rd number
-    unsigned short rs = INSN_8_6(CPU -> memory[CPU -> PC]); // get rs number
-    unsigned short rt = INSN_2_0(CPU -> memory[CPU -> PC]); // get rt number
-    int imm5 = INSN_4_0(CPU -> memory[CPU -> PC]); // IMM5
-    if (imm5 >> 4 == 1) {
-        imm5 = imm5 | 0xFFE0;
-    }
+    unsigned short subOp = insn -> handler - H_AND; // get sub-opcode
+    unsigned short rd = insn -> rd; // get rd number
+    unsigned short rs = insn -> rs; // get rs number
+    unsigned short rt = insn -> rt; // get rt number
+    int imm5 = insn -> imm; // sext(IMM5)
     
     if (rd > 7 | rs > 7 | rt > 7) { // Invalid registers
         fprintf(stderr, "error: Invalid registers\n");
@@ -695,10 +1084,10 @@ void LogicalOp(MachineState* CPU, FILE* output)
 /*
  * Parses rest of jump operation and prints out.
  */
-void JumpOp(MachineState* CPU, FILE* output)
+void JumpOp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
-    unsigned short subOp = (CPU -> memory[CPU -> PC] >> 11) & (0x1); // Get subOp
-    unsigned short rs = INSN_8_6(CPU -> memory[CPU -> PC]); // Get RS
+    unsigned short subOp = (insn -> handler == H_JMP); // Get subOp
+    unsigned short rs = insn -> rs; // Get RS
     
     if (rs > 7) { // Invalid registers
         fprintf(stderr, "error: Invalid registers\n");
@@ -725,7 +1114,7 @@ void JumpOp(MachineState* CPU, FILE* output)
     } else { // Immediate
         
         WriteOut(CPU, output); // Write output into file
-        CPU -> PC = CPU -> PC + 1 + INSN_10_0(CPU -> memory[CPU -> PC]);
+        CPU -> PC = insn -> target; // PC + 1 + IMM11
         
     }
 }
@@ -733,16 +1122,20 @@ void JumpOp(MachineState* CPU, FILE* output)
 /*
  * Parses rest of JSR operation and prints out.
  */
-void JSROp(MachineState* CPU, FILE* output)
+void JSROp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
-    unsigned short subOp = (CPU -> memory[CPU -> PC] >> 11) & (0x1); // Get subOp
-    unsigned short rs = INSN_8_6(CPU -> memory[CPU -> PC]); // Get RS
+    unsigned short subOp = (insn -> handler == H_JSR); // Get subOp
+    unsigned short rs = insn -> rs; // Get RS
     
     if (rs > 7) { // Invalid registers
         fprintf(stderr, "error: Invalid registers\n");
         CPU -> PC = 0x80FF;
         return;
     }
+
+    if (CPU -> profile != NULL) { // call edge for --profile
+        ProfileCall(CPU -> profile, CPU -> PC, (subOp == 1) ? insn -> target : CPU -> R[rs]);
+    }
     
     CPU -> rdMux_CTL = 1; // set RD control signal to 7
     CPU -> rsMux_CTL = 0; // set RS control signal to 0
@@ -758,7 +1151,7 @@ void JSROp(MachineState* CPU, FILE* output)
         CPU -> R[7] = CPU -> PC;
         
         WriteOut(CPU, output); // Write output into file
-        CPU -> PC = (CPU -> PC & 0x8000) | INSN_10_0(CPU -> memory[CPU -> PC] << 4);
+        CPU -> PC = insn -> target; // (PC & 0x8000) | IMM11 << 4
         
     } else { // Register
         CPU -> R[7] = CPU -> PC;
@@ -773,13 +1166,13 @@ void JSROp(MachineState* CPU, FILE* output)
 /*
  * Parses rest of shift/mod operations and prints out.
  */
-void ShiftModOp(MachineState* CPU, FILE* output)
+void ShiftModOp(MachineState* CPU, DecodedInsn* insn, FILE* output)
 {
-    unsigned short subOp = ((CPU -> memory[CPU -> PC]) >> 4) & 0x3; // Get I[6:5]
-    unsigned short rd = INSN_11_9(CPU -> memory[CPU -> PC]); // get rd number
-    unsigned short rs = INSN_8_6(CPU -> memory[CPU -> PC]); // get rs number
-    unsigned short rt = INSN_2_0(CPU -> memory[CPU -> PC]); // get rt number
-    unsigned short u4 = INSN_3_0(CPU -> memory[CPU -> PC]); // UIMM4
+    unsigned short subOp = insn -> handler - H_SLL; // Get I[5:4]
+    unsigned short rd = insn -> rd; // get rd number
+    unsigned short rs = insn -> rs; // get rs number
+    unsigned short rt = insn -> rt; // get rt number
+    unsigned short u4 = insn -> imm; // UIMM4
     
     if (rd > 7 | rs > 7 | rt > 7) { // Invalid registers
         fprintf(stderr, "error: Invalid registers\n");
@@ -825,44 +1218,5 @@ void ShiftModOp(MachineState* CPU, FILE* output)
  */
 void SetNZP(MachineState* CPU, short result)
 {
-    unsigned short currNZP = INSN_2_0(CPU -> PSR); // Get current NZP value of PSR
-    if (result < 0) { // negative value
-        if (currNZP == 1) { // P bit = 1
-            CPU -> PSR -= 1; // remove P bit
-            CPU -> PSR += 4; // add N bit
-        } else if (currNZP == 2) { // Z bit = 1
-            CPU -> PSR -= 2; // remove Z bit
-            CPU -> PSR += 4; // add N bit
-        } else if (currNZP == 0) { // reset
-            CPU -> PSR += 4; // add N bit
-        } else {
-            return; // nothing to adjust
-        }
-    } else if (result > 0) { // positive value
-        if (currNZP == 4) { // N bit = 1
-            CPU -> PSR -= 4; // remove N bit
-            CPU -> PSR += 1; // add P bit
-        } else if (currNZP == 2) { // Z bit = 1
-            CPU -> PSR -= 2; // remove Z bit
-            CPU -> PSR += 1; // add P bit
-        } else if (currNZP == 0) { // reset
-            CPU -> PSR += 1; // add P bit
-        } else {
-            return; // nothing to adjust
-        }
-    } else { // zero value
-        if (currNZP == 4) { // N bit = 1
-            CPU -> PSR -= 4; // remove N bit
-            CPU -> PSR += 2; // add Z bit
-        } else if (currNZP == 1) { // P bit = 1
-            CPU -> PSR -= 1; // remove P bit
-            CPU -> PSR += 2; // add Z bit
-        } else if (currNZP == 0) { // reset
-            CPU -> PSR += 2; // add Z bit
-        } else {
-            return; // nothing to adjust
-        }
-    }
-    
-    CPU -> NZPVal = INSN_2_0(CPU -> PSR); // Set new NZPVal
+    UpdateNZP(CPU, result);
 }
@@ -2,10 +2,38 @@
  * LC4.h: Declares simulator functions for executing instructions
  */
 
+#ifndef LC4_H
+#define LC4_H
+
 #include "string.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+// Handler ids for predecoded instructions (H_UNDECODED must stay 0 so a zeroed table is empty)
+enum {
+    H_UNDECODED = 0,
+    H_NOP, H_BRP, H_BRZ, H_BRZP, H_BRN, H_BRNP, H_BRNZ, H_BRNZP,
+    H_ADD, H_MUL, H_SUB, H_DIV, H_ADDI,
+    H_CMP, H_CMPU, H_CMPI, H_CMPIU,
+    H_JSRR, H_JSR,
+    H_AND, H_NOT, H_OR, H_XOR, H_ANDI, H_LOGIC_NONE,
+    H_LDR, H_STR, H_RTI, H_CONST,
+    H_SLL, H_SRA, H_SRL, H_MOD,
+    H_JMPR, H_JMP, H_HICONST, H_TRAP,
+    H_INVALID, H_DATA_FETCH, H_BREAK,
+    H_COUNT
+};
+
+// Compact decoded form of one instruction word
+typedef struct {
+    unsigned char handler; // H_* id
+    unsigned char rd; // I[11:9] (RD, RT for STR, RS for CMP, NZP mask for BR)
+    unsigned char rs; // I[8:6]
+    unsigned char rt; // I[2:0]
+    unsigned short imm; // immediate, already sign extended to 16 bits
+    unsigned short target; // precomputed branch/jump target
+} DecodedInsn;
+
 typedef struct {
     // PC the current value of the Program Counter register
     unsigned short int PC;
@@ -35,15 +63,104 @@ typedef struct {
 
     // Machine memory - all of it
     unsigned short int memory[65536];
+
+    // Predecoded instructions, parallel to memory (entry is stale once its word is written)
+    DecodedInsn decoded[65536];
+
+    // Basic-block cache: length of the block starting at each address (0 = none formed)
+    unsigned char blockLength[65536];
+
+    // Set for every 256-word page that holds part of a cached block
+    unsigned char blockPage[256];
+
+    // Memory map: PERM_* bits of each 256-word page (see DefaultMemoryMap)
+    unsigned char pagePerm[256];
+
+    // DEVICE_HOOK_* and WATCH_HOOK_* bits of each 256-word page: which LDR/STR
+    // go through the devices or the watchpoints (all 0 without, see devices.h and debug.h)
+    unsigned char devicePage[256];
+
+    // Number of times a store dropped cached blocks (lets other code caches notice)
+    unsigned long long blockFlushes;
+
+    // Instructions executed so far (by UpdateMachineState and every run loop)
+    unsigned long long instructions;
+
+    // Trace sink WriteOut goes through when set (NULL = fprintf straight to the output file)
+    struct TraceWriter* trace;
+
+    // Per-PC counters the step engine fills when set (--profile, see profile.h)
+    struct Profile* profile;
+
+    // Undo log the step engine records into when set (--reverse, see reverse.h)
+    struct Reverse* reverse;
+
+    // Labels ReadObjectFile collects from symbol sections when set (see loader.h)
+    struct SymbolTable* symbols;
+
+    // Memory-mapped devices behind the hooked pages when set (--devices, --frames)
+    struct Devices* devices;
+
+    // Run known OS TRAP routines natively instead of instruction by instruction (--hle, see hle.h)
+    unsigned char hle;
+
+    // Breakpoints and watchpoints when set (--gdb, see debug.h)
+    struct Debugger* debugger;
 } MachineState;
 
+// Longest basic block the block cache will form
+#define MAX_BLOCK_LENGTH 64
+
+// Page permission bits: these apply in user mode, and the same bits shifted
+// left by PERM_OS_SHIFT apply while PSR[15] = 1
+#define PERM_READ 0x1
+#define PERM_WRITE 0x2
+#define PERM_EXEC 0x4
+#define PERM_OS_SHIFT 4
+#define PERM_ANY(BITS) ((BITS) | ((BITS) << PERM_OS_SHIFT)) // BITS in either mode
+
+// Whether the page holding address grants BITS at the privilege in PSR
+#define PAGE_ALLOWS(CPU, PSR, ADDRESS, BITS) \
+    ((CPU) -> pagePerm[(unsigned short)(ADDRESS) >> 8] & ((BITS) << (((PSR) >> 15) * PERM_OS_SHIFT)))
+
 
 /*
- * This function should execute one LC4 datapath cycle.
+ * This function should execute one LC4 datapath cycle. Returns 1 once the PC
+ * is 0x80FF, 2 if a breakpoint at the PC kept the instruction from running or
+ * a watchpoint it triggered asks to stop after it (see debug.h), 0 otherwise.
  */
 int UpdateMachineState(MachineState* CPU, FILE* output);
 
 
+/*
+ * Run until the PC reaches 0x80FF (halt or error) or budget instructions have
+ * executed (budget 0 = no limit). Traces are identical to calling
+ * UpdateMachineState in a loop. Returns 1 on halt, 0 if the budget ran out,
+ * 2 on a breakpoint or watchpoint stop as UpdateMachineState does.
+ */
+int RunUntilHalt(MachineState* CPU, FILE* output, unsigned long long budget);
+
+
+/*
+ * Same contract as RunUntilHalt, but executes whole cached basic blocks.
+ */
+int RunBlocks(MachineState* CPU, FILE* output, unsigned long long budget);
+
+
+/*
+ * Same contract as RunBlocks, on a loop built without tracing: no output, no
+ * control signal bookkeeping, and NZP bits only computed when a branch needs
+ * them (and before returning).
+ */
+int RunUntraced(MachineState* CPU, unsigned long long budget);
+
+
+/*
+ * Form and cache the basic block starting at pc, returning its length.
+ */
+int FormBlock(MachineState* CPU, unsigned short pc);
+
+
 /*
  * This function should write out the current state of the CPU to the file output.
  */
@@ -51,45 +168,47 @@ void WriteOut(MachineState* CPU, FILE* output);
 
 
 /*
- * This handles BRANCH instructions.
+ * This handles BRANCH instructions. Like the other handlers below, it runs
+ * insn, the instruction UpdateMachineState decoded at the PC (under a
+ * breakpoint, the word itself rather than the H_BREAK entry).
  */
-void BranchOp(MachineState* CPU, FILE* output);
+void BranchOp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
  * This handles ARITHMETIC instructions.
  */
-void ArithmeticOp(MachineState* CPU, FILE* output);
+void ArithmeticOp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
  * This handles COMPARATIVE instructions.
  */
-void ComparativeOp(MachineState* CPU, FILE* output);
+void ComparativeOp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
  * This handles LOGICAL instructions.
  */
-void LogicalOp(MachineState* CPU, FILE* output);
+void LogicalOp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
  * This handles JUMP instructions.
  */
-void JumpOp(MachineState* CPU, FILE* output);
+void JumpOp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
  * This handles JSR instructions.
  */
-void JSROp(MachineState* CPU, FILE* output);
+void JSROp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
  * This handles SHIFT instructions.
  */
-void ShiftModOp(MachineState* CPU, FILE* output);
+void ShiftModOp(MachineState* CPU, DecodedInsn* insn, FILE* output);
 
 
 /*
@@ -98,13 +217,55 @@ void ShiftModOp(MachineState* CPU, FILE* output);
 void SetNZP(MachineState* CPU, short result);
 
 
+/*
+ * Decode the instruction word found at address pc (whether or not the memory
+ * map lets it be fetched there).
+ */
+void DecodeInsn(unsigned short pc, unsigned short word, DecodedInsn* insn);
+
+
+/*
+ * Return the predecoded instruction at the current PC, decoding it on first use.
+ */
+DecodedInsn* FetchDecoded(MachineState* CPU);
+
+
+/*
+ * Write a word into memory and drop its predecoded entry (and any cached block holding it).
+ */
+void StoreWord(MachineState* CPU, unsigned short address, unsigned short value);
+
+
+/*
+ * Drop predecoded entries and cached blocks for count words starting at
+ * address that were written into memory directly (bulk loads).
+ */
+void InvalidateWords(MachineState* CPU, unsigned short address, int count);
+
+
 /*
  * Reset the machine state as Pennsim would do
  */
 void Reset(MachineState* CPU);
 
 
+/*
+ * Install the standard LC4 memory map (Reset does): code at x0000-x1FFF and
+ * x8000-x9FFF, user data at x2000-x7FFF, OS-only data at xA000-xFFFF.
+ */
+void DefaultMemoryMap(MachineState* CPU);
+
+
+/*
+ * Install the 256 PERM_* bytes of pages as the memory map, dropping decoded
+ * instructions and cached blocks if it changed.
+ */
+void SetMemoryMap(MachineState* CPU, const unsigned char* pages);
+
+
 /*
  * Clear all of the internal values (set to 0)
  */
 void ClearSignals(MachineState* CPU);
+
+#endif
@@ -0,0 +1,435 @@
+/*
+ * LC4_exec.h: Body of the threaded interpreter loop. LC4.c includes this file
+ * once per run loop, with RUN_NAME set to the function to define,
+ * RUN_BLOCK_LENGTH() giving how many instructions to run from the current PC
+ * before the next full dispatch (1 = plain instruction-at-a-time) and
+ * RUN_TRACE set to 1 for a traced loop or 0 for the lean untraced one.
+ *
+ * The untraced loop skips WriteOut and all control signal, regInputVal and
+ * dmemAddr/dmemValue bookkeeping (those fields are left as they were), and
+ * only remembers the last flag-producing result: the PSR NZP bits are brought
+ * up to date before a branch reads them and when the loop returns. UpdateNZP
+ * only ever keeps the last result, so this matches the traced loop as long as
+ * NZPVal agrees with the NZP bits on entry (see RunUntraced).
+ */
+
+#if RUN_TRACE
+#define TRACED(STATEMENT) STATEMENT
+#define SET_NZP(RESULT) UpdateNZP(CPU, (RESULT))
+#define FLAGS()
+#define WRITE_OUT() WriteOut(CPU, output)
+#else
+#define TRACED(STATEMENT)
+#define SET_NZP(RESULT) nzpResult = (short int)(RESULT); nzpPending = 1
+#define FLAGS() if (nzpPending) { UpdateNZP(CPU, nzpResult); nzpPending = 0; }
+#define WRITE_OUT()
+#endif
+
+// Control signal / data memory settings shared by the threaded handlers
+#define SIGNALS(RD, RS, RT, REG_WE, NZP_WE_, DATA_WE_) TRACED( \
+    CPU -> rdMux_CTL = (RD); CPU -> rsMux_CTL = (RS); CPU -> rtMux_CTL = (RT); \
+    CPU -> regFile_WE = (REG_WE); CPU -> NZP_WE = (NZP_WE_); CPU -> DATA_WE = (DATA_WE_))
+#define NO_DMEM() TRACED(CPU -> dmemAddr = 0; CPU -> dmemValue = 0)
+
+// Leave the loop, counting the instructions run
+#define RETURN(STATUS) { FLAGS(); CPU -> instructions += start - remaining; return (STATUS); }
+
+// Bring CPU -> instructions up to date mid-run (this instruction included),
+// going on counting from here
+#define SYNC_COUNT() { \
+    CPU -> instructions += start - remaining - (blockLeft - 1); start = remaining + (blockLeft - 1); }
+
+// Write RD (and NZP) the way the ALU helpers do, trace, then fall through to PC + 1
+#define WRITE_RD(VALUE) \
+    R[insn -> rd] = (VALUE); TRACED(CPU -> regInputVal = insn -> rd); SET_NZP(R[insn -> rd])
+
+// Start the next block (or single instruction). Any part of the current block
+// that was skipped by an early exit is refunded to the budget first. Blocks
+// never span pages with different permissions, so checking that the current
+// privilege may fetch from the first one covers the whole block.
+#define ENTER() \
+    if (blockLeft > 1) remaining += blockLeft - 1; \
+    if (CPU -> PC == 0x80FF) RETURN(1) \
+    if (remaining == 0) RETURN(0) \
+    blockLeft = RUN_BLOCK_LENGTH(); \
+    if (blockLeft > remaining) blockLeft = 1; \
+    remaining -= blockLeft; \
+    insn = Decoded(CPU); \
+    if (!PAGE_ALLOWS(CPU, CPU -> PSR, CPU -> PC, PERM_EXEC) && insn -> handler != H_INVALID) insn = &fetchFault
+
+#ifdef LC4_THREADED
+#define HANDLER(H) L_##H:
+#define DISPATCH() do { ENTER(); goto *labels[insn -> handler]; } while (0)
+#define CHAIN() goto *labels[insn -> handler]
+#else
+#define HANDLER(H) case H:
+#define DISPATCH() continue
+#define CHAIN() goto chain
+#endif
+
+// Straight-line instructions inside a block chain to the next decoded entry
+// without the halt/budget/decode bookkeeping of a full dispatch.
+#define NEXT_PC() \
+    CPU -> PC = CPU -> PC + 1; \
+    if (blockLeft > 1) { blockLeft--; insn++; CHAIN(); } \
+    DISPATCH()
+
+
+int RUN_NAME(MachineState* CPU, FILE* output, unsigned long long budget)
+{
+    unsigned short* R = CPU -> R; // register file
+    unsigned long long remaining = (budget == 0) ? ~0ULL : budget; // instructions left
+    unsigned long long start = remaining; // for the instruction count
+    unsigned short address = 0; // LDR/STR data address
+    unsigned long long blockLeft = 1; // instructions left in the current block, this one included
+    int hook = 0; // LoadHook / StoreHook result
+    DecodedInsn* insn;
+#if !RUN_TRACE
+    short int nzpResult = 0; // last flag-producing result
+    int nzpPending = 0; // nzpResult not yet applied to the PSR
+
+    (void)output; // the untraced loop writes no trace lines
+#endif
+
+#ifdef LC4_THREADED
+    static void* labels[H_COUNT] = {
+        [H_UNDECODED] = &&L_H_INVALID,
+        [H_NOP] = &&L_H_NOP, [H_BRP] = &&L_H_BRP, [H_BRZ] = &&L_H_BRZ, [H_BRZP] = &&L_H_BRZP,
+        [H_BRN] = &&L_H_BRN, [H_BRNP] = &&L_H_BRNP, [H_BRNZ] = &&L_H_BRNZ, [H_BRNZP] = &&L_H_BRNZP,
+        [H_ADD] = &&L_H_ADD, [H_MUL] = &&L_H_MUL, [H_SUB] = &&L_H_SUB, [H_DIV] = &&L_H_DIV, [H_ADDI] = &&L_H_ADDI,
+        [H_CMP] = &&L_H_CMP, [H_CMPU] = &&L_H_CMPU, [H_CMPI] = &&L_H_CMPI, [H_CMPIU] = &&L_H_CMPIU,
+        [H_JSRR] = &&L_H_JSRR, [H_JSR] = &&L_H_JSR,
+        [H_AND] = &&L_H_AND, [H_NOT] = &&L_H_NOT, [H_OR] = &&L_H_OR, [H_XOR] = &&L_H_XOR,
+        [H_ANDI] = &&L_H_ANDI, [H_LOGIC_NONE] = &&L_H_LOGIC_NONE,
+        [H_LDR] = &&L_H_LDR, [H_STR] = &&L_H_STR, [H_RTI] = &&L_H_RTI, [H_CONST] = &&L_H_CONST,
+        [H_SLL] = &&L_H_SLL, [H_SRA] = &&L_H_SRA, [H_SRL] = &&L_H_SRL, [H_MOD] = &&L_H_MOD,
+        [H_JMPR] = &&L_H_JMPR, [H_JMP] = &&L_H_JMP, [H_HICONST] = &&L_H_HICONST, [H_TRAP] = &&L_H_TRAP,
+        [H_INVALID] = &&L_H_INVALID, [H_DATA_FETCH] = &&L_H_DATA_FETCH, [H_BREAK] = &&L_H_BREAK
+    };
+
+    DISPATCH();
+#else
+    for (;;) {
+        ENTER();
+chain:
+        switch (insn -> handler) {
+#endif
+
+    HANDLER(H_NOP)
+        SIGNALS(0, 0, 0, 0, 0, 0);
+        NO_DMEM();
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_BRP)
+    HANDLER(H_BRZ)
+    HANDLER(H_BRZP)
+    HANDLER(H_BRN)
+    HANDLER(H_BRNP)
+    HANDLER(H_BRNZ)
+    HANDLER(H_BRNZP)
+        SIGNALS(0, 0, 0, 0, 0, 0);
+        NO_DMEM();
+        WRITE_OUT();
+        FLAGS();
+        CPU -> PC = BranchTaken(insn -> rd, CPU -> PSR) ? insn -> target : CPU -> PC + 1;
+        DISPATCH();
+
+    HANDLER(H_ADD)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] + (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_MUL)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] * (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_SUB)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] - (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_DIV)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] / (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_ADDI)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] + (short int)insn -> imm);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_CMP)
+        SIGNALS(0, 2, 0, 0, 1, 0);
+        NO_DMEM();
+        SET_NZP((short int)R[insn -> rd] - (short int)R[insn -> rt]);
+        TRACED(CPU -> regInputVal = 0);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_CMPU)
+        SIGNALS(0, 2, 0, 0, 1, 0);
+        NO_DMEM();
+        SET_NZP((unsigned int)R[insn -> rd] - (unsigned int)R[insn -> rt]);
+        TRACED(CPU -> regInputVal = 0);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_CMPI)
+        SIGNALS(0, 2, 0, 0, 1, 0);
+        NO_DMEM();
+        SET_NZP((short int)R[insn -> rd] - (short int)insn -> imm);
+        TRACED(CPU -> regInputVal = 0);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_CMPIU)
+        SIGNALS(0, 2, 0, 0, 1, 0);
+        NO_DMEM();
+        SET_NZP((unsigned int)R[insn -> rd] - (unsigned int)insn -> imm);
+        TRACED(CPU -> regInputVal = 0);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_JSRR)
+        SIGNALS(1, 0, 0, 1, 0, 0);
+        NO_DMEM();
+        R[7] = CPU -> PC;
+        WRITE_OUT();
+        CPU -> PC = R[insn -> rs]; // read after R7 is written, as JSROp does
+        DISPATCH();
+
+    HANDLER(H_JSR)
+        SIGNALS(1, 0, 0, 1, 0, 0);
+        NO_DMEM();
+        R[7] = CPU -> PC;
+        WRITE_OUT();
+        CPU -> PC = insn -> target;
+        DISPATCH();
+
+    HANDLER(H_AND)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] & (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_NOT)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD(!(short int)R[insn -> rs]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_OR)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] | (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_XOR)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] ^ (short int)R[insn -> rt]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_ANDI)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((short int)R[insn -> rs] & insn -> imm);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_LOGIC_NONE)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD(R[insn -> rd]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_LDR)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        address = R[insn -> rs] + insn -> imm; // RS + sext(IMM6)
+        TRACED(CPU -> dmemAddr = address);
+        if (!PAGE_ALLOWS(CPU, CPU -> PSR, address, PERM_READ)) { // Bad values
+            fprintf(stderr, "error: Invalid Data Address\n");
+            CPU -> PC = 0x80FF;
+            DISPATCH();
+        }
+        if (CPU -> devicePage[address >> 8] & (DEVICE_HOOK_LOAD | WATCH_HOOK_LOAD)) { // device register (sees PSR and the count) or watched page
+            FLAGS();
+            SYNC_COUNT();
+            hook = LoadHook(CPU, address);
+            if (hook < 0) { // waits forever
+                CPU -> PC = 0x80FF;
+                DISPATCH();
+            }
+            if (hook > 0) { // watchpoint: finish the LDR and stop after it
+                TRACED(CPU -> dmemValue = CPU -> memory[address]);
+                WRITE_RD(CPU -> memory[address]);
+                WRITE_OUT();
+                CPU -> PC = CPU -> PC + 1;
+                remaining += blockLeft - 1;
+                RETURN(2);
+            }
+        }
+        TRACED(CPU -> dmemValue = CPU -> memory[address]);
+        WRITE_RD(CPU -> memory[address]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_STR)
+        SIGNALS(0, 0, 1, 0, 0, 1);
+        address = R[insn -> rs] + insn -> imm; // RS + sext(IMM6)
+        TRACED(CPU -> dmemAddr = address);
+        if (!PAGE_ALLOWS(CPU, CPU -> PSR, address, PERM_WRITE)) { // Bad values
+            fprintf(stderr, "error: Invalid Data Address\n");
+            CPU -> PC = 0x80FF;
+            DISPATCH();
+        }
+        TRACED(CPU -> dmemValue = R[insn -> rd]);
+        StoreWord(CPU, address, R[insn -> rd]);
+        if (CPU -> devicePage[address >> 8] & (DEVICE_HOOK_STORE | WATCH_HOOK_STORE)) { // device, video memory or watched page
+            if (StoreHook(CPU, address)) { // watchpoint: stop after the STR
+                WRITE_OUT();
+                CPU -> PC = CPU -> PC + 1;
+                remaining += blockLeft - 1;
+                RETURN(2);
+            }
+        }
+        WRITE_OUT();
+        if (CPU -> blockPage[address >> 8]) { // may have rewritten this block
+            CPU -> PC = CPU -> PC + 1;
+            DISPATCH();
+        }
+        NEXT_PC();
+
+    HANDLER(H_RTI)
+        SIGNALS(0, 0, 0, 0, 0, 0);
+        NO_DMEM();
+        CPU -> PSR = CPU -> PSR & 0x7FFF; // PSR[15] = 0
+        WRITE_OUT();
+        CPU -> PC = R[7];
+        DISPATCH();
+
+    HANDLER(H_CONST)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD(insn -> imm);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_SLL)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        R[insn -> rd] = R[insn -> rs] << insn -> imm;
+        TRACED(CPU -> regInputVal = R[insn -> rd]); // ShiftModOp records the value, not the register
+        SET_NZP(R[insn -> rd]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_SRA)
+    HANDLER(H_SRL)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        R[insn -> rd] = R[insn -> rs] >> insn -> imm; // both shift the zero-extended RS
+        TRACED(CPU -> regInputVal = R[insn -> rd]);
+        SET_NZP(R[insn -> rd]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_MOD)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        R[insn -> rd] = R[insn -> rs] % R[insn -> rt];
+        TRACED(CPU -> regInputVal = R[insn -> rd]);
+        SET_NZP(R[insn -> rd]);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_JMPR)
+        SIGNALS(0, 0, 0, 0, 0, 0);
+        NO_DMEM();
+        WRITE_OUT();
+        CPU -> PC = R[insn -> rs];
+        DISPATCH();
+
+    HANDLER(H_JMP)
+        SIGNALS(0, 0, 0, 0, 0, 0);
+        NO_DMEM();
+        WRITE_OUT();
+        CPU -> PC = insn -> target;
+        DISPATCH();
+
+    HANDLER(H_HICONST)
+        SIGNALS(0, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        WRITE_RD((R[insn -> rd] & 0xFF) | insn -> imm);
+        WRITE_OUT();
+        NEXT_PC();
+
+    HANDLER(H_TRAP)
+        SIGNALS(1, 0, 0, 1, 1, 0);
+        NO_DMEM();
+        R[7] = CPU -> PC + 1; // R7 = PC + 1
+        TRACED(CPU -> regInputVal = 7);
+        SET_NZP(R[7]);
+        CPU -> PSR = CPU -> PSR | 0x8000; // PSR[15] = 1
+        WRITE_OUT();
+        CPU -> PC = insn -> target; // PC = (0x8000 | uIMM8)
+        if (CPU -> hle) { // the routine runs natively and returns (no trace lines)
+            FLAGS();
+            HleTrap(CPU);
+        }
+        DISPATCH();
+
+    HANDLER(H_DATA_FETCH)
+        fprintf(stderr, "Error: Trying to Execute Code in Data Memory\n");
+        CPU -> PC = 0x80FF;
+        DISPATCH();
+
+    HANDLER(H_BREAK)
+        remaining += blockLeft; // neither this instruction nor the rest of the block ran
+        RETURN(2);
+
+    HANDLER(H_INVALID)
+#ifndef LC4_THREADED
+    default:
+#endif
+        fprintf(stderr, "error: Invalid Opcode\n");
+        CPU -> PC = 0x80FF;
+        DISPATCH();
+
+#ifndef LC4_THREADED
+        }
+    }
+#endif
+}
+
+#undef SIGNALS
+#undef NO_DMEM
+#undef WRITE_RD
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT_PC
+#undef ENTER
+#undef CHAIN
+#undef TRACED
+#undef RETURN
+#undef SYNC_COUNT
+#undef SET_NZP
+#undef FLAGS
+#undef WRITE_OUT
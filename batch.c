@@ -0,0 +1,557 @@
+/*
+ * batch.c: Lockstep engine running many instances of one program
+ */
+
+#include "batch.h"
+
+#define INSN_2_0(I) ((I) & 0x7)
+#define HALTED 0x80FF
+
+
+/*
+ * Same as UpdateNZP for one lane.
+ */
+static void LaneNZP(Batch* batch, int lane, short result)
+{
+    unsigned short currNZP = INSN_2_0(batch -> PSR[lane]);
+    unsigned short newNZP = (result < 0) ? 4 : ((result > 0) ? 1 : 2);
+
+    if ((0x17 >> currNZP) & 1) { // currNZP is 0, 1, 2 or 4
+        batch -> PSR[lane] = batch -> PSR[lane] - currNZP + newNZP;
+    }
+}
+
+
+/*
+ * Whether the memory map grants perm on address with the lane's privilege.
+ */
+static int LaneAddressValid(Batch* batch, int lane, unsigned short address, int perm)
+{
+    return PAGE_ALLOWS(batch -> image, batch -> PSR[lane], address, perm) != 0;
+}
+
+
+/*
+ * Stop a lane after an error: it halts and leaves the current step.
+ */
+static void LaneError(Batch* batch, int lane, const char* message)
+{
+    fprintf(stderr, "lane %d: %s\n", lane, message);
+    batch -> PC[lane] = HALTED;
+    batch -> mask[lane] = 0;
+}
+
+
+/*
+ * Execute the instruction at pc in one lane, with the semantics of the
+ * threaded interpreter. Control transfers set the lane's PC; for other
+ * instructions the caller advances it.
+ */
+static void StepLane(Batch* batch, int lane, unsigned short pc, const DecodedInsn* insn)
+{
+    unsigned short rs = batch -> R[insn -> rs][lane];
+    unsigned short rt = batch -> R[insn -> rt][lane];
+    unsigned short* rd = &batch -> R[insn -> rd & 7][lane];
+    unsigned short nzp = INSN_2_0(batch -> PSR[lane]);
+    unsigned short address = 0;
+
+    switch (insn -> handler) {
+    case H_NOP:
+        return;
+
+    case H_BRP: case H_BRZ: case H_BRZP: case H_BRN: case H_BRNP: case H_BRNZ: case H_BRNZP:
+        if (insn -> rd == 7 || (((0x16 >> nzp) & 1) && (insn -> rd & nzp))) { // same truth table as BranchOp
+            batch -> PC[lane] = insn -> target;
+        } else {
+            batch -> PC[lane] = pc + 1;
+        }
+        return;
+
+    case H_ADD: *rd = (short)rs + (short)rt; break;
+    case H_MUL: *rd = (short)rs * (short)rt; break;
+    case H_SUB: *rd = (short)rs - (short)rt; break;
+    case H_DIV: *rd = (short)rs / (short)rt; break;
+    case H_ADDI: *rd = (short)rs + (short)insn -> imm; break;
+
+    case H_CMP: LaneNZP(batch, lane, (short)*rd - (short)rt); return;
+    case H_CMPU: LaneNZP(batch, lane, (unsigned int)*rd - (unsigned int)rt); return;
+    case H_CMPI: LaneNZP(batch, lane, (short)*rd - (short)insn -> imm); return;
+    case H_CMPIU: LaneNZP(batch, lane, (unsigned int)*rd - (unsigned int)insn -> imm); return;
+
+    case H_JSRR:
+        batch -> R[7][lane] = pc;
+        batch -> PC[lane] = batch -> R[insn -> rs][lane]; // read after R7 is written, as JSROp does
+        return;
+    case H_JSR:
+        batch -> R[7][lane] = pc;
+        batch -> PC[lane] = insn -> target;
+        return;
+
+    case H_AND: *rd = rs & rt; break;
+    case H_NOT: *rd = !rs; break;
+    case H_OR: *rd = rs | rt; break;
+    case H_XOR: *rd = rs ^ rt; break;
+    case H_ANDI: *rd = rs & insn -> imm; break;
+    case H_LOGIC_NONE: break;
+
+    case H_LDR:
+        address = rs + insn -> imm; // RS + sext(IMM6)
+        if (!LaneAddressValid(batch, lane, address, PERM_READ)) {
+            LaneError(batch, lane, "error: Invalid Data Address");
+            return;
+        }
+        *rd = PagedRead(batch -> memory, lane, address);
+        break;
+    case H_STR:
+        address = rs + insn -> imm; // RS + sext(IMM6)
+        if (!LaneAddressValid(batch, lane, address, PERM_WRITE)) {
+            LaneError(batch, lane, "error: Invalid Data Address");
+            return;
+        }
+        if (PagedWrite(batch -> memory, lane, address, *rd) != 0) { // never code: code is only fetched where STR cannot write
+            LaneError(batch, lane, "error: out of memory");
+        }
+        return;
+
+    case H_RTI:
+        batch -> PSR[lane] &= 0x7FFF; // PSR[15] = 0
+        batch -> PC[lane] = batch -> R[7][lane];
+        return;
+
+    case H_CONST: *rd = insn -> imm; break;
+    case H_SLL: *rd = rs << insn -> imm; break;
+    case H_SRA: case H_SRL: *rd = rs >> insn -> imm; break; // both shift the zero-extended RS
+    case H_MOD: *rd = rs % rt; break;
+
+    case H_JMPR:
+        batch -> PC[lane] = rs;
+        return;
+    case H_JMP:
+        batch -> PC[lane] = insn -> target;
+        return;
+
+    case H_HICONST: *rd = (*rd & 0xFF) | insn -> imm; break;
+
+    case H_TRAP:
+        batch -> R[7][lane] = pc + 1; // R7 = PC + 1
+        LaneNZP(batch, lane, batch -> R[7][lane]);
+        batch -> PSR[lane] |= 0x8000; // PSR[15] = 1
+        batch -> PC[lane] = insn -> target;
+        return;
+
+    case H_DATA_FETCH:
+        LaneError(batch, lane, "Error: Trying to Execute Code in Data Memory");
+        return;
+
+    default:
+        LaneError(batch, lane, "error: Invalid Opcode");
+        return;
+    }
+
+    LaneNZP(batch, lane, *rd); // instructions that wrote RD
+}
+
+
+/*
+ * Whether the instruction ends its block by setting the PC.
+ */
+static int Transfers(unsigned char handler)
+{
+    return (handler >= H_BRP && handler <= H_BRNZP) || handler == H_JSR || handler == H_JSRR ||
+           handler == H_RTI || handler == H_JMP || handler == H_JMPR || handler == H_TRAP ||
+           handler == H_INVALID || handler == H_DATA_FETCH;
+}
+
+
+/*
+ * Mark the lanes at the lowest running PC, one lane at a time.
+ */
+static unsigned short GroupLanes(Batch* batch)
+{
+    unsigned short pc = 0xFFFF;
+    int lane = 0;
+
+    for (lane = 0; lane < batch -> width; lane++) {
+        if (batch -> PC[lane] != HALTED && batch -> PC[lane] < pc) {
+            pc = batch -> PC[lane];
+        }
+    }
+    for (lane = 0; lane < batch -> width; lane++) {
+        batch -> mask[lane] = (batch -> PC[lane] == pc) ? 0xFFFF : 0;
+    }
+    return pc;
+}
+
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// SSE2: 8 lanes per vector, always available on x86-64
+#define LANES 8
+#define VEC __m128i
+#define BATCH_TARGET
+#define GROUP_NAME GroupSSE2
+#define VECTOR_NAME VectorSSE2
+#define MOVE_NAME MoveSSE2
+#define VLOAD(P) _mm_loadu_si128((const __m128i*)(P))
+#define VSTORE(P, V) _mm_storeu_si128((__m128i*)(P), (V))
+#define VSET(X) _mm_set1_epi16((short)(X))
+#define VADD _mm_add_epi16
+#define VSUB _mm_sub_epi16
+#define VMUL _mm_mullo_epi16
+#define VAND _mm_and_si128
+#define VANDNOT _mm_andnot_si128
+#define VOR _mm_or_si128
+#define VXOR _mm_xor_si128
+#define VCMPEQ _mm_cmpeq_epi16
+#define VCMPGT _mm_cmpgt_epi16
+#define VSLL(A, N) _mm_sll_epi16((A), _mm_cvtsi32_si128(N))
+#define VSRL(A, N) _mm_srl_epi16((A), _mm_cvtsi32_si128(N))
+#define VMINU(A, B) VXOR(_mm_min_epi16(VXOR((A), VSET(0x8000)), VXOR((B), VSET(0x8000))), VSET(0x8000)) // no unsigned min before SSE4.1
+#define VNONE(V) (_mm_movemask_epi8(V) == 0)
+#include "batch_exec.h"
+#undef LANES
+#undef VEC
+#undef BATCH_TARGET
+#undef GROUP_NAME
+#undef VECTOR_NAME
+#undef MOVE_NAME
+#undef VLOAD
+#undef VSTORE
+#undef VSET
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VAND
+#undef VANDNOT
+#undef VOR
+#undef VXOR
+#undef VCMPEQ
+#undef VCMPGT
+#undef VSLL
+#undef VSRL
+#undef VMINU
+#undef VNONE
+
+// AVX2: 16 lanes per vector, used when the host supports it
+#define LANES 16
+#define VEC __m256i
+#define BATCH_TARGET __attribute__((target("avx2")))
+#define GROUP_NAME GroupAVX2
+#define VECTOR_NAME VectorAVX2
+#define MOVE_NAME MoveAVX2
+#define VLOAD(P) _mm256_loadu_si256((const __m256i*)(P))
+#define VSTORE(P, V) _mm256_storeu_si256((__m256i*)(P), (V))
+#define VSET(X) _mm256_set1_epi16((short)(X))
+#define VADD _mm256_add_epi16
+#define VSUB _mm256_sub_epi16
+#define VMUL _mm256_mullo_epi16
+#define VAND _mm256_and_si256
+#define VANDNOT _mm256_andnot_si256
+#define VOR _mm256_or_si256
+#define VXOR _mm256_xor_si256
+#define VCMPEQ _mm256_cmpeq_epi16
+#define VCMPGT _mm256_cmpgt_epi16
+#define VSLL(A, N) _mm256_sll_epi16((A), _mm_cvtsi32_si128(N))
+#define VSRL(A, N) _mm256_srl_epi16((A), _mm_cvtsi32_si128(N))
+#define VMINU _mm256_min_epu16
+#define VNONE(V) _mm256_testz_si256((V), (V))
+#include "batch_exec.h"
+#undef LANES
+#undef VEC
+#undef BATCH_TARGET
+#undef GROUP_NAME
+#undef VECTOR_NAME
+#undef MOVE_NAME
+#undef VLOAD
+#undef VSTORE
+#undef VSET
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VAND
+#undef VANDNOT
+#undef VOR
+#undef VXOR
+#undef VCMPEQ
+#undef VCMPGT
+#undef VSLL
+#undef VSRL
+#undef VMINU
+#undef VNONE
+#endif
+
+
+/*
+ * Create count instances of the program loaded in image.
+ */
+Batch* BatchCreate(MachineState* image, int count)
+{
+    Batch* batch;
+    int width = (count + BATCH_LANE_MULTIPLE - 1) / BATCH_LANE_MULTIPLE * BATCH_LANE_MULTIPLE;
+    int missing = 0; // an allocation failed
+    int lane = 0;
+    int i = 0;
+
+    if (count <= 0) {
+        fprintf(stderr, "error: a batch needs at least one instance\n");
+        return NULL;
+    }
+    for (i = 0; i < 256; i++) {
+        if ((image -> pagePerm[i] & PERM_ANY(PERM_WRITE)) && (image -> pagePerm[i] & PERM_ANY(PERM_EXEC))) {
+            fprintf(stderr, "error: batch mode needs a memory map without writable code pages (page x%02X)\n", i);
+            return NULL;
+        }
+    }
+
+    batch = calloc(1, sizeof(Batch));
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch -> count = count;
+    batch -> width = width;
+    batch -> image = image;
+
+    for (i = 0; i < 8; i++) {
+        batch -> R[i] = malloc(width * sizeof(unsigned short));
+        missing |= (batch -> R[i] == NULL);
+    }
+    batch -> PC = malloc(width * sizeof(unsigned short));
+    batch -> PSR = malloc(width * sizeof(unsigned short));
+    batch -> mask = calloc(width, sizeof(unsigned short));
+    batch -> memory = PagedCreate(image -> memory, count); // every lane starts on the shared image pages
+    if (missing || batch -> PC == NULL || batch -> PSR == NULL || batch -> mask == NULL || batch -> memory == NULL) {
+        fprintf(stderr, "error: not enough memory for %d instances\n", count);
+        BatchFree(batch);
+        return NULL;
+    }
+
+    for (lane = 0; lane < width; lane++) {
+        for (i = 0; i < 8; i++) {
+            batch -> R[i][lane] = image -> R[i];
+        }
+        batch -> PC[lane] = (lane < count) ? image -> PC : HALTED; // padding lanes never run
+        batch -> PSR[lane] = image -> PSR;
+    }
+
+    batch -> group = GroupLanes;
+#if defined(__x86_64__)
+    batch -> group = GroupSSE2;
+    batch -> vector = VectorSSE2;
+    batch -> move = MoveSSE2;
+    if (__builtin_cpu_supports("avx2")) {
+        batch -> group = GroupAVX2;
+        batch -> vector = VectorAVX2;
+        batch -> move = MoveAVX2;
+    }
+#endif
+    return batch;
+}
+
+
+/*
+ * Parse a seed value: decimal, or hex with an x or 0x prefix.
+ */
+static int ParseValue(const char* text, long* value)
+{
+    char* end;
+
+    if (text[0] == 'x' || text[0] == 'X') {
+        *value = strtol(text + 1, &end, 16);
+    } else {
+        *value = strtol(text, &end, 0);
+    }
+    return (end != text && *end == '\0' && *value >= -32768 && *value <= 65535) ? 0 : -1;
+}
+
+
+/*
+ * Apply one name=value assignment of a seed line to a lane.
+ */
+static int ApplySeed(Batch* batch, int lane, char* assignment)
+{
+    char* equals = strchr(assignment, '=');
+    long address = 0;
+    long value = 0;
+
+    if (equals == NULL) {
+        return -1;
+    }
+    *equals = '\0';
+    if (ParseValue(equals + 1, &value) != 0) {
+        return -1;
+    }
+
+    if ((assignment[0] == 'R' || assignment[0] == 'r') && assignment[1] >= '0' && assignment[1] <= '7' &&
+        assignment[2] == '\0') {
+        batch -> R[assignment[1] - '0'][lane] = (unsigned short)value;
+    } else if (strcmp(assignment, "PC") == 0) {
+        batch -> PC[lane] = (unsigned short)value;
+    } else if (strcmp(assignment, "PSR") == 0) {
+        batch -> PSR[lane] = (unsigned short)value;
+    } else if (ParseValue(assignment, &address) == 0 && address >= 0 && address <= 0xFFFF &&
+               (batch -> image -> pagePerm[address >> 8] & PERM_ANY(PERM_WRITE))) { // data memory only
+        if (PagedWrite(batch -> memory, lane, (unsigned short)address, (unsigned short)value) != 0) {
+            return -1;
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Create one instance per line of the seed file.
+ */
+Batch* BatchLoad(MachineState* image, const char* filename)
+{
+    FILE* seeds = fopen(filename, "r");
+    char line[4096];
+    char* token;
+    Batch* batch;
+    int count = 0; // instances in the file
+    int lane = 0;
+    int number = 0; // line number
+
+    if (seeds == NULL) {
+        fprintf(stderr, "error: seed file %s could not be open\n", filename);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), seeds) != NULL) {
+        token = line + strspn(line, " \t\r\n");
+        count += (*token != '\0' && *token != '#');
+    }
+
+    batch = BatchCreate(image, count);
+    if (batch == NULL) {
+        fclose(seeds);
+        return NULL;
+    }
+
+    rewind(seeds);
+    while (fgets(line, sizeof(line), seeds) != NULL) {
+        number++;
+        token = line + strspn(line, " \t\r\n");
+        if (*token == '\0' || *token == '#') {
+            continue;
+        }
+        for (token = strtok(line, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+            if (ApplySeed(batch, lane, token) != 0) {
+                fprintf(stderr, "error: %s:%d: bad seed %s (expected R0-R7, PC, PSR or a data address = value)\n",
+                        filename, number, token);
+                fclose(seeds);
+                BatchFree(batch);
+                return NULL;
+            }
+        }
+        lane++;
+    }
+
+    fclose(seeds);
+    return batch;
+}
+
+
+/*
+ * Release the instances.
+ */
+void BatchFree(Batch* batch)
+{
+    int i = 0;
+
+    if (batch == NULL) {
+        return;
+    }
+    for (i = 0; i < 8; i++) {
+        free(batch -> R[i]);
+    }
+    free(batch -> PC);
+    free(batch -> PSR);
+    free(batch -> mask);
+    PagedFree(batch -> memory);
+    free(batch);
+}
+
+
+/*
+ * Run every instance until it halts or budget instructions have been issued.
+ */
+int BatchRun(Batch* batch, unsigned long long budget)
+{
+    MachineState* image = batch -> image; // shared code
+    unsigned long long remaining = (budget == 0) ? ~0ULL : budget; // instructions left to issue
+    const DecodedInsn* insn;
+    unsigned short pc = 0; // PC of the lanes in this step
+    int length = 0; // instructions in the block at pc
+    int k = 0; // instruction in the block
+    int lane = 0;
+
+    for (;;) {
+        pc = batch -> group(batch);
+        if (pc == 0xFFFF && memchr(batch -> mask, 0xFF, batch -> width * sizeof(unsigned short)) == NULL) {
+            return 1; // every lane halted (none is really at xFFFF)
+        }
+        if (remaining == 0) {
+            return 0;
+        }
+
+        if ((image -> pagePerm[pc >> 8] & PERM_ANY(PERM_EXEC)) != PERM_ANY(PERM_EXEC)) {
+            for (lane = 0; lane < batch -> width; lane++) { // only one privilege may fetch here
+                if (batch -> mask[lane] && !PAGE_ALLOWS(image, batch -> PSR[lane], pc, PERM_EXEC)) {
+                    LaneError(batch, lane, "Error: Trying to Execute Code in Data Memory");
+                }
+            }
+        }
+
+        length = image -> blockLength[pc] ? image -> blockLength[pc] : FormBlock(image, pc);
+        if ((unsigned long long)length > remaining) {
+            length = (int)remaining;
+        }
+        remaining -= length;
+        batch -> issued += length;
+
+        for (k = 0; k < length; k++) {
+            insn = &image -> decoded[(unsigned short)(pc + k)]; // decoded by FormBlock, and never stored over
+            if (batch -> vector == NULL || !batch -> vector(batch, pc + k, insn)) {
+                for (lane = 0; lane < batch -> width; lane++) {
+                    if (batch -> mask[lane]) {
+                        StepLane(batch, lane, pc + k, insn);
+                    }
+                }
+            }
+            if (Transfers(insn -> handler)) { // always the last instruction of a block
+                break;
+            }
+        }
+
+        if (k == length && batch -> move != NULL) { // fell off the end of the block
+            batch -> move(batch, pc + length);
+        } else if (k == length) {
+            for (lane = 0; lane < batch -> width; lane++) {
+                if (batch -> mask[lane]) {
+                    batch -> PC[lane] = pc + length;
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * Write the final state of each instance.
+ */
+void BatchWriteOut(Batch* batch, FILE* output)
+{
+    int lane = 0;
+    int i = 0;
+
+    for (lane = 0; lane < batch -> count; lane++) {
+        fprintf(output, "%d PC: 0x%04X PSR: 0x%04X", lane, batch -> PC[lane], batch -> PSR[lane]);
+        for (i = 0; i < 8; i++) {
+            fprintf(output, " R%d: 0x%04X", i, batch -> R[i][lane]);
+        }
+        fprintf(output, "\n");
+    }
+}
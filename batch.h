@@ -0,0 +1,85 @@
+/*
+ * batch.h: Declares the lockstep engine that runs many instances of one program
+ *
+ * All instances share the loaded program (its decoded instructions and cached
+ * blocks): the memory map may not have a page that is both writable and
+ * executable, so STR can never write code. Memory is paged copy-on-write over the image (see
+ * pagedmemory.h), so an instance only owns the pages it has stored into.
+ * Registers, PC and PSR are kept in structure-of-arrays form, one lane per
+ * instance.
+ *
+ * Each step picks the lowest PC among the running lanes and executes the
+ * cached block there for every lane at that PC. ALU instructions, BR, JMP and
+ * JSR run as SSE2/AVX2 vector kernels across the lanes; everything else
+ * (memory, JSRR/JMPR/TRAP/RTI, DIV/MOD, errors) runs lane by lane. Lanes that
+ * branch apart wait at their own PCs and run together again once they meet.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "LC4.h"
+#include "pagedmemory.h"
+
+#define BATCH_LANE_MULTIPLE 16 // lanes are padded to a whole number of AVX2 vectors
+
+typedef struct Batch Batch;
+
+struct Batch {
+    int count; // instances
+    int width; // count rounded up to BATCH_LANE_MULTIPLE (padding lanes stay halted)
+
+    MachineState* image; // loaded program: code, initial memory and state
+
+    // One lane per instance
+    unsigned short* R[8]; // R[register][lane]
+    unsigned short* PC;
+    unsigned short* PSR;
+    unsigned short* mask; // 0xFFFF for the lanes taking part in the current step
+    PagedMemory* memory; // each lane's memory, copy-on-write over the image
+
+    unsigned long long issued; // instructions issued (each runs for a whole group of lanes)
+
+    // Vector kernels picked for the host (NULL = lane by lane only)
+    unsigned short (*group)(Batch* batch); // mark the lanes at the lowest PC, 0xFFFF when all halted
+    int (*vector)(Batch* batch, unsigned short pc, const DecodedInsn* insn); // 0 if insn has no vector kernel
+    void (*move)(Batch* batch, unsigned short pc); // set the PC of the lanes in the step
+};
+
+
+/*
+ * Create count instances of the program loaded in image, each starting from
+ * the image's state (call Reset on the image first). Returns NULL on failure.
+ */
+Batch* BatchCreate(MachineState* image, int count);
+
+
+/*
+ * Create one instance per line of the seed file. A line is a list of
+ * name=value assignments applied on top of the image's state: R0-R7, PC,
+ * PSR, or a data memory address such as x4000. Values are decimal, or hex
+ * with an x or 0x prefix. Blank lines and lines starting with # are skipped.
+ */
+Batch* BatchLoad(MachineState* image, const char* filename);
+
+
+/*
+ * Release the instances.
+ */
+void BatchFree(Batch* batch);
+
+
+/*
+ * Run every instance until its PC reaches 0x80FF, or until budget instructions
+ * have been issued (budget 0 = no limit). Returns 1 once all instances have
+ * halted, 0 if the budget ran out.
+ */
+int BatchRun(Batch* batch, unsigned long long budget);
+
+
+/*
+ * Write the final PC, PSR and registers of each instance to output, one line each.
+ */
+void BatchWriteOut(Batch* batch, FILE* output);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * batch_exec.h: Vector kernels of the lockstep batch engine. batch.c includes
+ * this file once per instruction set, with LANES, VEC and the V* operations
+ * defined for it, BATCH_TARGET set to the matching target attribute, and
+ * GROUP_NAME / VECTOR_NAME / MOVE_NAME giving the functions to define.
+ */
+
+// Visit every vector of lanes that has a lane in the current step (m = its mask)
+#define LANE_LOOP(BODY) \
+    for (i = 0; i < batch -> width; i += LANES) { \
+        m = VLOAD(batch -> mask + i); \
+        if (VNONE(m)) continue; \
+        BODY \
+    }
+
+// Take NEW in the lanes of M, keep OLD in the others
+#define BLEND(M, NEW, OLD) VOR(VAND((M), (NEW)), VANDNOT((M), (OLD)))
+
+// Same as UpdateNZP: the NZP bits are only replaced while they are 0 or one-hot
+#define UPDATE_NZP(RESULT) \
+    p = VLOAD(batch -> PSR + i); \
+    nzp = VAND(p, VSET(7)); \
+    ok = VAND(m, VCMPEQ(VAND(nzp, VSUB(nzp, VSET(1))), VSET(0))); \
+    nzp = VOR(VOR(VAND(VCMPGT(VSET(0), (RESULT)), VSET(4)), VAND(VCMPEQ((RESULT), VSET(0)), VSET(2))), \
+              VAND(VCMPGT((RESULT), VSET(0)), VSET(1))); \
+    VSTORE(batch -> PSR + i, BLEND(ok, VOR(VANDNOT(VSET(7), p), nzp), p))
+
+// RD = EXPR (of a = RS, b = RT, d = RD), then the NZP bits from the new RD
+#define WRITE_RD(EXPR) \
+    LANE_LOOP( \
+        a = VLOAD(rs + i); \
+        b = VLOAD(rt + i); \
+        d = VLOAD(rd + i); \
+        r = (EXPR); \
+        VSTORE(rd + i, BLEND(m, r, d)); \
+        UPDATE_NZP(r); \
+    ) \
+    return 1
+
+// NZP bits from EXPR without writing a register (CMP family)
+#define COMPARE(EXPR) \
+    LANE_LOOP( \
+        d = VLOAD(rd + i); \
+        b = VLOAD(rt + i); \
+        r = (EXPR); \
+        UPDATE_NZP(r); \
+    ) \
+    return 1
+
+
+/*
+ * Mark the lanes whose PC is the lowest among the running lanes and return
+ * that PC (0xFFFF once every lane has halted).
+ */
+BATCH_TARGET static unsigned short GROUP_NAME(Batch* batch)
+{
+    unsigned short lowest[LANES]; // per-position minimum
+    unsigned short pc = 0xFFFF;
+    VEC low = VSET(0xFFFF);
+    VEC key;
+    int i = 0;
+
+    for (i = 0; i < batch -> width; i += LANES) {
+        key = VLOAD(batch -> PC + i);
+        key = VOR(key, VCMPEQ(key, VSET(0x80FF))); // halted lanes sort last
+        low = VMINU(low, key);
+    }
+    VSTORE(lowest, low);
+    for (i = 0; i < LANES; i++) {
+        pc = (lowest[i] < pc) ? lowest[i] : pc;
+    }
+
+    key = VSET(pc);
+    for (i = 0; i < batch -> width; i += LANES) {
+        VSTORE(batch -> mask + i, VCMPEQ(VLOAD(batch -> PC + i), key));
+    }
+    return pc;
+}
+
+
+/*
+ * Set the PC of every lane in the current step to pc.
+ */
+BATCH_TARGET static void MOVE_NAME(Batch* batch, unsigned short pc)
+{
+    VEC m;
+    int i = 0;
+
+    LANE_LOOP(
+        VSTORE(batch -> PC + i, BLEND(m, VSET(pc), VLOAD(batch -> PC + i)));
+    )
+}
+
+
+/*
+ * Execute insn, found at pc, in every lane of the current step. Returns 0,
+ * without doing anything, for instructions that have no vector kernel.
+ */
+BATCH_TARGET static int VECTOR_NAME(Batch* batch, unsigned short pc, const DecodedInsn* insn)
+{
+    unsigned short* rd = batch -> R[insn -> rd & 7]; // BR keeps its NZP mask here
+    unsigned short* rs = batch -> R[insn -> rs];
+    unsigned short* rt = batch -> R[insn -> rt];
+    VEC m, a, b, d, r, p, nzp, ok;
+    int i = 0;
+
+    switch (insn -> handler) {
+    case H_NOP:
+        return 1;
+    case H_BRP: case H_BRZ: case H_BRZP: case H_BRN: case H_BRNP: case H_BRNZ: case H_BRNZP:
+        LANE_LOOP( // same truth table as BranchOp: BRnzp always, else a one-hot NZP in the mask
+            p = VLOAD(batch -> PSR + i);
+            nzp = VAND(p, VSET(7));
+            ok = VOR(VOR(VCMPEQ(nzp, VSET(1)), VCMPEQ(nzp, VSET(2))), VCMPEQ(nzp, VSET(4)));
+            ok = VOR(VAND(ok, VCMPEQ(VAND(nzp, VSET(insn -> rd)), nzp)), VSET((insn -> rd == 7) ? 0xFFFF : 0));
+            r = BLEND(ok, VSET(insn -> target), VSET(pc + 1));
+            VSTORE(batch -> PC + i, BLEND(m, r, VLOAD(batch -> PC + i)));
+        )
+        return 1;
+    case H_JMP:
+        MOVE_NAME(batch, insn -> target);
+        return 1;
+    case H_JSR:
+        LANE_LOOP(
+            VSTORE(batch -> R[7] + i, BLEND(m, VSET(pc), VLOAD(batch -> R[7] + i)));
+            VSTORE(batch -> PC + i, BLEND(m, VSET(insn -> target), VLOAD(batch -> PC + i)));
+        )
+        return 1;
+    case H_ADD:
+        WRITE_RD(VADD(a, b));
+    case H_MUL:
+        WRITE_RD(VMUL(a, b));
+    case H_SUB:
+        WRITE_RD(VSUB(a, b));
+    case H_ADDI:
+        WRITE_RD(VADD(a, VSET(insn -> imm)));
+    case H_CMP: case H_CMPU: // both compare the low 16 bits of the difference
+        COMPARE(VSUB(d, b));
+    case H_CMPI: case H_CMPIU:
+        COMPARE(VSUB(d, VSET(insn -> imm)));
+    case H_AND:
+        WRITE_RD(VAND(a, b));
+    case H_NOT: // logical not, as LogicalOp does
+        WRITE_RD(VAND(VCMPEQ(a, VSET(0)), VSET(1)));
+    case H_OR:
+        WRITE_RD(VOR(a, b));
+    case H_XOR:
+        WRITE_RD(VXOR(a, b));
+    case H_ANDI:
+        WRITE_RD(VAND(a, VSET(insn -> imm)));
+    case H_LOGIC_NONE:
+        WRITE_RD(d);
+    case H_CONST:
+        WRITE_RD(VSET(insn -> imm));
+    case H_HICONST:
+        WRITE_RD(VOR(VAND(d, VSET(0xFF)), VSET(insn -> imm)));
+    case H_SLL:
+        WRITE_RD(VSLL(a, insn -> imm));
+    case H_SRA: case H_SRL: // both shift the zero-extended RS
+        WRITE_RD(VSRL(a, insn -> imm));
+    }
+    return 0;
+}
+
+#undef LANE_LOOP
+#undef BLEND
+#undef UPDATE_NZP
+#undef WRITE_RD
+#undef COMPARE
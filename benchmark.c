@@ -0,0 +1,317 @@
+/*
+ * benchmark.c: Times the interpreter core on the p1 programs and on synthetic
+ * long-running kernels, and prints the results as JSON
+ *
+ * Every program runs in three modes: traced (text trace), binary (packed
+ * trace records) and untraced. The traced modes run RunBlocks into a scratch
+ * file; untraced runs RunUntraced. Each case runs in its own child process,
+ * so the peak RSS reported is that case's alone, and is repeated until it has
+ * taken BENCH_MIN_SECONDS. Build two copies of LC4.c and diff their JSON to
+ * catch regressions.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "loader.h"
+#include "tracewriter.h"
+
+#define BENCH_BUDGET 100000000ULL // instructions before a run is cut off
+#define BENCH_MIN_SECONDS 0.25 // time each case is repeated for
+#define BENCH_MAX_RUNS 1000
+
+// Modes each program is run in
+static const char* const modes[] = {"traced", "binary", "untraced"};
+#define MODE_COUNT 3
+
+// p1 programs benchmarked when present in the program directory
+static const char* const programs[] = {"sort", "rubik", "wireframe", "sqrt", "power", "multiply", "divide"};
+#define PROGRAM_COUNT (int)(sizeof(programs) / sizeof(programs[0]))
+
+// Synthetic kernels written by WriteKernels
+static const char* const kernels[] = {"alu", "memory", "calls"};
+#define KERNEL_COUNT 3
+
+// Result of one case, sent back from the child process
+typedef struct {
+    int ok; // the program loaded and ran
+    int runs; // repetitions
+    unsigned long long instructions; // per run
+    unsigned long long traceBytes; // per run
+    double runSeconds; // total over the runs
+    double loadSeconds; // total time in ReadObjectFile
+} BenchResult;
+
+
+static double Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+
+/*
+ * Write words as a code section loaded at address.
+ */
+static void WriteSection(FILE* file, unsigned short address, const unsigned short* words, int count)
+{
+    unsigned short header[3] = {0xCADE, address, (unsigned short)count};
+    int i = 0;
+
+    for (i = 0; i < 3; i++) {
+        fputc(header[i] >> 8, file);
+        fputc(header[i] & 0xFF, file);
+    }
+    for (i = 0; i < count; i++) {
+        fputc(words[i] >> 8, file);
+        fputc(words[i] & 0xFF, file);
+    }
+}
+
+
+/*
+ * Write the synthetic kernels into dir as kernel_<name>.obj. They start at
+ * x8200 (the reset PC), each run about two million instructions, and halt by
+ * jumping to x80FF. Returns 0, or -1 if a file could not be written.
+ */
+static int WriteKernels(const char* dir)
+{
+    // ALU: ADD/MUL/XOR/SLL/SUB on a 65536-count inner loop, 4 times
+    static const unsigned short alu[] = {
+        0x9C04, // CONST R6, #4          outer count
+        0x9400, // CONST R2, #0          OUTER: inner count (65536)
+        0x1003, // ADD R0, R0, R3        INNER:
+        0x160C, // MUL R3, R0, R4
+        0x5918, // XOR R4, R4, R0
+        0xAB03, // SLL R5, R4, #3
+        0x1B50, // SUB R5, R5, R0
+        0x14BF, // ADD R2, R2, #-1
+        0x0BF9, // BRnp INNER
+        0x1DBF, // ADD R6, R6, #-1
+        0x03F6, // BRp OUTER
+        0x9EFF, // CONST R7, #xFF
+        0xDF80, // HICONST R7, #x80
+        0xC1C0  // JMPR R7
+    };
+    // Memory: LDR/ADD/STR streaming over x4000-x7000 (user data memory), 27 times
+    static const unsigned short memory[] = {
+        0x9C1B, // CONST R6, #27         outer count
+        0x9200, // CONST R1, #0          OUTER:
+        0xD340, // HICONST R1, #x40      R1 = x4000
+        0x9400, // CONST R2, #0
+        0xD530, // HICONST R2, #x30      R2 = x3000 words
+        0x6640, // LDR R3, R1, #0        INNER:
+        0x16C0, // ADD R3, R3, R0
+        0x7641, // STR R3, R1, #1
+        0x1261, // ADD R1, R1, #1
+        0x14BF, // ADD R2, R2, #-1
+        0x0BFA, // BRnp INNER
+        0x1DBF, // ADD R6, R6, #-1
+        0x03F4, // BRp OUTER
+        0x9EFF, // CONST R7, #xFF
+        0xDF80, // HICONST R7, #x80
+        0xC1C0  // JMPR R7
+    };
+    // Calls: JSR to a three-instruction subroutine at x8400, 5 times 65536
+    static const unsigned short calls[] = {
+        0x9C05, // CONST R6, #5          outer count
+        0x9400, // CONST R2, #0          OUTER:
+        0x4840, // JSR x8400             INNER:
+        0x14BF, // ADD R2, R2, #-1
+        0x0BFD, // BRnp INNER
+        0x1DBF, // ADD R6, R6, #-1
+        0x03FA, // BRp OUTER
+        0x9EFF, // CONST R7, #xFF
+        0xDF80, // HICONST R7, #x80
+        0xC1C0  // JMPR R7
+    };
+    static const unsigned short subroutine[] = {
+        0x1001, // ADD R0, R0, R1        x8400
+        0x1FE1, // ADD R7, R7, #1        JSR leaves R7 at the JSR itself
+        0xC1C0  // JMPR R7
+    };
+    char filename[512];
+    FILE* file;
+    int i = 0;
+    int status = 0;
+
+    for (i = 0; i < KERNEL_COUNT && status == 0; i++) {
+        snprintf(filename, sizeof(filename), "%s/kernel_%s.obj", dir, kernels[i]);
+        file = fopen(filename, "wb");
+        if (file == NULL) {
+            return -1;
+        }
+        if (i == 0) {
+            WriteSection(file, 0x8200, alu, sizeof(alu) / sizeof(alu[0]));
+        } else if (i == 1) {
+            WriteSection(file, 0x8200, memory, sizeof(memory) / sizeof(memory[0]));
+        } else {
+            WriteSection(file, 0x8200, calls, sizeof(calls) / sizeof(calls[0]));
+            WriteSection(file, 0x8400, subroutine, sizeof(subroutine) / sizeof(subroutine[0]));
+        }
+        status = fclose(file);
+    }
+    return status;
+}
+
+
+/*
+ * Load and run object in mode until BENCH_MIN_SECONDS have passed (at least
+ * once), writing the trace to scratch.
+ */
+static void RunCase(const char* object, int mode, const char* scratch, BenchResult* result)
+{
+    MachineState* CPU = malloc(sizeof(MachineState));
+    FILE* output;
+    double start = 0;
+    double loaded = 0;
+
+    memset(result, 0, sizeof(BenchResult));
+    while (CPU != NULL && result -> runs < BENCH_MAX_RUNS &&
+           (result -> runs == 0 || result -> runSeconds + result -> loadSeconds < BENCH_MIN_SECONDS)) {
+        memset(CPU, 0, sizeof(MachineState));
+        start = Now();
+        if (ReadObjectFile((char*)object, CPU) != 0) {
+            break;
+        }
+        loaded = Now();
+        result -> loadSeconds += loaded - start;
+        Reset(CPU);
+        ClearSignals(CPU);
+
+        if (modes[mode][0] == 'u') { // untraced
+            RunUntraced(CPU, BENCH_BUDGET);
+            result -> runSeconds += Now() - loaded;
+        } else {
+            output = fopen(scratch, "wb");
+            if (output == NULL) {
+                break;
+            }
+            loaded = Now(); // opening the file is not part of the run
+            CPU -> trace = TraceOpen(output, (modes[mode][0] == 'b') ? TRACE_FORMAT_BIN : TRACE_FORMAT_TEXT, 0);
+            if (CPU -> trace == NULL) {
+                fclose(output);
+                break;
+            }
+            RunBlocks(CPU, output, BENCH_BUDGET);
+            TraceClose(CPU -> trace);
+            fflush(output);
+            result -> runSeconds += Now() - loaded;
+            result -> traceBytes = ftell(output);
+            fclose(output);
+        }
+
+        result -> instructions = CPU -> instructions;
+        result -> runs++;
+        result -> ok = 1;
+    }
+
+    remove(scratch);
+    free(CPU);
+}
+
+
+/*
+ * Run one case in a child process and print its JSON object. Returns 1 if
+ * something was printed.
+ */
+static int Benchmark(const char* name, const char* object, int mode, const char* scratch, int first)
+{
+    BenchResult result;
+    struct rusage usage;
+    int channel[2];
+    int status = 0;
+    pid_t child;
+    double seconds = 0; // per run
+
+    memset(&result, 0, sizeof(result));
+    memset(&usage, 0, sizeof(usage));
+    if (pipe(channel) != 0 || (child = fork()) < 0) {
+        fprintf(stderr, "error: could not start the benchmark of %s\n", name);
+        return 0;
+    }
+
+    if (child == 0) {
+        close(channel[0]);
+        RunCase(object, mode, scratch, &result);
+        _exit(write(channel[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+    }
+
+    close(channel[1]);
+    if (read(channel[0], &result, sizeof(result)) != sizeof(result)) {
+        result.ok = 0;
+    }
+    close(channel[0]);
+    wait4(child, &status, 0, &usage);
+
+    if (!result.ok) {
+        fprintf(stderr, "error: %s did not load\n", object);
+        return 0;
+    }
+    seconds = result.runSeconds / result.runs;
+    printf("%s\n    {\"program\": \"%s\", \"mode\": \"%s\", \"runs\": %d, \"instructions\": %llu, "
+           "\"seconds\": %.9f, \"instructionsPerSecond\": %.0f, \"nsPerInstruction\": %.3f, "
+           "\"traceBytes\": %llu, \"traceBytesPerSecond\": %.0f, \"loadSeconds\": %.9f, \"peakRssKB\": %ld}",
+           first ? "" : ",", name, modes[mode], result.runs, result.instructions,
+           seconds, (seconds > 0) ? result.instructions / seconds : 0.0,
+           result.instructions ? 1e9 * seconds / result.instructions : 0.0,
+           result.traceBytes, (seconds > 0) ? result.traceBytes / seconds : 0.0,
+           result.loadSeconds / result.runs, usage.ru_maxrss);
+    fflush(stdout);
+    return 1;
+}
+
+
+int main(int argc, char** argv)
+{
+    char dir[] = "/tmp/lc4benchXXXXXX"; // kernels and trace scratch file
+    char object[512];
+    char scratch[512];
+    char name[64];
+    int first = 1; // no JSON object printed yet
+    int mode = 0;
+    int i = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: benchmark <program directory>\n");
+        return -1;
+    }
+    if (mkdtemp(dir) == NULL || WriteKernels(dir) != 0) {
+        fprintf(stderr, "error: could not write the synthetic kernels\n");
+        return -1;
+    }
+    snprintf(scratch, sizeof(scratch), "%s/trace.out", dir);
+
+    printf("{\n  \"compiler\": \"%s\",\n", __VERSION__);
+    printf("  \"minSeconds\": %.2f,\n  \"results\": [", BENCH_MIN_SECONDS);
+
+    for (i = 0; i < PROGRAM_COUNT + KERNEL_COUNT; i++) {
+        if (i < PROGRAM_COUNT) {
+            snprintf(object, sizeof(object), "%s/%s.obj", argv[1], programs[i]);
+            snprintf(name, sizeof(name), "%s", programs[i]);
+            if (access(object, R_OK) != 0) {
+                fprintf(stderr, "note: %s not found, skipped\n", object);
+                continue;
+            }
+        } else {
+            snprintf(object, sizeof(object), "%s/kernel_%s.obj", dir, kernels[i - PROGRAM_COUNT]);
+            snprintf(name, sizeof(name), "kernel_%s", kernels[i - PROGRAM_COUNT]);
+        }
+        for (mode = 0; mode < MODE_COUNT; mode++) {
+            if (Benchmark(name, object, mode, scratch, first)) {
+                first = 0;
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    for (i = 0; i < KERNEL_COUNT; i++) {
+        snprintf(object, sizeof(object), "%s/kernel_%s.obj", dir, kernels[i]);
+        remove(object);
+    }
+    rmdir(dir);
+    return 0;
+}
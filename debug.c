@@ -0,0 +1,111 @@
+/*
+ * debug.c: Breakpoints and watchpoints (--gdb)
+ */
+
+#include "debug.h"
+
+
+/*
+ * Create the debugger.
+ */
+int DebugAttach(MachineState* CPU)
+{
+    CPU -> debugger = calloc(1, sizeof(Debugger));
+    return (CPU -> debugger != NULL) ? 0 : -1;
+}
+
+
+/*
+ * Remove every breakpoint and watchpoint and free the debugger.
+ */
+void DebugDetach(MachineState* CPU)
+{
+    Debugger* debugger = CPU -> debugger;
+    int address = 0;
+    int page = 0;
+
+    if (debugger == NULL) {
+        return;
+    }
+    CPU -> debugger = NULL;
+    for (address = 0; address < 65536; address++) {
+        if (debugger -> breakpoint[address]) {
+            InvalidateWords(CPU, address, 1); // decoded again as the plain instruction
+        }
+    }
+    for (page = 0; page < 256; page++) {
+        CPU -> devicePage[page] &= ~(WATCH_HOOK_LOAD | WATCH_HOOK_STORE);
+    }
+    free(debugger);
+}
+
+
+/*
+ * Set or clear the breakpoint at address.
+ */
+void DebugSetBreakpoint(MachineState* CPU, unsigned short address, int on)
+{
+    if (CPU -> debugger -> breakpoint[address] != (on != 0)) {
+        CPU -> debugger -> breakpoint[address] = (on != 0);
+        InvalidateWords(CPU, address, 1); // DecodeAt gives it H_BREAK, or the instruction back
+    }
+}
+
+
+/*
+ * Add or remove a watchpoint on count words from address.
+ */
+int DebugSetWatch(MachineState* CPU, unsigned short address, int count, int kind, int on)
+{
+    Debugger* debugger = CPU -> debugger;
+    unsigned short word = 0;
+    int step = on ? 1 : -1;
+    int page = 0;
+    int i = 0;
+
+    for (i = 0; i < count; i++) { // all or nothing
+        word = address + i;
+        if (on ? debugger -> watches[word][kind] == 0xFF : debugger -> watches[word][kind] == 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        word = address + i;
+        page = word >> 8;
+        debugger -> watches[word][kind] += step;
+        if (kind != WATCH_WRITE) {
+            debugger -> pageLoads[page] += step;
+        }
+        if (kind != WATCH_READ) {
+            debugger -> pageStores[page] += step;
+        }
+        CPU -> devicePage[page] &= ~(WATCH_HOOK_LOAD | WATCH_HOOK_STORE);
+        CPU -> devicePage[page] |= (debugger -> pageLoads[page] ? WATCH_HOOK_LOAD : 0) |
+                                   (debugger -> pageStores[page] ? WATCH_HOOK_STORE : 0);
+    }
+    return 0;
+}
+
+
+/*
+ * Check an access to a page holding a watched word.
+ */
+int DebugWatch(MachineState* CPU, unsigned short address, int kind)
+{
+    Debugger* debugger = CPU -> debugger;
+
+    if (debugger -> suspended) {
+        return 0;
+    }
+    if (debugger -> watches[address][kind]) {
+        debugger -> watchKind = kind;
+    } else if (debugger -> watches[address][WATCH_ACCESS]) {
+        debugger -> watchKind = WATCH_ACCESS;
+    } else {
+        return 0; // another word of the page
+    }
+    debugger -> watchHit = 1;
+    debugger -> watchAddress = address;
+    return 1;
+}
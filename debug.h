@@ -0,0 +1,80 @@
+/*
+ * debug.h: Declares breakpoints and watchpoints (--gdb, see gdbstub.h)
+ *
+ * Neither costs anything while it is not hit. A breakpoint is kept in the
+ * predecoded instruction: DecodeAt gives the word at a breakpoint address the
+ * H_BREAK handler, which stops the run loops before the instruction runs
+ * (setting or clearing one drops the decoded entry and any cached block
+ * holding it). A watchpoint sets a WATCH_HOOK_* bit in CPU -> devicePage, so
+ * LDR and STR only look the word up on the slow path they already take for
+ * device pages; a hit lets the instruction finish and stops right after it.
+ * Either way the run loops return 2.
+ *
+ * Watchpoints follow the GDB kinds: write, read and access (both).
+ */
+
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "LC4.h"
+
+// CPU -> devicePage bits, beside DEVICE_HOOK_*: the page holds a watched word
+#define WATCH_HOOK_LOAD 0x4
+#define WATCH_HOOK_STORE 0x8
+
+// Watchpoint kinds (GDB Z2, Z3 and Z4 packets)
+#define WATCH_WRITE 0
+#define WATCH_READ 1
+#define WATCH_ACCESS 2
+#define WATCH_KINDS 3
+
+typedef struct Debugger {
+    unsigned char breakpoint[65536]; // set at every breakpoint address
+    unsigned char watches[65536][WATCH_KINDS]; // watchpoints of each kind on each word
+    unsigned int pageLoads[256]; // read and access watchpoints in each page
+    unsigned int pageStores[256]; // write and access watchpoints in each page
+
+    // Last watchpoint hit
+    int watchHit; // set by DebugWatch, cleared by whoever reports it
+    unsigned short watchAddress;
+    int watchKind; // WATCH_*
+
+    // Run straight through breakpoints and watchpoints (replaying history)
+    int suspended;
+} Debugger;
+
+
+/*
+ * Create a debugger without breakpoints or watchpoints and attach it to CPU.
+ * Returns -1 if out of memory.
+ */
+int DebugAttach(MachineState* CPU);
+
+
+/*
+ * Remove every breakpoint and watchpoint and free the debugger.
+ */
+void DebugDetach(MachineState* CPU);
+
+
+/*
+ * Set (on = 1) or clear (on = 0) the breakpoint at address.
+ */
+void DebugSetBreakpoint(MachineState* CPU, unsigned short address, int on);
+
+
+/*
+ * Add (on = 1) or remove (on = 0) a watchpoint of the given kind on count
+ * words from address. Returns 0, or -1 if there is no such watchpoint to remove.
+ */
+int DebugSetWatch(MachineState* CPU, unsigned short address, int count, int kind, int on);
+
+
+/*
+ * Called for an LDR (WATCH_READ) or STR (WATCH_WRITE) at address on a page
+ * with a WATCH_HOOK_* bit. Returns 1 and records the hit if a watchpoint
+ * covers the access, 0 otherwise.
+ */
+int DebugWatch(MachineState* CPU, unsigned short address, int kind);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * devices.c: Memory-mapped LC4 devices: console, timer and framebuffer
+ */
+
+#include <time.h>
+#include "devices.h"
+#include "tracewriter.h"
+
+
+static double Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+
+/*
+ * Write out the batched console output. Returns 0, or -1 if it was lost.
+ */
+static int FlushConsole(Devices* devices)
+{
+    int status = 0;
+
+    if (devices -> pendingUsed != 0) {
+        status = (fwrite(devices -> pending, 1, devices -> pendingUsed, devices -> output) == devices -> pendingUsed) ? 0 : -1;
+        devices -> pendingUsed = 0;
+    }
+    return (fflush(devices -> output) == 0) ? status : -1;
+}
+
+
+/*
+ * Wait for the next key unless one is already waiting (console output is
+ * flushed first, so prompts show up before the read blocks).
+ */
+static void PollKey(Devices* devices)
+{
+    if (devices -> key < 0 && devices -> input != NULL && !feof(devices -> input)) {
+        FlushConsole(devices);
+        devices -> key = fgetc(devices -> input);
+    }
+}
+
+
+/*
+ * Mark the rows holding words [address, address + count) as changed.
+ */
+static void MarkDirty(Devices* devices, unsigned short address, int count)
+{
+    int row = (address - VIDEO_BASE) / VIDEO_WIDTH;
+    int last = (address + count - 1 - VIDEO_BASE) / VIDEO_WIDTH;
+
+    for (; row <= last; row++) {
+        if (!devices -> dirty[row]) {
+            devices -> dirty[row] = 1;
+            devices -> dirtyRows++;
+        }
+    }
+}
+
+
+/*
+ * Whether an instruction of a polling loop only computes or loads.
+ */
+static int ComputesOnly(const DecodedInsn* insn)
+{
+    return insn -> handler == H_NOP || (insn -> handler >= H_ADD && insn -> handler <= H_CMPIU) ||
+           (insn -> handler >= H_AND && insn -> handler <= H_LDR) || insn -> handler == H_CONST ||
+           (insn -> handler >= H_SLL && insn -> handler <= H_MOD) || insn -> handler == H_HICONST;
+}
+
+
+/*
+ * Whether an instruction is a BR or JMP IMM11 (insn -> target is where the
+ * interpreters take it).
+ */
+static int Jumps(const DecodedInsn* insn)
+{
+    return (insn -> handler >= H_BRP && insn -> handler <= H_BRNZP) || insn -> handler == H_JMP;
+}
+
+
+/*
+ * Length in words of the loop the LDR at pc polls in: a backward BR or JMP
+ * within DEVICE_POLL_BODY words, with nothing in between that stores, calls,
+ * traps or returns. 0 if there is none.
+ */
+static int PollingLoop(MachineState* CPU, unsigned short pc)
+{
+    unsigned short address = 0;
+    unsigned short target = 0;
+    DecodedInsn insn;
+    int length = 0;
+
+    for (length = 1; length <= DEVICE_POLL_BODY; length++) {
+        address = pc + length - 1;
+        DecodeInsn(address, CPU -> memory[address], &insn);
+        if (Jumps(&insn)) {
+            target = insn.target;
+        } else if (ComputesOnly(&insn)) {
+            continue;
+        } else {
+            return 0;
+        }
+        if ((unsigned short)(pc - target) < DEVICE_POLL_BODY - length + 1) { // back to the LDR or before it
+            break;
+        }
+    }
+    if (length > DEVICE_POLL_BODY) {
+        return 0;
+    }
+
+    for (address = target; address != pc; address++) { // the part before the LDR
+        DecodeInsn(address, CPU -> memory[address], &insn);
+        if (!Jumps(&insn) && !ComputesOnly(&insn)) {
+            return 0;
+        }
+    }
+    return length + (unsigned short)(pc - target);
+}
+
+
+/*
+ * Time warp after a status register read: skip a polling loop that can only
+ * go on once the device changes. Returns 0, or -1 if it never will.
+ */
+static int Warp(MachineState* CPU, unsigned short address)
+{
+    Devices* devices = CPU -> devices;
+    unsigned long long period = CPU -> instructions - devices -> pollInstruction; // one iteration
+    unsigned long long wait = 0; // instructions until the timer expires
+    unsigned long long iterations = 0;
+    char note[128];
+
+    if (CPU -> memory[address] & 0x8000) { // ready, nothing to wait for
+        devices -> pollAddress = 0;
+        return 0;
+    }
+    if (devices -> pollAddress != address || devices -> pollPC != CPU -> PC || devices -> pollPSR != CPU -> PSR ||
+        memcmp(devices -> pollR, CPU -> R, sizeof(devices -> pollR)) != 0 ||
+        period > (unsigned long long)PollingLoop(CPU, CPU -> PC)) { // not (yet) the same iteration again
+        devices -> pollAddress = address;
+        devices -> pollPC = CPU -> PC;
+        devices -> pollPSR = CPU -> PSR;
+        memcpy(devices -> pollR, CPU -> R, sizeof(devices -> pollR));
+        devices -> pollInstruction = CPU -> instructions;
+        return 0;
+    }
+
+    devices -> pollAddress = 0;
+    if (address == DEVICE_KBSR) { // PollKey only comes back empty once the input has ended
+        fprintf(stderr, "error: waiting for a key at x%04X after the end of the input\n", CPU -> PC);
+        return -1;
+    }
+
+    wait = (unsigned long long)CPU -> memory[DEVICE_TIR] * DEVICE_INSTRUCTIONS_PER_MS -
+           (CPU -> instructions - devices -> timerInstruction);
+    iterations = (wait + period - 1) / period;
+    CPU -> instructions += iterations * period; // this read becomes the one that finds TSR expired
+    devices -> timerInstruction = CPU -> instructions;
+    CPU -> memory[address] = 0x8000;
+
+    if (devices -> noteElided && CPU -> trace != NULL) {
+        snprintf(note, sizeof(note), "# x%04X: %llu iterations of %llu instructions elided\n",
+                 CPU -> PC, iterations, period);
+        TraceNote(CPU -> trace, note);
+    }
+    return 0;
+}
+
+
+/*
+ * Create the devices.
+ */
+Devices* DevicesCreate(FILE* input, FILE* output, const char* frames)
+{
+    Devices* devices = calloc(1, sizeof(Devices));
+
+    if (devices == NULL) {
+        return NULL;
+    }
+    devices -> input = input;
+    devices -> output = output;
+    devices -> key = -1;
+    devices -> timerStart = Now();
+    devices -> frames = frames;
+    return devices;
+}
+
+
+/*
+ * Hook the device pages.
+ */
+void DevicesAttach(MachineState* CPU, Devices* devices)
+{
+    int address = 0;
+    int page = 0;
+
+    CPU -> devices = devices;
+    for (page = 0; page < 256; page++) { // other hook bits (watchpoints) stay
+        CPU -> devicePage[page] &= ~(DEVICE_HOOK_LOAD | DEVICE_HOOK_STORE);
+    }
+    for (page = VIDEO_BASE >> 8; page < DEVICE_KBSR >> 8; page++) { // video memory: reads are plain memory
+        CPU -> devicePage[page] |= DEVICE_HOOK_STORE;
+    }
+    CPU -> devicePage[DEVICE_KBSR >> 8] |= DEVICE_HOOK_LOAD | DEVICE_HOOK_STORE;
+
+    for (address = VIDEO_BASE; address < VIDEO_BASE + VIDEO_WIDTH * VIDEO_HEIGHT; address++) {
+        if (CPU -> memory[address] != 0) { // an image loaded into video memory is a change from black
+            MarkDirty(devices, address, 1);
+        }
+    }
+}
+
+
+/*
+ * Refresh a device register before it is read.
+ */
+int DeviceLoad(MachineState* CPU, unsigned short address)
+{
+    Devices* devices = CPU -> devices;
+    double now = 0;
+    int expired = 0;
+
+    switch (address) {
+    case DEVICE_KBSR:
+        PollKey(devices);
+        CPU -> memory[address] = (devices -> key >= 0) ? 0x8000 : 0;
+        break;
+    case DEVICE_KBDR:
+        PollKey(devices);
+        CPU -> memory[address] = (devices -> key >= 0) ? (unsigned short)devices -> key : 0;
+        devices -> key = -1; // consumed
+        break;
+    case DEVICE_ADSR:
+        CPU -> memory[address] = 0x8000;
+        break;
+    case DEVICE_TSR:
+        if (devices -> warp) { // instructions stand in for time
+            expired = CPU -> instructions - devices -> timerInstruction >=
+                      (unsigned long long)CPU -> memory[DEVICE_TIR] * DEVICE_INSTRUCTIONS_PER_MS;
+        } else {
+            now = Now();
+            expired = (now - devices -> timerStart) * 1000 >= CPU -> memory[DEVICE_TIR];
+        }
+        if (expired) {
+            CPU -> memory[address] = 0x8000;
+            devices -> timerStart = now;
+            devices -> timerInstruction = CPU -> instructions;
+        } else {
+            CPU -> memory[address] = 0;
+        }
+        break;
+    default: // other words of the page are plain memory
+        return 0;
+    }
+
+    if (devices -> warp && (address == DEVICE_KBSR || address == DEVICE_TSR)) {
+        return Warp(CPU, address);
+    }
+    return 0;
+}
+
+
+/*
+ * Act on a store to a device page.
+ */
+void DeviceStore(MachineState* CPU, unsigned short address)
+{
+    Devices* devices = CPU -> devices;
+
+    if (address < DEVICE_KBSR) { // video memory
+        MarkDirty(devices, address, 1);
+        return;
+    }
+
+    if (address == DEVICE_ADDR) {
+        devices -> pending[devices -> pendingUsed++] = (char)(CPU -> memory[address] & 0xFF);
+        if (devices -> pendingUsed == DEVICE_OUTPUT_BUFFER) {
+            FlushConsole(devices);
+        }
+    } else if (address == DEVICE_VDCR && CPU -> memory[address] == 1) { // clear the screen
+        memset(&CPU -> memory[VIDEO_BASE], 0, VIDEO_WIDTH * VIDEO_HEIGHT * sizeof(unsigned short));
+        InvalidateWords(CPU, VIDEO_BASE, VIDEO_WIDTH * VIDEO_HEIGHT);
+        MarkDirty(devices, VIDEO_BASE, VIDEO_WIDTH * VIDEO_HEIGHT);
+    } else if (address == DEVICE_VDCR && CPU -> memory[address] == 2) { // present
+        if (DevicesFrame(CPU) != 0) {
+            devices -> frames = NULL; // reported once, no more frames
+        }
+    }
+}
+
+
+/*
+ * Write the next frame if the framebuffer changed.
+ */
+int DevicesFrame(MachineState* CPU)
+{
+    Devices* devices = CPU -> devices;
+    char filename[4096];
+    unsigned short pixel = 0;
+    unsigned char* rgb;
+    FILE* file;
+    int row = 0;
+    int column = 0;
+    int status = 0;
+
+    if (devices -> frames == NULL || devices -> dirtyRows == 0) {
+        return 0;
+    }
+
+    for (row = 0; row < VIDEO_HEIGHT; row++) { // convert the rows that changed
+        if (!devices -> dirty[row]) {
+            continue;
+        }
+        rgb = devices -> rgb[row];
+        for (column = 0; column < VIDEO_WIDTH; column++) {
+            pixel = CPU -> memory[VIDEO_BASE + row * VIDEO_WIDTH + column];
+            rgb[column * 3] = ((pixel >> 10) & 0x1F) << 3 | ((pixel >> 12) & 0x7); // 5 bits to 8
+            rgb[column * 3 + 1] = ((pixel >> 5) & 0x1F) << 3 | ((pixel >> 7) & 0x7);
+            rgb[column * 3 + 2] = (pixel & 0x1F) << 3 | ((pixel >> 2) & 0x7);
+        }
+        devices -> dirty[row] = 0;
+    }
+    devices -> dirtyRows = 0;
+
+    snprintf(filename, sizeof(filename), "%s%06u.ppm", devices -> frames, devices -> frameCount);
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "error: frame %s could not be open\n", filename);
+        return -1;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", VIDEO_WIDTH, VIDEO_HEIGHT);
+    if (fwrite(devices -> rgb, sizeof(devices -> rgb), 1, file) != 1) {
+        status = -1;
+    }
+    if (fclose(file) != 0 || status != 0) {
+        fprintf(stderr, "error: frame %s could not be written\n", filename);
+        return -1;
+    }
+    devices -> frameCount++;
+    return 0;
+}
+
+
+/*
+ * Finish the console and framebuffer output and detach.
+ */
+int DevicesClose(MachineState* CPU)
+{
+    Devices* devices = CPU -> devices;
+    int status = 0;
+    int page = 0;
+
+    if (devices == NULL) {
+        return 0;
+    }
+    status = DevicesFrame(CPU);
+    if (FlushConsole(devices) != 0) {
+        fprintf(stderr, "error: console output could not be written\n");
+        status = -1;
+    }
+
+    for (page = 0; page < 256; page++) {
+        CPU -> devicePage[page] &= ~(DEVICE_HOOK_LOAD | DEVICE_HOOK_STORE);
+    }
+    CPU -> devices = NULL;
+    free(devices);
+    return status;
+}
@@ -0,0 +1,129 @@
+/*
+ * devices.h: Declares the memory-mapped LC4 devices (--devices, --frames)
+ *
+ * Device registers live in the OS page at xFE00 and video memory at
+ * xC000-xFDFF (128 x 124 pixels, one word each, 5-5-5 RGB). Memory keeps
+ * mirroring every register, so the interpreters read and write it as usual:
+ * before an LDR from a hooked page DeviceLoad refreshes the word from the
+ * device, and after an STR DeviceStore acts on what was written. Which pages
+ * are hooked is kept per page in CPU -> devicePage.
+ *
+ *   xFE00 KBSR  bit 15 set while a key is waiting (read from the console input)
+ *   xFE02 KBDR  the waiting key; reading it consumes the key
+ *   xFE04 ADSR  bit 15 always set: the display is always ready
+ *   xFE06 ADDR  writing prints the low byte (console output is batched)
+ *   xFE08 TSR   bit 15 set once TIR milliseconds passed since it last was
+ *   xFE0A TIR   timer interval in milliseconds
+ *   xFE0C VDCR  writing 1 clears video memory, writing 2 presents a frame
+ *
+ * The framebuffer keeps an RGB copy of video memory and a dirty flag per row.
+ * A frame is converted (dirty rows only) and written as a PPM file when it is
+ * presented or the run ends, and only if a row changed since the last one.
+ *
+ * With time warp (--time-warp) the timer counts instructions instead of
+ * wall-clock time, DEVICE_INSTRUCTIONS_PER_MS of them per millisecond, and
+ * programs spinning on KBSR or TSR are fast-forwarded. A status register read
+ * that finds the device not ready, from the same LDR and with the same
+ * registers and PSR as the previous device read, inside a short loop that
+ * cannot store or call anything, means every further iteration will be the
+ * same until the device changes: the iterations up to the timer expiring are
+ * skipped in one step (counted in CPU -> instructions, optionally noted in
+ * the text trace), and a wait for a key that can no longer come ends the run.
+ */
+
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include "LC4.h"
+
+#define DEVICE_KBSR 0xFE00
+#define DEVICE_KBDR 0xFE02
+#define DEVICE_ADSR 0xFE04
+#define DEVICE_ADDR 0xFE06
+#define DEVICE_TSR 0xFE08
+#define DEVICE_TIR 0xFE0A
+#define DEVICE_VDCR 0xFE0C
+
+#define VIDEO_BASE 0xC000
+#define VIDEO_WIDTH 128
+#define VIDEO_HEIGHT 124
+
+// CPU -> devicePage bits: which accesses to a page go through the devices
+#define DEVICE_HOOK_LOAD 0x1
+#define DEVICE_HOOK_STORE 0x2
+
+#define DEVICE_OUTPUT_BUFFER 4096 // console bytes held before they are written
+#define DEVICE_INSTRUCTIONS_PER_MS 10000 // timer rate with time warp (a 10 MHz LC4)
+#define DEVICE_POLL_BODY 16 // longest polling loop time warp recognizes, in words
+
+typedef struct Devices {
+    // Console
+    FILE* input; // keyboard (NULL = no key ever arrives)
+    FILE* output; // display
+    int key; // waiting key, -1 = none
+    char pending[DEVICE_OUTPUT_BUFFER]; // display bytes not yet written
+    size_t pendingUsed;
+
+    // Timer
+    double timerStart; // seconds when TSR last read as expired
+    unsigned long long timerInstruction; // instruction count then (time warp)
+
+    // Time warp (--time-warp): the last status register read, to spot polling loops
+    int warp; // on
+    int noteElided; // --trace-elided: note each skipped loop in the text trace
+    unsigned short pollPC; // LDR that read it
+    unsigned short pollAddress; // 0 = none yet
+    unsigned short pollR[8]; // registers and PSR then
+    unsigned short pollPSR;
+    unsigned long long pollInstruction; // CPU -> instructions then
+
+    // Framebuffer
+    const char* frames; // PPM files are written to <frames>NNNNNN.ppm (NULL = none)
+    unsigned int frameCount; // frames written so far
+    unsigned char dirty[VIDEO_HEIGHT]; // rows stored into since the last frame
+    int dirtyRows; // rows set in dirty
+    unsigned char rgb[VIDEO_HEIGHT][VIDEO_WIDTH * 3]; // converted rows
+} Devices;
+
+
+/*
+ * Create the devices: a console on input/output and, when frames is set, a
+ * framebuffer writing PPM frames. Returns NULL if out of memory.
+ */
+Devices* DevicesCreate(FILE* input, FILE* output, const char* frames);
+
+
+/*
+ * Route CPU's accesses to the device pages through devices.
+ */
+void DevicesAttach(MachineState* CPU, Devices* devices);
+
+
+/*
+ * Refresh memory[address] from the device behind it before a load by the LDR
+ * at CPU -> PC (CPU -> instructions counting it). Returns 0, or -1 if time
+ * warp found the program waiting for a key that will never come.
+ */
+int DeviceLoad(MachineState* CPU, unsigned short address);
+
+
+/*
+ * Act on the word just stored at memory[address].
+ */
+void DeviceStore(MachineState* CPU, unsigned short address);
+
+
+/*
+ * Write the framebuffer as the next PPM frame if a row changed since the
+ * last one. Returns 0, or -1 if the file could not be written.
+ */
+int DevicesFrame(MachineState* CPU);
+
+
+/*
+ * Flush console output, write a final frame if needed and detach the devices
+ * from CPU. Returns 0, or -1 if output was lost.
+ */
+int DevicesClose(MachineState* CPU);
+
+#endif
@@ -0,0 +1,843 @@
+/*
+ * gdbstub.c: GDB remote serial protocol server (--gdb)
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "gdbstub.h"
+#include "debug.h"
+#include "reverse.h"
+
+#define GDB_INTERRUPT (-2) // ReadPacket got Ctrl-C
+#define GDB_SERVE (-1) // HandlePacket: go on reading packets
+
+#define GDB_REGISTERS 10 // R0-R7, PC, PSR
+
+static const char hex[] = "0123456789abcdef";
+
+// Stop reason of each WATCH_* kind
+static const char* watchNames[WATCH_KINDS] = {"watch", "rwatch", "awatch"};
+
+// Register layout given to qXfer:features:read
+static const char targetXml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\"><feature name=\"org.lc4.core\">"
+    "<reg name=\"r0\" bitsize=\"16\" type=\"uint16\" regnum=\"0\"/>"
+    "<reg name=\"r1\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r2\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r3\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r4\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r5\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r6\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r7\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "<reg name=\"psr\" bitsize=\"16\" type=\"uint16\"/>"
+    "</feature></target>";
+
+
+/*
+ * Value of a hex digit, -1 if c is not one.
+ */
+static int HexValue(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+
+/*
+ * Parse the hex number at *text, moving *text past it.
+ */
+static unsigned long ParseHex(const char** text)
+{
+    unsigned long value = 0;
+
+    while (HexValue(**text) >= 0) {
+        value = value * 16 + HexValue(**text);
+        (*text)++;
+    }
+    return value;
+}
+
+
+/*
+ * Append a word as 4 hex digits, most significant byte first.
+ */
+static char* PutWord(char* text, unsigned short value)
+{
+    text[0] = hex[(value >> 12) & 0xF];
+    text[1] = hex[(value >> 8) & 0xF];
+    text[2] = hex[(value >> 4) & 0xF];
+    text[3] = hex[value & 0xF];
+    return text + 4;
+}
+
+
+/*
+ * Parse 4 hex digits as a word. Returns -1 if they are not.
+ */
+static long GetWord(const char* text)
+{
+    long value = 0;
+    int i = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (HexValue(text[i]) < 0) {
+            return -1;
+        }
+        value = value * 16 + HexValue(text[i]);
+    }
+    return value;
+}
+
+
+/*
+ * The debugger went away.
+ */
+static void Lost(GdbStub* stub)
+{
+    if (stub -> connection >= 0) {
+        close(stub -> connection);
+        stub -> connection = -1;
+    }
+    stub -> inputNext = stub -> inputUsed = 0;
+}
+
+
+/*
+ * Next byte from the debugger, waiting for it. Returns -1 once it went away.
+ */
+static int ReadByte(GdbStub* stub)
+{
+    ssize_t got = 0;
+
+    if (stub -> inputNext == stub -> inputUsed) {
+        if (stub -> connection < 0) {
+            return -1;
+        }
+        do {
+            got = recv(stub -> connection, stub -> input, sizeof(stub -> input), 0);
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) {
+            Lost(stub);
+            return -1;
+        }
+        stub -> inputNext = 0;
+        stub -> inputUsed = (int)got;
+    }
+    return (unsigned char)stub -> input[stub -> inputNext++];
+}
+
+
+/*
+ * Send length bytes to the debugger. Returns 0, or -1 once it went away.
+ */
+static int WriteAll(GdbStub* stub, const char* data, size_t length)
+{
+    ssize_t sent = 0;
+
+    while (length != 0 && stub -> connection >= 0) {
+        sent = send(stub -> connection, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            Lost(stub);
+            break;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return (stub -> connection >= 0) ? 0 : -1;
+}
+
+
+/*
+ * Send text as a packet, again until the debugger acknowledges it.
+ */
+static int SendPacket(GdbStub* stub, const char* text)
+{
+    char frame[GDB_PACKET_SIZE + 5]; // $text#cs
+    unsigned char sum = 0;
+    size_t length = 0;
+    int c = 0;
+
+    for (length = 0; text[length] != 0 && length < GDB_PACKET_SIZE; length++) {
+        frame[length + 1] = text[length];
+        sum += (unsigned char)text[length];
+    }
+    frame[0] = '$';
+    frame[length + 1] = '#';
+    frame[length + 2] = hex[sum >> 4];
+    frame[length + 3] = hex[sum & 0xF];
+
+    for (;;) {
+        if (WriteAll(stub, frame, length + 4) != 0) {
+            return -1;
+        }
+        if (stub -> noAck) {
+            return 0;
+        }
+        do {
+            c = ReadByte(stub);
+        } while (c >= 0 && c != '+' && c != '-');
+        if (c != '-') {
+            return (c < 0) ? -1 : 0;
+        }
+    }
+}
+
+
+/*
+ * Wait for the next packet into stub -> packet. Returns its length, -1 once
+ * the debugger went away, or GDB_INTERRUPT for Ctrl-C.
+ */
+static int ReadPacket(GdbStub* stub)
+{
+    int length = 0;
+    int overflow = 0;
+    int sum = 0;
+    int high = 0;
+    int low = 0;
+    int c = 0;
+
+    for (;;) {
+        c = ReadByte(stub);
+        if (c < 0) {
+            return -1;
+        } else if (c == 0x03) {
+            return GDB_INTERRUPT;
+        } else if (c != '$') { // acknowledgements and line noise
+            continue;
+        }
+
+        length = 0;
+        overflow = 0;
+        sum = 0;
+        while ((c = ReadByte(stub)) >= 0 && c != '#') {
+            if (length < GDB_PACKET_SIZE) {
+                stub -> packet[length++] = (char)c;
+            } else {
+                overflow = 1;
+            }
+            sum += c;
+        }
+        high = ReadByte(stub);
+        low = ReadByte(stub);
+        if (c < 0 || high < 0 || low < 0) {
+            return -1;
+        }
+        stub -> packet[length] = 0;
+
+        if (stub -> noAck) {
+            return length;
+        }
+        if (!overflow && HexValue(high) * 16 + HexValue(low) == (sum & 0xFF)) {
+            WriteAll(stub, "+", 1);
+            return length;
+        }
+        WriteAll(stub, "-", 1); // sent again
+    }
+}
+
+
+/*
+ * Whether Ctrl-C came (or the debugger went away) while the machine ran.
+ */
+static int Interrupted(GdbStub* stub)
+{
+    struct pollfd ready;
+    int c = 0;
+
+    ready.fd = stub -> connection;
+    ready.events = POLLIN;
+    while (stub -> inputNext < stub -> inputUsed ||
+           (stub -> connection >= 0 && poll(&ready, 1, 0) > 0)) {
+        c = ReadByte(stub);
+        if (c < 0 || c == 0x03) {
+            return 1;
+        }
+    }
+    return stub -> connection < 0;
+}
+
+
+/*
+ * Report that the machine stopped, and keep the reply for '?'.
+ */
+static void Report(GdbStub* stub, const char* stop)
+{
+    snprintf(stub -> stop, sizeof(stub -> stop), "%s", stop);
+    stub -> action = GDB_IDLE;
+    SendPacket(stub, stub -> stop);
+}
+
+
+/*
+ * Report a breakpoint stop.
+ */
+static void ReportBreak(GdbStub* stub)
+{
+    Report(stub, stub -> swbreak ? "T05swbreak:;" : "T05");
+}
+
+
+/*
+ * Report the watchpoint hit DebugWatch recorded.
+ */
+static void ReportWatch(GdbStub* stub)
+{
+    Debugger* debugger = stub -> CPU -> debugger;
+    char stop[64];
+
+    snprintf(stop, sizeof(stop), "T05%s:%x;", watchNames[debugger -> watchKind], debugger -> watchAddress);
+    debugger -> watchHit = 0;
+    Report(stub, stop);
+}
+
+
+/*
+ * Register n (R0-R7, PC, PSR).
+ */
+static unsigned short GetRegister(MachineState* CPU, int n)
+{
+    return (n < 8) ? CPU -> R[n] : ((n == 8) ? CPU -> PC : CPU -> PSR);
+}
+
+static void SetRegister(MachineState* CPU, int n, unsigned short value)
+{
+    if (n < 8) {
+        CPU -> R[n] = value;
+    } else if (n == 8) {
+        CPU -> PC = value;
+    } else {
+        if ((value & 0x7) != (CPU -> PSR & 0x7)) { // NZPVal follows the NZP bits as SetNZP keeps it
+            CPU -> NZPVal = value & 0x7;
+        }
+        CPU -> PSR = value;
+    }
+}
+
+
+/*
+ * m addr,length: length bytes from word addr on, 2 per word.
+ */
+static void ReadMemory(GdbStub* stub, const char* arguments)
+{
+    MachineState* CPU = stub -> CPU;
+    unsigned short address = (unsigned short)ParseHex(&arguments);
+    unsigned long length = 0;
+    unsigned short word = 0;
+    unsigned long i = 0;
+
+    if (*arguments++ != ',') {
+        snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+        return;
+    }
+    length = ParseHex(&arguments);
+    if (length > GDB_PACKET_SIZE / 2) {
+        length = GDB_PACKET_SIZE / 2;
+    }
+    for (i = 0; i < length; i++) {
+        word = CPU -> memory[(unsigned short)(address + i / 2)];
+        word = (i % 2 == 0) ? (word >> 8) : (word & 0xFF);
+        stub -> reply[i * 2] = hex[word >> 4];
+        stub -> reply[i * 2 + 1] = hex[word & 0xF];
+    }
+    stub -> reply[length * 2] = 0;
+}
+
+
+/*
+ * M addr,length:data: write whole words from word addr on.
+ */
+static void WriteMemory(GdbStub* stub, const char* arguments)
+{
+    MachineState* CPU = stub -> CPU;
+    unsigned short address = (unsigned short)ParseHex(&arguments);
+    unsigned long length = 0;
+    unsigned long i = 0;
+    long value = 0;
+
+    snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+    if (*arguments++ != ',') {
+        return;
+    }
+    length = ParseHex(&arguments);
+    if (*arguments++ != ':' || length % 2 != 0 || strlen(arguments) != length * 2) {
+        return; // only whole words
+    }
+    for (i = 0; i < length / 2; i++) { // check first, then write
+        if (GetWord(arguments + i * 4) < 0) {
+            return;
+        }
+    }
+    for (i = 0; i < length / 2; i++) {
+        value = GetWord(arguments + i * 4);
+        StoreWord(CPU, (unsigned short)(address + i), (unsigned short)value);
+    }
+    snprintf(stub -> reply, sizeof(stub -> reply), "OK");
+}
+
+
+/*
+ * Z/z type,addr,kind: insert or remove a breakpoint or watchpoint.
+ */
+static void SetPoint(GdbStub* stub, const char* arguments, int on)
+{
+    MachineState* CPU = stub -> CPU;
+    int type = HexValue(*arguments++);
+    unsigned short address = 0;
+    unsigned long length = 0;
+
+    if (type < 0 || type > 4) {
+        stub -> reply[0] = 0; // not supported
+        return;
+    }
+    snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+    if (*arguments++ != ',') {
+        return;
+    }
+    address = (unsigned short)ParseHex(&arguments);
+    if (*arguments++ != ',') {
+        return;
+    }
+    length = ParseHex(&arguments); // kind for breakpoints, bytes for watchpoints
+
+    if (type <= 1) { // software and hardware breakpoints are the same here
+        DebugSetBreakpoint(CPU, address, on);
+    } else if (DebugSetWatch(CPU, address, (length > 2) ? (int)((length + 1) / 2) : 1, type - 2, on) != 0) {
+        return;
+    }
+    snprintf(stub -> reply, sizeof(stub -> reply), "OK");
+}
+
+
+/*
+ * qXfer:features:read:target.xml:offset,length
+ */
+static void ReadFeatures(GdbStub* stub, const char* arguments)
+{
+    unsigned long offset = 0;
+    unsigned long length = 0;
+    unsigned long size = sizeof(targetXml) - 1;
+
+    if (strncmp(arguments, "target.xml:", 11) != 0) {
+        snprintf(stub -> reply, sizeof(stub -> reply), "E00");
+        return;
+    }
+    arguments += 11;
+    offset = ParseHex(&arguments);
+    if (*arguments++ != ',') {
+        snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+        return;
+    }
+    length = ParseHex(&arguments);
+    if (offset > size) {
+        offset = size;
+    }
+    if (length > size - offset) {
+        length = size - offset;
+    }
+    if (length > GDB_PACKET_SIZE - 1) {
+        length = GDB_PACKET_SIZE - 1;
+    }
+    stub -> reply[0] = (offset + length < size) ? 'm' : 'l'; // 'l': the last part
+    memcpy(stub -> reply + 1, targetXml + offset, length);
+    stub -> reply[length + 1] = 0;
+}
+
+
+/*
+ * q and Q packets.
+ */
+static void Query(GdbStub* stub)
+{
+    const char* packet = stub -> packet;
+
+    stub -> reply[0] = 0;
+    if (strncmp(packet, "qSupported", 10) == 0) {
+        stub -> swbreak = (strstr(packet, "swbreak+") != NULL);
+        snprintf(stub -> reply, sizeof(stub -> reply),
+                 "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;swbreak+;hwbreak+%s",
+                 GDB_PACKET_SIZE, (stub -> CPU -> reverse != NULL) ? ";ReverseStep+;ReverseContinue+" : "");
+    } else if (strncmp(packet, "qXfer:features:read:", 20) == 0) {
+        ReadFeatures(stub, packet + 20);
+    } else if (strcmp(packet, "QStartNoAckMode") == 0) {
+        snprintf(stub -> reply, sizeof(stub -> reply), "OK");
+    } else if (strcmp(packet, "qAttached") == 0) {
+        snprintf(stub -> reply, sizeof(stub -> reply), "1");
+    } else if (strcmp(packet, "qC") == 0) {
+        snprintf(stub -> reply, sizeof(stub -> reply), "QC1");
+    } else if (strcmp(packet, "qfThreadInfo") == 0) {
+        snprintf(stub -> reply, sizeof(stub -> reply), "m1");
+    } else if (strcmp(packet, "qsThreadInfo") == 0) {
+        snprintf(stub -> reply, sizeof(stub -> reply), "l");
+    }
+}
+
+
+/*
+ * bc / bs: run backwards through the undo log, one instruction or until a
+ * breakpoint, a watched access or the start of the history.
+ */
+static void RunBackwards(GdbStub* stub, int continuing)
+{
+    MachineState* CPU = stub -> CPU;
+    Debugger* debugger = CPU -> debugger;
+    UndoEntry undone;
+    DecodedInsn insn;
+    unsigned long long steps = 0;
+
+    for (steps = 1; ; steps++) {
+        if (ReverseStep(CPU, &undone) != 0) {
+            Report(stub, "T05replaylog:begin;");
+            return;
+        }
+        if (!continuing) {
+            Report(stub, "S05");
+            return;
+        }
+        if (debugger -> breakpoint[CPU -> PC]) {
+            ReportBreak(stub);
+            return;
+        }
+        DecodeInsn(undone.pc, CPU -> memory[undone.pc], &insn); // registers are back as the instruction saw them
+        if (((undone.flags & UNDO_STORED) && DebugWatch(CPU, undone.address, WATCH_WRITE)) ||
+            (insn.handler == H_LDR && DebugWatch(CPU, CPU -> R[insn.rs] + insn.imm, WATCH_READ))) {
+            ReportWatch(stub);
+            return;
+        }
+        if (steps % GDB_SLICE == 0 && Interrupted(stub)) {
+            Report(stub, "S02");
+            return;
+        }
+    }
+}
+
+
+/*
+ * Start running for the debugger: a breakpoint at the PC is taken out for
+ * the first instruction, so resuming from it does not stop again at once.
+ */
+static int Resume(GdbStub* stub, int action, unsigned long long* budget)
+{
+    MachineState* CPU = stub -> CPU;
+    const char* address = stub -> packet + 1;
+
+    if (*address != 0) { // c addr / s addr
+        CPU -> PC = (unsigned short)ParseHex(&address);
+    }
+    stub -> action = action;
+    if (CPU -> debugger -> breakpoint[CPU -> PC]) {
+        stub -> stepOver = CPU -> PC;
+        DebugSetBreakpoint(CPU, CPU -> PC, 0);
+        *budget = 1;
+    } else {
+        *budget = (action == GDB_STEP) ? 1 : GDB_SLICE;
+    }
+    return GDB_RUN;
+}
+
+
+/*
+ * Answer the packet in stub -> packet. Returns GDB_SERVE to go on reading
+ * packets, or what GdbNext returns.
+ */
+static int HandlePacket(GdbStub* stub, unsigned long long* budget)
+{
+    MachineState* CPU = stub -> CPU;
+    const char* arguments = stub -> packet + 1;
+    char* text = stub -> reply;
+    long value = 0;
+    int n = 0;
+
+    stub -> reply[0] = 0; // empty reply: not supported
+    switch (stub -> packet[0]) {
+    case '?':
+        snprintf(stub -> reply, sizeof(stub -> reply), "%s", stub -> stop);
+        break;
+
+    case 'g': // all registers
+        for (n = 0; n < GDB_REGISTERS; n++) {
+            text = PutWord(text, GetRegister(CPU, n));
+        }
+        *text = 0;
+        break;
+
+    case 'G':
+        if (strlen(arguments) != GDB_REGISTERS * 4) {
+            snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+            break;
+        }
+        for (n = 0; n < GDB_REGISTERS && GetWord(arguments + n * 4) >= 0; n++);
+        if (n < GDB_REGISTERS) {
+            snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+            break;
+        }
+        for (n = 0; n < GDB_REGISTERS; n++) {
+            SetRegister(CPU, n, (unsigned short)GetWord(arguments + n * 4));
+        }
+        snprintf(stub -> reply, sizeof(stub -> reply), "OK");
+        break;
+
+    case 'p': // one register
+        n = (int)ParseHex(&arguments);
+        if (n >= GDB_REGISTERS) {
+            snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+            break;
+        }
+        *PutWord(text, GetRegister(CPU, n)) = 0;
+        break;
+
+    case 'P':
+        n = (int)ParseHex(&arguments);
+        value = (*arguments == '=') ? GetWord(arguments + 1) : -1;
+        if (n >= GDB_REGISTERS || value < 0) {
+            snprintf(stub -> reply, sizeof(stub -> reply), "E01");
+            break;
+        }
+        SetRegister(CPU, n, (unsigned short)value);
+        snprintf(stub -> reply, sizeof(stub -> reply), "OK");
+        break;
+
+    case 'm':
+        ReadMemory(stub, arguments);
+        break;
+
+    case 'M':
+        WriteMemory(stub, arguments);
+        break;
+
+    case 'c':
+        return Resume(stub, GDB_CONTINUE, budget);
+
+    case 's':
+        return Resume(stub, GDB_STEP, budget);
+
+    case 'b': // bc, bs
+        if (CPU -> reverse != NULL && (stub -> packet[1] == 'c' || stub -> packet[1] == 's') && stub -> packet[2] == 0) {
+            RunBackwards(stub, stub -> packet[1] == 'c');
+            return GDB_SERVE; // already reported
+        }
+        break;
+
+    case 'Z':
+        SetPoint(stub, arguments, 1);
+        break;
+
+    case 'z':
+        SetPoint(stub, arguments, 0);
+        break;
+
+    case 'q':
+    case 'Q':
+        Query(stub);
+        break;
+
+    case 'H': // one thread
+    case 'T':
+        snprintf(stub -> reply, sizeof(stub -> reply), "OK");
+        break;
+
+    case 'D':
+        SendPacket(stub, "OK");
+        return GDB_DETACH;
+
+    case 'k':
+        return GDB_KILL;
+
+    case 'v':
+        if (strncmp(stub -> packet, "vKill", 5) == 0) {
+            SendPacket(stub, "OK");
+            return GDB_KILL;
+        }
+        break;
+    }
+
+    SendPacket(stub, stub -> reply);
+    if (strcmp(stub -> packet, "QStartNoAckMode") == 0) { // from after its acknowledgement on
+        stub -> noAck = 1;
+    }
+    return GDB_SERVE;
+}
+
+
+/*
+ * Listen on address and wait for the debugger. Returns 0, or -1 with the
+ * error printed.
+ */
+static int Listen(GdbStub* stub, const char* address)
+{
+    struct sockaddr_in inet;
+    struct sockaddr_un local;
+    struct stat status;
+    char* end = NULL;
+    long port = 0;
+    int one = 1;
+
+    if (strchr(address, '/') != NULL) { // Unix socket
+        if (strlen(address) >= sizeof(local.sun_path)) {
+            fprintf(stderr, "Error: socket path %s is too long\n", address);
+            return -1;
+        }
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, address);
+        if (stat(address, &status) == 0 && S_ISSOCK(status.st_mode)) { // left by an earlier run
+            unlink(address);
+        }
+        stub -> listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (stub -> listener < 0 || bind(stub -> listener, (struct sockaddr*)&local, sizeof(local)) != 0) {
+            fprintf(stderr, "Error: cannot listen on %s: %s\n", address, strerror(errno));
+            return -1;
+        }
+        stub -> path = address;
+    } else { // TCP port on localhost
+        port = strtol(address, &end, 10);
+        if (*address == 0 || *end != 0 || port <= 0 || port > 65535) {
+            fprintf(stderr, "Error: --gdb takes a port number or a socket path, not %s\n", address);
+            return -1;
+        }
+        memset(&inet, 0, sizeof(inet));
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons((unsigned short)port);
+        inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        stub -> listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (stub -> listener >= 0) {
+            setsockopt(stub -> listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (stub -> listener < 0 || bind(stub -> listener, (struct sockaddr*)&inet, sizeof(inet)) != 0) {
+            fprintf(stderr, "Error: cannot listen on localhost:%ld: %s\n", port, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (listen(stub -> listener, 1) != 0) {
+        fprintf(stderr, "Error: cannot listen on %s: %s\n", address, strerror(errno));
+        return -1;
+    }
+    fprintf(stderr, "Waiting for the debugger on %s%s\n", (stub -> path != NULL) ? "" : "localhost:", address);
+    do {
+        stub -> connection = accept(stub -> listener, NULL, NULL);
+    } while (stub -> connection < 0 && errno == EINTR);
+    if (stub -> connection < 0) {
+        fprintf(stderr, "Error: no debugger connected: %s\n", strerror(errno));
+        return -1;
+    }
+    if (stub -> path == NULL) { // packets are small and answered one at a time
+        setsockopt(stub -> connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for the debugger and attach the breakpoint and watchpoint tables.
+ */
+GdbStub* GdbOpen(MachineState* CPU, const char* address)
+{
+    GdbStub* stub = calloc(1, sizeof(GdbStub));
+
+    if (stub == NULL) {
+        fprintf(stderr, "Error: out of memory for the debugger\n");
+        return NULL;
+    }
+    stub -> CPU = CPU;
+    stub -> listener = -1;
+    stub -> connection = -1;
+    stub -> stepOver = -1;
+    snprintf(stub -> stop, sizeof(stub -> stop), "S05");
+    if (DebugAttach(CPU) != 0) {
+        fprintf(stderr, "Error: out of memory for the debugger\n");
+        GdbClose(stub);
+        return NULL;
+    }
+    if (Listen(stub, address) != 0) {
+        GdbClose(stub);
+        return NULL;
+    }
+    return stub;
+}
+
+
+/*
+ * Serve packets until the machine has to run.
+ */
+int GdbNext(GdbStub* stub, unsigned long long* budget)
+{
+    int status = GDB_SERVE;
+
+    while (status == GDB_SERVE) {
+        if (stub -> connection < 0) {
+            return GDB_KILL;
+        }
+        if (stub -> action != GDB_IDLE) { // a continue goes on
+            *budget = GDB_SLICE;
+            return GDB_RUN;
+        }
+        if (ReadPacket(stub) >= 0) { // Ctrl-C while stopped has nothing to interrupt
+            status = HandlePacket(stub, budget);
+        }
+    }
+    return status;
+}
+
+
+/*
+ * Take the result of a run.
+ */
+void GdbStopped(GdbStub* stub, int status)
+{
+    MachineState* CPU = stub -> CPU;
+
+    if (stub -> stepOver >= 0) { // put the breakpoint stepped over back
+        DebugSetBreakpoint(CPU, (unsigned short)stub -> stepOver, 1);
+        stub -> stepOver = -1;
+    }
+
+    if (status == 2 && CPU -> debugger -> watchHit) {
+        ReportWatch(stub);
+    } else if (status == 2) {
+        ReportBreak(stub);
+    } else if (status != 0) {
+        Report(stub, (status == 1) ? "W00" : "W01"); // halted, or the run failed
+    } else if (stub -> action == GDB_STEP) {
+        Report(stub, "S05");
+    } else if (Interrupted(stub)) {
+        Report(stub, "S02");
+    }
+}
+
+
+/*
+ * Remove the breakpoints and watchpoints and close the connection.
+ */
+void GdbClose(GdbStub* stub)
+{
+    if (stub == NULL) {
+        return;
+    }
+    Lost(stub);
+    if (stub -> listener >= 0) {
+        close(stub -> listener);
+    }
+    if (stub -> path != NULL) {
+        unlink(stub -> path);
+    }
+    DebugDetach(stub -> CPU);
+    free(stub);
+}
@@ -0,0 +1,97 @@
+/*
+ * gdbstub.h: Declares the GDB remote serial protocol server (--gdb)
+ *
+ * The stub listens on a localhost TCP port, or on a Unix socket when the
+ * address given holds a '/', and serves one debugger connection. main keeps
+ * running the machine on the engine it picked: GdbNext answers packets until
+ * the debugger resumes, hands out a budget of instructions to run, and
+ * GdbStopped takes the result. A continue runs GDB_SLICE instructions at a
+ * time (checking for an interrupt in between) until a breakpoint, watchpoint
+ * or the halt stops it, so between stops the machine runs at the speed of the
+ * engine (untraced with --no-trace).
+ *
+ * The target is described to the debugger as ten 16-bit registers: R0-R7,
+ * PC and PSR. Addresses in packets are LC4 word addresses, as the PC holds
+ * them, and each word reads and writes as 2 bytes, most significant first as
+ * in object files; register values are sent the same way. Supported:
+ *
+ *   ? g G p P m M c s k D          registers, memory, resume, kill, detach
+ *   Z0/Z1 z0/z1                    breakpoints (software and hardware alike)
+ *   Z2-Z4 z2-z4                    write, read and access watchpoints
+ *   bc bs                          reverse continue and step, with --reverse
+ *   qSupported qXfer:features:read (target.xml) QStartNoAckMode and the
+ *   single-thread queries; Ctrl-C interrupts a continue
+ *
+ * A breakpoint stop is reported as T05swbreak, a watchpoint as T05watch,
+ * T05rwatch or T05awatch with the word address (the access instruction has
+ * run), a finished step as S05, an interrupt as S02 and the halt as W00.
+ * Going back past the recorded history stops with T05replaylog:begin; the
+ * trace keeps its lines, and instructions run again after going back are
+ * traced again.
+ */
+
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+#include "LC4.h"
+
+#define GDB_PACKET_SIZE 4096 // largest packet taken or sent
+#define GDB_SLICE (1 << 20) // instructions a continue runs between checks for an interrupt
+
+// GdbNext results
+#define GDB_RUN 0 // run *budget instructions, then call GdbStopped
+#define GDB_DETACH 1 // the debugger detached: run on without it
+#define GDB_KILL 2 // the debugger killed the program or went away: stop the run
+
+// GdbStub.action
+#define GDB_IDLE 0 // waiting for packets
+#define GDB_CONTINUE 1
+#define GDB_STEP 2
+
+typedef struct GdbStub {
+    MachineState* CPU;
+    int listener; // listening socket
+    int connection; // the debugger, -1 once it went away
+    const char* path; // Unix socket to remove at the end (NULL for TCP)
+    int noAck; // QStartNoAckMode: no '+' / '-' exchanged
+    int swbreak; // the debugger takes swbreak stop reasons
+    int action; // GDB_IDLE, or what the machine is running for the debugger
+    int stepOver; // breakpoint taken out for one instruction, -1 if none
+    char stop[64]; // last stop reply, repeated for '?'
+    char input[GDB_PACKET_SIZE]; // bytes received and not handled yet
+    int inputNext;
+    int inputUsed;
+    char packet[GDB_PACKET_SIZE + 1]; // packet being handled
+    char reply[GDB_PACKET_SIZE + 1]; // and its reply
+} GdbStub;
+
+
+/*
+ * Listen on address (a TCP port on localhost, or the path of a Unix socket),
+ * wait for the debugger to connect and attach a debugger to CPU (see
+ * debug.h). Returns NULL on error.
+ */
+GdbStub* GdbOpen(MachineState* CPU, const char* address);
+
+
+/*
+ * Serve packets until the debugger resumes the machine (GDB_RUN, budget set
+ * to the instructions to run), detaches or kills it.
+ */
+int GdbNext(GdbStub* stub, unsigned long long* budget);
+
+
+/*
+ * Take the result of running the budget GdbNext gave (the run loop status:
+ * 0 budget used up, 1 halt, 2 breakpoint or watchpoint stop, -1 error),
+ * reporting a stop to the debugger if the machine stopped.
+ */
+void GdbStopped(GdbStub* stub, int status);
+
+
+/*
+ * Remove the breakpoints and watchpoints and close the connection.
+ */
+void GdbClose(GdbStub* stub);
+
+#endif
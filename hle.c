@@ -0,0 +1,258 @@
+/*
+ * hle.c: Native versions of the OS TRAP routines (--hle)
+ */
+
+#include "hle.h"
+#include "devices.h"
+
+#define HLE_SAVE 0xBFFF // word the routines save R6 in
+
+// A routine of the OS image that can run natively
+typedef struct {
+    const char* name;
+    unsigned short address; // entry point
+    const unsigned short* code; // its exact words
+    int length;
+    int (*run)(MachineState* CPU); // instructions it stands for (RTI included), 0 = interpret instead
+} HleRoutine;
+
+
+/*
+ * Whether the OS may make a perm access at address.
+ */
+static int Allowed(MachineState* CPU, unsigned short address, int perm)
+{
+    return PAGE_ALLOWS(CPU, CPU -> PSR, address, perm) != 0;
+}
+
+
+/*
+ * Whether address can be read as plain memory (readable, no device behind it).
+ */
+static int Plain(MachineState* CPU, unsigned short address)
+{
+    return Allowed(CPU, address, PERM_READ) && !(CPU -> devicePage[address >> 8] & DEVICE_HOOK_LOAD);
+}
+
+
+/*
+ * LDR and STR as the interpreters make them.
+ */
+static unsigned short Load(MachineState* CPU, unsigned short address)
+{
+    if (CPU -> devicePage[address >> 8] & DEVICE_HOOK_LOAD) {
+        DeviceLoad(CPU, address); // never a wait: routines that would wait are declined
+    }
+    return CPU -> memory[address];
+}
+
+static void Store(MachineState* CPU, unsigned short address, unsigned short value)
+{
+    StoreWord(CPU, address, value);
+    if (CPU -> devicePage[address >> 8] & DEVICE_HOOK_STORE) {
+        DeviceStore(CPU, address);
+    }
+}
+
+
+/*
+ * Whether DRAW_PTS leaves address alone (it stores to HLE_SAVE and video memory).
+ */
+static int Untouched(unsigned short address)
+{
+    return address != HLE_SAVE && (unsigned short)(address - VIDEO_BASE) >= VIDEO_WIDTH * VIDEO_HEIGHT;
+}
+
+
+/*
+ * Whether R6 can be saved to and restored from HLE_SAVE.
+ */
+static int CanSave(MachineState* CPU)
+{
+    return Plain(CPU, HLE_SAVE) && Allowed(CPU, HLE_SAVE, PERM_WRITE) &&
+           !(CPU -> devicePage[HLE_SAVE >> 8] & DEVICE_HOOK_STORE);
+}
+
+
+/*
+ * GETC: wait for a key, R1 = the key.
+ */
+static const unsigned short getcCode[] = {
+    0x9800, 0xD9FE, 0x6100, 0x07FC, 0x9802, 0xD9FE, 0x6300, 0x8000
+};
+
+static int HleGetc(MachineState* CPU)
+{
+    unsigned short* R = CPU -> R;
+    unsigned short status = 0;
+
+    if (!Allowed(CPU, DEVICE_KBSR, PERM_READ) || !Allowed(CPU, DEVICE_KBDR, PERM_READ)) {
+        return 0;
+    }
+    status = Load(CPU, DEVICE_KBSR);
+    if (!(status & 0x8000)) {
+        return 0; // no key will come: the interpreter polls
+    }
+
+    R[0] = status;
+    R[4] = DEVICE_KBDR;
+    R[1] = Load(CPU, DEVICE_KBDR);
+    SetNZP(CPU, R[1]);
+    return 8;
+}
+
+
+/*
+ * DRAW_PTS: R0 points (x, y) at R1 in color R2, skipping those off screen.
+ */
+static const unsigned short drawPointsCode[] = {
+    0x98FF, 0xD9BF, 0x7D00, 0x1D20, 0x6640, 0x6841, 0x1262, 0x2900, 0x080E,
+    0x9A7C, 0x2805, 0x060B, 0x2700, 0x0809, 0x9A80, 0x2605, 0x0606, 0x1B0D,
+    0x1B43, 0x9800, 0xD9C0, 0x1B44, 0x7540, 0x103F, 0x03EB, 0x6D80, 0x8000
+};
+
+static int HleDrawPoints(MachineState* CPU)
+{
+    unsigned short* R = CPU -> R;
+    unsigned short points = 0; // R1 as the loop advances it
+    unsigned short left = 0; // R0 as the loop counts it down
+    unsigned short address = 0;
+    short x = 0;
+    short y = 0;
+    int draw = 0; // 0: check every access first, 1: draw
+    int count = 0; // instructions
+
+    if (!CanSave(CPU)) {
+        return 0;
+    }
+
+    for (draw = 0; draw < 2; draw++) {
+        if (draw) {
+            Store(CPU, HLE_SAVE, R[6]);
+        }
+        points = R[1];
+        left = R[0];
+        count = 6; // prologue, final LDR and RTI
+        do {
+            if (!draw && (!Plain(CPU, points) || !Plain(CPU, points + 1) ||
+                !Untouched(points) || !Untouched(points + 1))) {
+                return 0;
+            }
+            x = (short)CPU -> memory[points];
+            y = (short)CPU -> memory[(unsigned short)(points + 1)];
+            points += 2;
+
+            if (y < 0) {
+                count += 7;
+            } else if (y >= VIDEO_HEIGHT || x < 0) {
+                count += (y >= VIDEO_HEIGHT) ? 10 : 12;
+                R[5] = draw ? VIDEO_HEIGHT : R[5];
+            } else if (x >= VIDEO_WIDTH) {
+                count += 15;
+                R[5] = draw ? VIDEO_WIDTH : R[5];
+            } else {
+                count += 21;
+                address = VIDEO_BASE + y * VIDEO_WIDTH + x;
+                if (!draw && !Allowed(CPU, address, PERM_WRITE)) {
+                    return 0;
+                }
+                if (draw) {
+                    Store(CPU, address, R[2]);
+                    R[5] = address;
+                    y = (short)VIDEO_BASE; // R4 is reused for the base
+                }
+            }
+            if (draw) {
+                R[3] = (unsigned short)x;
+                R[4] = (unsigned short)y;
+            }
+            left--;
+        } while ((short)left > 0);
+    }
+
+    R[0] = left;
+    R[1] = points;
+    R[6] = CPU -> memory[HLE_SAVE];
+    SetNZP(CPU, R[6]);
+    return count;
+}
+
+
+/*
+ * RESET_VMEM and BLT_VMEM: write 1 or 2 to VDCR.
+ */
+static const unsigned short resetVideoCode[] = {0x980C, 0xD9FE, 0x9A01, 0x7B00, 0x8000};
+static const unsigned short blitVideoCode[] = {0x980C, 0xD9FE, 0x9A02, 0x7B00, 0x8000};
+
+static int HleVideoControl(MachineState* CPU, unsigned short command)
+{
+    if (!Allowed(CPU, DEVICE_VDCR, PERM_WRITE)) {
+        return 0;
+    }
+    CPU -> R[4] = DEVICE_VDCR;
+    CPU -> R[5] = command;
+    Store(CPU, DEVICE_VDCR, command);
+    SetNZP(CPU, command);
+    return 5;
+}
+
+static int HleResetVideo(MachineState* CPU)
+{
+    return HleVideoControl(CPU, 1);
+}
+
+static int HleBlitVideo(MachineState* CPU)
+{
+    return HleVideoControl(CPU, 2);
+}
+
+
+#define CODE(WORDS) WORDS, (int)(sizeof(WORDS) / sizeof(WORDS[0]))
+
+static const HleRoutine routines[] = {
+    {"GETC", 0x8245, CODE(getcCode), HleGetc},
+    {"DRAW_PTS", 0x820F, CODE(drawPointsCode), HleDrawPoints},
+    {"RESET_VMEM", 0x822A, CODE(resetVideoCode), HleResetVideo},
+    {"BLT_VMEM", 0x822F, CODE(blitVideoCode), HleBlitVideo}
+};
+#define ROUTINE_COUNT (int)(sizeof(routines) / sizeof(routines[0]))
+
+
+/*
+ * Run the routine a TRAP vector leads to natively.
+ */
+int HleTrap(MachineState* CPU)
+{
+    unsigned short entry = CPU -> PC;
+    DecodedInsn vector; // the word at the TRAP vector
+    const HleRoutine* routine;
+    int jumps = 0; // 1 if the vector holds a JMP to the routine
+    int count = 0;
+    int i = 0;
+
+    if (entry == 0x80FF || !Allowed(CPU, entry, PERM_EXEC)) {
+        return 0; // halting, or the fetch faults
+    }
+    DecodeInsn(entry, CPU -> memory[entry], &vector);
+    if (vector.handler == H_JMP) { // to wherever the interpreters would go
+        entry = vector.target;
+        jumps = 1;
+    }
+
+    for (i = 0; i < ROUTINE_COUNT; i++) {
+        routine = &routines[i];
+        if (routine -> address == entry && Allowed(CPU, entry, PERM_EXEC) &&
+            Allowed(CPU, entry + routine -> length - 1, PERM_EXEC) &&
+            memcmp(&CPU -> memory[entry], routine -> code, routine -> length * sizeof(unsigned short)) == 0) {
+            count = routine -> run(CPU);
+            if (count == 0) {
+                return 0;
+            }
+            CPU -> instructions += jumps + count;
+            CPU -> PC = CPU -> R[7]; // RTI
+            CPU -> PSR = CPU -> PSR & 0x7FFF;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * hle.h: Declares high-level emulation of the OS TRAP routines (--hle)
+ *
+ * With CPU -> hle set, a TRAP into a known routine of the OS image (os.obj:
+ * GETC, DRAW_PTS, RESET_VMEM, BLT_VMEM) is carried out natively instead of
+ * instruction by instruction. PUTS is not one of them: it loops with a
+ * backward JMP, which the interpreters do not sign-extend, so interpreted
+ * it does not print the string the way a native version would. A routine is
+ * only recognized when the words at its address are exactly the known code,
+ * and it is left to the interpreter whenever it would fault or spin
+ * forever. Registers, PSR (including NZP) and memory end up as if the
+ * routine had run, device accesses happen the same way, and the routine's
+ * instructions are added to CPU -> instructions; only the trace lines of
+ * the routine are missing.
+ */
+
+#ifndef HLE_H
+#define HLE_H
+
+#include "LC4.h"
+
+
+/*
+ * Called right after a TRAP has set PC to its vector. Runs the routine the
+ * vector leads to natively if it is a known one, leaving PC at the return
+ * address as its RTI would. Returns 1 if it did, 0 if the interpreter has to.
+ */
+int HleTrap(MachineState* CPU);
+
+#endif
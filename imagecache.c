@@ -0,0 +1,178 @@
+/*
+ * imagecache.c: Prelinked memory image cache used by --image-cache
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "imagecache.h"
+#include "loader.h"
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL // 64-bit FNV-1a
+#define FNV_PRIME 0x100000001B3ULL
+
+
+static unsigned long long HashBytes(unsigned long long hash, const unsigned char* bytes, size_t length)
+{
+    size_t i = 0;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/*
+ * Hash the contents of the object files in order (each followed by its length
+ * so the boundaries count). Returns -1 if one cannot be read.
+ */
+static int HashInputs(char** files, int count, unsigned long long* key)
+{
+    unsigned char buffer[65536];
+    unsigned long long hash = HashBytes(FNV_OFFSET, (const unsigned char*)IMAGE_MAGIC, 4);
+    unsigned long long total = 0; // bytes in the current file
+    unsigned short version = IMAGE_VERSION;
+    size_t length = 0;
+    FILE* file;
+    int i = 0;
+
+    hash = HashBytes(hash, (const unsigned char*)&version, sizeof(version));
+    for (i = 0; i < count; i++) {
+        file = fopen(files[i], "rb");
+        if (file == NULL) {
+            return -1;
+        }
+        total = 0;
+        while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            hash = HashBytes(hash, buffer, length);
+            total += length;
+        }
+        if (ferror(file)) {
+            fclose(file);
+            return -1;
+        }
+        fclose(file);
+        hash = HashBytes(hash, (const unsigned char*)&total, sizeof(total));
+    }
+
+    *key = hash;
+    return 0;
+}
+
+
+/*
+ * Copy a cached image into memory. Returns -1 if there is no usable image.
+ */
+static int MapImage(MachineState* CPU, const char* path, unsigned long long key)
+{
+    const unsigned char* bytes;
+    const ImageHeader* header;
+    struct stat info;
+    size_t size = sizeof(ImageHeader) + sizeof(CPU -> memory);
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return -1; // not cached yet
+    }
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size != size) {
+        close(fd);
+        return -1;
+    }
+
+    bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        return -1;
+    }
+
+    header = (const ImageHeader*)bytes;
+    if (memcmp(header -> magic, IMAGE_MAGIC, 4) != 0 || header -> version != IMAGE_VERSION ||
+        header -> byteOrder != IMAGE_BYTE_ORDER || header -> key != key) {
+        munmap((void*)bytes, size);
+        return -1;
+    }
+
+    memcpy(CPU -> memory, bytes + sizeof(ImageHeader), sizeof(CPU -> memory));
+    InvalidateWords(CPU, 0, 65536);
+    munmap((void*)bytes, size);
+    return 0;
+}
+
+
+/*
+ * Write the loaded memory as the image for key (to a temporary name first, so
+ * concurrent runs never see half an image).
+ */
+static void SaveImage(MachineState* CPU, const char* path, unsigned long long key)
+{
+    ImageHeader header;
+    char* temporary = malloc(strlen(path) + 32);
+    FILE* file;
+    int status = 0;
+
+    if (temporary == NULL) {
+        return;
+    }
+    sprintf(temporary, "%s.%ld.tmp", path, (long)getpid());
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.byteOrder = IMAGE_BYTE_ORDER;
+    header.key = key;
+
+    file = fopen(temporary, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Warning: could not write image cache %s\n", temporary);
+        free(temporary);
+        return;
+    }
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(CPU -> memory, sizeof(CPU -> memory), 1, file) != 1) {
+        status = -1;
+    }
+    if (fclose(file) != 0 || status != 0 || rename(temporary, path) != 0) {
+        fprintf(stderr, "Warning: could not write image cache %s\n", path);
+        remove(temporary);
+    }
+    free(temporary);
+}
+
+
+/*
+ * Load the object files through the image cache.
+ */
+int LoadImageCached(MachineState* CPU, const char* dir, char** files, int count)
+{
+    unsigned long long key = 0; // hash of the inputs
+    char* path = NULL; // DIR/<key>.img
+    int cached = 0; // key computed, so the image can be used/saved
+    int i = 0;
+
+    if (HashInputs(files, count, &key) == 0) {
+        path = malloc(strlen(dir) + 32);
+        if (path != NULL) {
+            sprintf(path, "%s/%016llx.img", dir, key);
+            cached = 1;
+        }
+    }
+
+    if (cached && MapImage(CPU, path, key) == 0) {
+        free(path);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) { // Write all data into memory
+        if (ReadObjectFile(files[i], CPU) != 0) {
+            free(path);
+            return -1; // Error during ReadObjectFile()
+        }
+    }
+
+    if (cached) {
+        SaveImage(CPU, path, key);
+    }
+    free(path);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * imagecache.h: Declares the prelinked memory image cache used by --image-cache
+ *
+ * The fully loaded 64K-word memory is stored as DIR/<key>.img, where key is a
+ * hash of the contents of the .obj files in load order. A run with the same
+ * inputs maps the image instead of parsing the object files; any change to an
+ * input gives a different key, so stale images are never used.
+ */
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include "LC4.h"
+
+#define IMAGE_MAGIC "LC4I"
+#define IMAGE_VERSION 1 // bump when the loader or the image layout changes
+#define IMAGE_BYTE_ORDER 0x0102 // written in the writer's byte order
+
+typedef struct {
+    char magic[4]; // IMAGE_MAGIC
+    unsigned short version; // IMAGE_VERSION
+    unsigned short byteOrder; // IMAGE_BYTE_ORDER
+    unsigned long long key; // hash of the inputs, checked against the file name
+} ImageHeader; // followed by the 65536 memory words
+
+
+/*
+ * Load the count object files in files into memory, through the image cache in
+ * directory dir. Problems with the cache itself only produce a warning; the
+ * object files are then loaded the normal way. Returns 0 on success, -1 if
+ * an object file cannot be loaded.
+ */
+int LoadImageCached(MachineState* CPU, const char* dir, char** files, int count);
+
+#endif
@@ -0,0 +1,741 @@
+/*
+ * jit.c: Compiles hot LC4 basic blocks into x86-64 code
+ *
+ * Register use inside generated code:
+ *   r8w-r15w  LC4 R0-R7
+ *   bx        PSR
+ *   esi       PC of the next block (zero extended)
+ *   rdi       remaining instruction budget
+ *   rbp       MachineState*
+ *   rax, rcx, rdx scratch; [rsp] holds the entry table for the dispatcher
+ *
+ * Generated code never calls out. Blocks jump to a shared dispatcher that
+ * looks up the next compiled block and leaves through the exit stub on halt,
+ * an uncompiled target or an exhausted budget. TRAP, RTI, DIV and MOD are left
+ * to the interpreter, as are LDR/STR whose page permission check fails and STR
+ * into a page that holds cached code, and LDR/STR on a device page (side exits
+ * before the instruction executes), and code on pages only one privilege may
+ * fetch from.
+ */
+
+#include "jit.h"
+#include "devices.h"
+#include <stddef.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (16 << 20) // bytes of generated code before the cache is flushed
+#define JIT_MAX_INSN_BYTES 160 // upper bound on code emitted for one LC4 instruction
+#define JIT_NEVER 0xFFFF // hits value marking a block that cannot be compiled
+
+// Host register numbers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define HR(N) (8 + (N)) // host register pinned to LC4 register N
+
+// x86 opcodes for "op r/m, r" forms
+#define OP_ADD 0x01
+#define OP_OR 0x09
+#define OP_AND 0x21
+#define OP_SUB 0x29
+#define OP_XOR 0x31
+#define OP_TEST 0x85
+#define OP_MOV 0x89
+
+typedef unsigned long long (*JitEnterFn)(MachineState* CPU, unsigned long long remaining, void** entry);
+
+struct JitState {
+    unsigned char* code; // executable code cache
+    size_t used; // bytes of code emitted so far
+    size_t stubs; // bytes used by the entry/dispatch/exit stubs (kept across flushes)
+    unsigned char* dispatch; // dispatcher stub
+    unsigned char* exit; // exit stub
+    JitEnterFn enter; // entry stub
+
+    void* entry[65536]; // compiled code for the block starting at each PC
+    unsigned short hits[65536]; // interpretations of each block start
+    unsigned char length[65536]; // instructions covered by each compiled block
+    unsigned long long blockFlushes; // CPU -> blockFlushes when the cache was last checked
+};
+
+
+//////////////// CODE EMISSION HELPERS ///////////////////////////
+
+
+static void Byte(JitState* jit, unsigned int value)
+{
+    jit -> code[jit -> used++] = (unsigned char)value;
+}
+
+static void Word(JitState* jit, unsigned int value)
+{
+    Byte(jit, value & 0xFF);
+    Byte(jit, (value >> 8) & 0xFF);
+}
+
+static void Dword(JitState* jit, unsigned int value)
+{
+    Word(jit, value & 0xFFFF);
+    Word(jit, (value >> 16) & 0xFFFF);
+}
+
+// REX prefix when any extended register is involved (or W is requested)
+static void Rex(JitState* jit, int w, int reg, int index, int base)
+{
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+
+    if (rex != 0x40) {
+        Byte(jit, rex);
+    }
+}
+
+static void ModRM(JitState* jit, int mod, int reg, int rm)
+{
+    Byte(jit, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Relative 32-bit displacement from the end of the current instruction to target
+static void Rel32(JitState* jit, unsigned char* target)
+{
+    Dword(jit, (unsigned int)(target - (jit -> code + jit -> used + 4)));
+}
+
+// op r/m16, r16
+static void OpRR16(JitState* jit, int opcode, int rm, int reg)
+{
+    Byte(jit, 0x66);
+    Rex(jit, 0, reg, 0, rm);
+    Byte(jit, opcode);
+    ModRM(jit, 3, reg, rm);
+}
+
+// op r/m16, imm16 (ext selects add 0, or 1, and 4, sub 5, cmp 7)
+static void OpRI16(JitState* jit, int ext, int rm, unsigned short imm)
+{
+    Byte(jit, 0x66);
+    Rex(jit, 0, 0, 0, rm);
+    Byte(jit, 0x81);
+    ModRM(jit, 3, ext, rm);
+    Word(jit, imm);
+}
+
+// shl/shr r/m16, imm8 (ext 4 = shl, 5 = shr)
+static void Shift16(JitState* jit, int ext, int rm, int count)
+{
+    Byte(jit, 0x66);
+    Rex(jit, 0, 0, 0, rm);
+    Byte(jit, 0xC1);
+    ModRM(jit, 3, ext, rm);
+    Byte(jit, count);
+}
+
+// imul r16, r/m16
+static void Imul16(JitState* jit, int reg, int rm)
+{
+    Byte(jit, 0x66);
+    Rex(jit, 0, reg, 0, rm);
+    Byte(jit, 0x0F);
+    Byte(jit, 0xAF);
+    ModRM(jit, 3, reg, rm);
+}
+
+// movzx r32, r16
+static void Movzx16(JitState* jit, int reg, int rm)
+{
+    Rex(jit, 0, reg, 0, rm);
+    Byte(jit, 0x0F);
+    Byte(jit, 0xB7);
+    ModRM(jit, 3, reg, rm);
+}
+
+// mov r32, imm32
+static void MovRI32(JitState* jit, int reg, unsigned int imm)
+{
+    Rex(jit, 0, 0, 0, reg);
+    Byte(jit, 0xB8 + (reg & 7));
+    Dword(jit, imm);
+}
+
+// [rbp + disp32] operand
+static void MemRBP(JitState* jit, int reg, size_t disp)
+{
+    ModRM(jit, 2, reg, RBP);
+    Dword(jit, (unsigned int)disp);
+}
+
+// [rbp + index * scale + disp32] operand (scale given as log2)
+static void MemRBPIndex(JitState* jit, int reg, int index, int scale, size_t disp)
+{
+    ModRM(jit, 2, reg, 4);
+    Byte(jit, (scale << 6) | ((index & 7) << 3) | RBP);
+    Dword(jit, (unsigned int)disp);
+}
+
+static void JmpTo(JitState* jit, unsigned char* target)
+{
+    Byte(jit, 0xE9);
+    Rel32(jit, target);
+}
+
+
+//////////////// LC4 INSTRUCTION TRANSLATION ///////////////////////////
+
+
+/*
+ * PSR NZP bits from the 16-bit value in host register reg. Only valid while the
+ * NZP bits are one-hot or zero, which RunJit checks before entering native code.
+ */
+static void EmitNZP(JitState* jit, int reg)
+{
+    OpRR16(jit, OP_TEST, reg, reg);
+    Byte(jit, 0x0F); Byte(jit, 0x98); Byte(jit, 0xC0); // sets al
+    Byte(jit, 0x0F); Byte(jit, 0x94); Byte(jit, 0xC1); // sete cl
+    Byte(jit, 0x0F); Byte(jit, 0xB6); Byte(jit, 0xC0); // movzx eax, al
+    Byte(jit, 0x0F); Byte(jit, 0xB6); Byte(jit, 0xC9); // movzx ecx, cl
+    Byte(jit, 0x8D); Byte(jit, 0x44); Byte(jit, 0x40); Byte(jit, 0x01); // lea eax, [rax + rax*2 + 1]
+    Byte(jit, 0x01); Byte(jit, 0xC8); // add eax, ecx -> 4 (N), 2 (Z) or 1 (P)
+    Byte(jit, 0x81); Byte(jit, 0xE3); Dword(jit, 0xFFF8); // and ebx, ~7
+    Byte(jit, 0x09); Byte(jit, 0xC3); // or ebx, eax
+}
+
+
+/*
+ * Leave to the interpreter before the instruction at pc, giving back the
+ * budget charged for it and the rest of the block.
+ */
+static void EmitSideExit(JitState* jit, unsigned short pc, int refund)
+{
+    MovRI32(jit, RSI, pc);
+    Byte(jit, 0x48); Byte(jit, 0x81); Byte(jit, 0xC7); Dword(jit, refund); // add rdi, refund
+    JmpTo(jit, jit -> exit);
+}
+
+
+/*
+ * eax = (R[rs] + imm) & 0xFFFF, then side exit unless the memory map grants
+ * perm (PERM_READ or PERM_WRITE) on its page at the current privilege.
+ */
+static void EmitDataAddress(JitState* jit, DecodedInsn* insn, unsigned short pc, int refund, int perm)
+{
+    size_t skip; // offset of the rel8 to patch
+
+    Movzx16(jit, RAX, HR(insn -> rs));
+    if (insn -> imm != 0) {
+        OpRI16(jit, 0, RAX, insn -> imm); // add ax, imm
+    }
+    Movzx16(jit, RAX, RAX);
+
+    Byte(jit, 0x89); Byte(jit, 0xC1); // mov ecx, eax
+    Byte(jit, 0xC1); Byte(jit, 0xE9); Byte(jit, 8); // shr ecx, 8 -> page
+    Byte(jit, 0x0F); Byte(jit, 0xB6); // movzx ecx, byte [rbp + rcx + pagePerm]
+    MemRBPIndex(jit, RCX, RCX, 0, offsetof(MachineState, pagePerm));
+    Byte(jit, 0xF7); Byte(jit, 0xC3); Dword(jit, 0x8000); // test ebx, 0x8000
+    Byte(jit, 0x74); Byte(jit, 3); // jz +3
+    Byte(jit, 0xC1); Byte(jit, 0xE9); Byte(jit, PERM_OS_SHIFT); // shr ecx, PERM_OS_SHIFT -> OS bits
+    Byte(jit, 0xF6); Byte(jit, 0xC1); Byte(jit, perm); // test cl, perm
+    Byte(jit, 0x75); skip = jit -> used; Byte(jit, 0); // jnz ok
+    EmitSideExit(jit, pc, refund);
+    jit -> code[skip] = (unsigned char)(jit -> used - skip - 1);
+}
+
+
+/*
+ * Side exit unless the page number in ecx has none of the DEVICE_HOOK_* bits
+ * in hook, so the interpreter makes the access through the devices.
+ */
+static void EmitDeviceCheck(JitState* jit, int hook, unsigned short pc, int refund)
+{
+    size_t skip; // offset of the rel8 to patch
+
+    Byte(jit, 0xF6); // test byte [rbp + rcx + devicePage], hook
+    MemRBPIndex(jit, 0, RCX, 0, offsetof(MachineState, devicePage));
+    Byte(jit, hook);
+    Byte(jit, 0x74); skip = jit -> used; Byte(jit, 0); // jz ok
+    EmitSideExit(jit, pc, refund);
+    jit -> code[skip] = (unsigned char)(jit -> used - skip - 1);
+}
+
+
+/*
+ * Whether the instruction can be compiled (the rest run in the interpreter).
+ */
+static int Compilable(unsigned char handler)
+{
+    return handler != H_DIV && handler != H_MOD && handler != H_TRAP && handler != H_RTI &&
+           handler != H_INVALID && handler != H_DATA_FETCH && handler != H_BREAK && handler != H_UNDECODED;
+}
+
+
+/*
+ * Whether the compiled instruction ends by jumping to the dispatcher.
+ */
+static int Transfers(unsigned char handler)
+{
+    return (handler >= H_BRP && handler <= H_BRNZP) || handler == H_JSR || handler == H_JSRR ||
+           handler == H_JMP || handler == H_JMPR;
+}
+
+
+/*
+ * Whether the instruction sets NZP.
+ */
+static int SetsNZP(unsigned char handler)
+{
+    return (handler >= H_ADD && handler <= H_CMPIU) || (handler >= H_AND && handler <= H_LOGIC_NONE) ||
+           handler == H_LDR || handler == H_CONST || (handler >= H_SLL && handler <= H_MOD) ||
+           handler == H_HICONST || handler == H_TRAP;
+}
+
+
+/*
+ * Release all compiled blocks (the stubs stay).
+ */
+static void JitFlush(JitState* jit)
+{
+    memset(jit -> entry, 0, sizeof(jit -> entry));
+    memset(jit -> hits, 0, sizeof(jit -> hits));
+    jit -> used = jit -> stubs;
+}
+
+
+/*
+ * Compile the first compilable run of the cached block at pc. Returns the
+ * entry point, or NULL if its first instruction has to be interpreted.
+ */
+static void* CompileBlock(JitState* jit, MachineState* CPU, unsigned short pc)
+{
+    int length = CPU -> blockLength[pc] ? CPU -> blockLength[pc] : FormBlock(CPU, pc);
+    int count = 0; // instructions compiled
+    int k = 0; // instruction index in the block
+    int needNZP[MAX_BLOCK_LENGTH]; // materialize NZP after instruction k
+    int need = 1; // NZP is observable after the last instruction
+    DecodedInsn* insn;
+    unsigned char* start;
+    unsigned short at; // LC4 address of instruction k
+
+    // Compiled blocks chain to each other without looking at PSR[15], so only
+    // code that both privileges may fetch is compiled
+    if ((CPU -> pagePerm[pc >> 8] & PERM_ANY(PERM_EXEC)) != PERM_ANY(PERM_EXEC)) {
+        return NULL;
+    }
+    while (count < length && Compilable(CPU -> decoded[(unsigned short)(pc + count)].handler)) {
+        count++;
+    }
+    if (count == 0) {
+        return NULL;
+    }
+
+    // NZP only has to be written where something can observe it: a branch, the
+    // end of the block, or a side exit (LDR/STR). Earlier results are dead.
+    for (k = count - 1; k >= 0; k--) {
+        insn = &CPU -> decoded[(unsigned short)(pc + k)];
+        needNZP[k] = need;
+        if (insn -> handler == H_LDR || insn -> handler == H_STR) {
+            need = 1;
+        } else if (SetsNZP(insn -> handler)) {
+            need = 0;
+        }
+    }
+
+    if (jit -> used + (size_t)(count + 2) * JIT_MAX_INSN_BYTES > JIT_CODE_SIZE) {
+        JitFlush(jit); // out of room: start over
+    }
+    start = jit -> code + jit -> used;
+
+    // Charge the budget for the whole block up front, leaving if it is too small
+    Byte(jit, 0x48); Byte(jit, 0x81); Byte(jit, 0xFF); Dword(jit, count); // cmp rdi, count
+    Byte(jit, 0x73); Byte(jit, 5); // jae +5
+    JmpTo(jit, jit -> exit);
+    Byte(jit, 0x48); Byte(jit, 0x81); Byte(jit, 0xEF); Dword(jit, count); // sub rdi, count
+
+    for (k = 0; k < count; k++) {
+        at = pc + k;
+        insn = &CPU -> decoded[at];
+
+        switch (insn -> handler) {
+        case H_NOP:
+            break;
+
+        case H_ADD: case H_SUB: case H_AND: case H_OR: case H_XOR:
+            OpRR16(jit, OP_MOV, RAX, HR(insn -> rs));
+            OpRR16(jit, insn -> handler == H_ADD ? OP_ADD : insn -> handler == H_SUB ? OP_SUB :
+                        insn -> handler == H_AND ? OP_AND : insn -> handler == H_OR ? OP_OR : OP_XOR,
+                   RAX, HR(insn -> rt));
+            OpRR16(jit, OP_MOV, HR(insn -> rd), RAX);
+            break;
+
+        case H_MUL:
+            OpRR16(jit, OP_MOV, RAX, HR(insn -> rs));
+            Imul16(jit, RAX, HR(insn -> rt));
+            OpRR16(jit, OP_MOV, HR(insn -> rd), RAX);
+            break;
+
+        case H_ADDI: case H_ANDI:
+            OpRR16(jit, OP_MOV, RAX, HR(insn -> rs));
+            OpRI16(jit, insn -> handler == H_ADDI ? 0 : 4, RAX, insn -> imm);
+            OpRR16(jit, OP_MOV, HR(insn -> rd), RAX);
+            break;
+
+        case H_NOT: // RD = !RS
+            Byte(jit, 0x31); Byte(jit, 0xC0); // xor eax, eax
+            OpRR16(jit, OP_TEST, HR(insn -> rs), HR(insn -> rs));
+            Byte(jit, 0x0F); Byte(jit, 0x94); Byte(jit, 0xC0); // sete al
+            OpRR16(jit, OP_MOV, HR(insn -> rd), RAX);
+            break;
+
+        case H_LOGIC_NONE:
+            break;
+
+        case H_CMP: case H_CMPU: case H_CMPI: case H_CMPIU: // all four reduce to a 16-bit difference
+            OpRR16(jit, OP_MOV, RAX, HR(insn -> rd));
+            if (insn -> handler == H_CMP || insn -> handler == H_CMPU) {
+                OpRR16(jit, OP_SUB, RAX, HR(insn -> rt));
+            } else {
+                OpRI16(jit, 5, RAX, insn -> imm);
+            }
+            if (needNZP[k]) {
+                EmitNZP(jit, RAX);
+            }
+            continue;
+
+        case H_CONST:
+            MovRI32(jit, HR(insn -> rd), insn -> imm);
+            break;
+
+        case H_HICONST:
+            OpRI16(jit, 4, HR(insn -> rd), 0x00FF);
+            OpRI16(jit, 1, HR(insn -> rd), insn -> imm);
+            break;
+
+        case H_SLL: case H_SRA: case H_SRL: // SRA shifts the zero-extended value like ShiftModOp
+            OpRR16(jit, OP_MOV, RAX, HR(insn -> rs));
+            if (insn -> imm != 0) {
+                Shift16(jit, insn -> handler == H_SLL ? 4 : 5, RAX, insn -> imm);
+            }
+            OpRR16(jit, OP_MOV, HR(insn -> rd), RAX);
+            break;
+
+        case H_LDR:
+            EmitDataAddress(jit, insn, at, count - k, PERM_READ);
+            Byte(jit, 0x89); Byte(jit, 0xC1); // mov ecx, eax
+            Byte(jit, 0xC1); Byte(jit, 0xE9); Byte(jit, 8); // shr ecx, 8 -> page
+            EmitDeviceCheck(jit, DEVICE_HOOK_LOAD, at, count - k);
+            Rex(jit, 0, HR(insn -> rd), RAX, RBP);
+            Byte(jit, 0x0F); Byte(jit, 0xB7); // movzx rd, word [rbp + rax*2 + memory]
+            MemRBPIndex(jit, HR(insn -> rd), RAX, 1, offsetof(MachineState, memory));
+            break;
+
+        case H_STR: {
+            size_t skip; // offset of the rel8 to patch
+
+            EmitDataAddress(jit, insn, at, count - k, PERM_WRITE);
+            Byte(jit, 0x89); Byte(jit, 0xC1); // mov ecx, eax
+            Byte(jit, 0xC1); Byte(jit, 0xE9); Byte(jit, 8); // shr ecx, 8 -> page
+            Byte(jit, 0x80); // cmp byte [rbp + rcx + blockPage], 0
+            MemRBPIndex(jit, 7, RCX, 0, offsetof(MachineState, blockPage));
+            Byte(jit, 0);
+            Byte(jit, 0x74); skip = jit -> used; Byte(jit, 0); // je ok
+            EmitSideExit(jit, at, count - k); // page holds cached code: let StoreWord handle it
+            jit -> code[skip] = (unsigned char)(jit -> used - skip - 1);
+            EmitDeviceCheck(jit, DEVICE_HOOK_STORE, at, count - k);
+
+            Byte(jit, 0x66);
+            Rex(jit, 0, HR(insn -> rd), RAX, RBP);
+            Byte(jit, OP_MOV); // mov word [rbp + rax*2 + memory], rt
+            MemRBPIndex(jit, HR(insn -> rd), RAX, 1, offsetof(MachineState, memory));
+            Byte(jit, 0xC6); // mov byte [rbp + rax*8 + decoded], H_UNDECODED
+            MemRBPIndex(jit, 0, RAX, 3, offsetof(MachineState, decoded));
+            Byte(jit, H_UNDECODED);
+            continue;
+        }
+
+        case H_BRP: case H_BRZ: case H_BRZP: case H_BRN:
+        case H_BRNP: case H_BRNZ: case H_BRNZP:
+            if (insn -> rd == 7) { // BRnzp
+                MovRI32(jit, RSI, insn -> target);
+            } else {
+                MovRI32(jit, RSI, (unsigned short)(at + 1));
+                MovRI32(jit, RAX, insn -> target);
+                Byte(jit, 0xF6); Byte(jit, 0xC3); Byte(jit, insn -> rd); // test bl, mask
+                Byte(jit, 0x0F); Byte(jit, 0x45); Byte(jit, 0xF0); // cmovnz esi, eax
+            }
+            JmpTo(jit, jit -> dispatch);
+            continue;
+
+        case H_JMP:
+            MovRI32(jit, RSI, insn -> target);
+            JmpTo(jit, jit -> dispatch);
+            continue;
+
+        case H_JMPR:
+            Movzx16(jit, RSI, HR(insn -> rs));
+            JmpTo(jit, jit -> dispatch);
+            continue;
+
+        case H_JSR:
+            MovRI32(jit, HR(7), at); // R7 = PC, as JSROp does
+            MovRI32(jit, RSI, insn -> target);
+            JmpTo(jit, jit -> dispatch);
+            continue;
+
+        case H_JSRR:
+            MovRI32(jit, HR(7), at);
+            Movzx16(jit, RSI, HR(insn -> rs)); // read after R7 is written
+            JmpTo(jit, jit -> dispatch);
+            continue;
+        }
+
+        if (needNZP[k] && SetsNZP(insn -> handler)) {
+            EmitNZP(jit, HR(insn -> rd));
+        }
+    }
+
+    if (!Transfers(CPU -> decoded[(unsigned short)(pc + count - 1)].handler)) { // fell off the end
+        MovRI32(jit, RSI, (unsigned short)(pc + count));
+        JmpTo(jit, jit -> dispatch);
+    }
+
+    jit -> entry[pc] = start;
+    jit -> length[pc] = count;
+    return start;
+}
+
+
+/*
+ * Emit the entry, dispatch and exit stubs at the start of the cache.
+ */
+static void EmitStubs(JitState* jit)
+{
+    size_t R = offsetof(MachineState, R); // register file
+    unsigned char* entry;
+    size_t patch; // dispatcher jumps to the exit stub, patched once it exists
+    size_t patch2;
+    int n = 0;
+
+    // unsigned long long enter(MachineState* CPU, unsigned long long remaining, void** entry)
+    entry = jit -> code + jit -> used;
+    Byte(jit, 0x53); Byte(jit, 0x55); // push rbx, rbp
+    Byte(jit, 0x41); Byte(jit, 0x54); Byte(jit, 0x41); Byte(jit, 0x55); // push r12, r13
+    Byte(jit, 0x41); Byte(jit, 0x56); Byte(jit, 0x41); Byte(jit, 0x57); // push r14, r15
+    Byte(jit, 0x52); // push rdx (entry table stays at [rsp])
+    Byte(jit, 0x48); Byte(jit, 0x89); Byte(jit, 0xFD); // mov rbp, rdi
+    Byte(jit, 0x48); Byte(jit, 0x89); Byte(jit, 0xF7); // mov rdi, rsi
+    for (n = 0; n < 8; n++) { // movzx r(8+n)d, word [rbp + R + 2n]
+        Rex(jit, 0, HR(n), 0, RBP);
+        Byte(jit, 0x0F); Byte(jit, 0xB7);
+        MemRBP(jit, HR(n), R + 2 * n);
+    }
+    Byte(jit, 0x0F); Byte(jit, 0xB7); MemRBP(jit, RBX, offsetof(MachineState, PSR)); // movzx ebx, PSR
+    Byte(jit, 0x0F); Byte(jit, 0xB7); MemRBP(jit, RSI, offsetof(MachineState, PC)); // movzx esi, PC
+
+    // dispatch: next block from esi, or leave
+    jit -> dispatch = jit -> code + jit -> used;
+    Byte(jit, 0x81); Byte(jit, 0xFE); Dword(jit, 0x80FF); // cmp esi, 0x80FF
+    Byte(jit, 0x0F); Byte(jit, 0x84); patch = jit -> used; Dword(jit, 0); // je exit
+    Byte(jit, 0x48); Byte(jit, 0x8B); Byte(jit, 0x04); Byte(jit, 0x24); // mov rax, [rsp]
+    Byte(jit, 0x48); Byte(jit, 0x8B); Byte(jit, 0x04); Byte(jit, 0xF0); // mov rax, [rax + rsi*8]
+    Byte(jit, 0x48); Byte(jit, 0x85); Byte(jit, 0xC0); // test rax, rax
+    Byte(jit, 0x0F); Byte(jit, 0x84); patch2 = jit -> used; Dword(jit, 0); // jz exit
+    Byte(jit, 0xFF); Byte(jit, 0xE0); // jmp rax
+
+    // exit: write the pinned state back and return the remaining budget
+    jit -> exit = jit -> code + jit -> used;
+    for (n = 0; n < 8; n++) { // mov word [rbp + R + 2n], r(8+n)w
+        Byte(jit, 0x66);
+        Rex(jit, 0, HR(n), 0, RBP);
+        Byte(jit, OP_MOV);
+        MemRBP(jit, HR(n), R + 2 * n);
+    }
+    Byte(jit, 0x66); Byte(jit, OP_MOV); MemRBP(jit, RBX, offsetof(MachineState, PSR)); // mov PSR, bx
+    Byte(jit, 0x66); Byte(jit, OP_MOV); MemRBP(jit, RSI, offsetof(MachineState, PC)); // mov PC, si
+    Byte(jit, 0x48); Byte(jit, 0x89); Byte(jit, 0xF8); // mov rax, rdi
+    Byte(jit, 0x5A); // pop rdx
+    Byte(jit, 0x41); Byte(jit, 0x5F); Byte(jit, 0x41); Byte(jit, 0x5E); // pop r15, r14
+    Byte(jit, 0x41); Byte(jit, 0x5D); Byte(jit, 0x41); Byte(jit, 0x5C); // pop r13, r12
+    Byte(jit, 0x5D); Byte(jit, 0x5B); // pop rbp, rbx
+    Byte(jit, 0xC3); // ret
+
+    *(unsigned int*)(jit -> code + patch) = (unsigned int)(jit -> exit - (jit -> code + patch + 4));
+    *(unsigned int*)(jit -> code + patch2) = (unsigned int)(jit -> exit - (jit -> code + patch2 + 4));
+
+    jit -> enter = (JitEnterFn)entry;
+    jit -> stubs = jit -> used;
+}
+
+
+/*
+ * Allocate the code cache.
+ */
+JitState* JitCreate(void)
+{
+    JitState* jit = malloc(sizeof(JitState));
+
+    if (jit == NULL) {
+        return NULL;
+    }
+    memset(jit, 0, sizeof(JitState));
+
+    jit -> code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit -> code == MAP_FAILED) { // W^X systems refuse RWX mappings
+        free(jit);
+        return NULL;
+    }
+
+    EmitStubs(jit);
+    return jit;
+}
+
+
+/*
+ * Release the code cache.
+ */
+void JitFree(JitState* jit)
+{
+    if (jit != NULL) {
+        munmap(jit -> code, JIT_CODE_SIZE);
+        free(jit);
+    }
+}
+
+
+/*
+ * Compare the JIT machine with its interpreter shadow, reporting the first difference.
+ */
+static int VerifyState(MachineState* CPU, MachineState* shadow, unsigned short block)
+{
+    int i = 0;
+
+    if (CPU -> PC != shadow -> PC || CPU -> PSR != shadow -> PSR || memcmp(CPU -> R, shadow -> R, sizeof(CPU -> R)) != 0) {
+        fprintf(stderr, "error: JIT mismatch after block %04X: PC %04X/%04X PSR %04X/%04X\n",
+                block, CPU -> PC, shadow -> PC, CPU -> PSR, shadow -> PSR);
+        for (i = 0; i < 8; i++) {
+            fprintf(stderr, "  R%d %04X/%04X\n", i, CPU -> R[i], shadow -> R[i]);
+        }
+        return -1;
+    }
+
+    if (memcmp(CPU -> memory, shadow -> memory, sizeof(CPU -> memory)) != 0) {
+        for (i = 0; i < 65536 && CPU -> memory[i] == shadow -> memory[i]; i++) {
+            continue;
+        }
+        fprintf(stderr, "error: JIT mismatch after block %04X: memory[%04X] %04X/%04X\n",
+                block, i, CPU -> memory[i], shadow -> memory[i]);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Run with hot blocks compiled, see jit.h.
+ */
+int RunJit(MachineState* CPU, JitState* jit, unsigned long long budget, int verify)
+{
+    unsigned long long remaining = (budget == 0) ? ~0ULL : budget; // instructions left
+    unsigned long long left = 0; // budget handed back by native code
+    unsigned long long executed = 0; // instructions run by native code
+    unsigned long long length = 0; // instructions in the block being interpreted
+    MachineState* shadow = NULL; // interpreter copy for verify mode
+    unsigned short pc = 0;
+    int status = 0;
+
+    if (verify) {
+        shadow = malloc(sizeof(MachineState));
+        if (shadow == NULL) {
+            fprintf(stderr, "error: out of memory for JIT verify\n");
+            return -1;
+        }
+        memcpy(shadow, CPU, sizeof(MachineState));
+    }
+
+    for (;;) {
+        pc = CPU -> PC;
+        if (pc == 0x80FF) {
+            status = 1;
+            break;
+        }
+        if (remaining == 0) {
+            status = 0;
+            break;
+        }
+
+        if (CPU -> blockFlushes != jit -> blockFlushes) { // code was written: compiled blocks may be stale
+            JitFlush(jit);
+            jit -> blockFlushes = CPU -> blockFlushes;
+        }
+
+        if (jit -> entry[pc] == NULL && jit -> hits[pc] != JIT_NEVER && ++jit -> hits[pc] >= JIT_HOT_THRESHOLD) {
+            if (CompileBlock(jit, CPU, pc) == NULL) {
+                jit -> hits[pc] = JIT_NEVER;
+            }
+        }
+
+        // Native code needs one-hot (or clear) NZP bits, see EmitNZP, and
+        // enough budget for the whole block since it is charged up front
+        if (jit -> entry[pc] != NULL && ((0x17 >> (CPU -> PSR & 7)) & 1) && jit -> length[pc] <= remaining) {
+            left = jit -> enter(CPU, verify ? jit -> length[pc] : remaining, jit -> entry);
+            CPU -> NZPVal = CPU -> PSR & 7;
+            executed = (verify ? jit -> length[pc] : remaining) - left;
+            remaining -= executed;
+            CPU -> instructions += executed;
+
+            if (verify && executed != 0) { // replay the block on the shadow and compare
+                RunUntilHalt(shadow, NULL, executed);
+                if (VerifyState(CPU, shadow, pc) != 0) {
+                    status = -1;
+                    break;
+                }
+            }
+            if (executed != 0) {
+                continue;
+            }
+            // Side exit before the first instruction: the interpreter takes it
+        }
+
+        // Interpret one block
+        length = CPU -> blockLength[pc] ? CPU -> blockLength[pc] : FormBlock(CPU, pc);
+        if (length > remaining) {
+            length = remaining;
+        }
+        RunBlocks(CPU, NULL, length);
+        if (verify && CPU -> devices != NULL) { // device accesses happen once: take the result over
+            memcpy(shadow, CPU, sizeof(MachineState));
+        } else if (verify) {
+            RunBlocks(shadow, NULL, length);
+        }
+        remaining -= length;
+    }
+
+    free(shadow);
+    return status;
+}
+
+#else // no native backend for this host
+
+
+JitState* JitCreate(void)
+{
+    return NULL;
+}
+
+
+void JitFree(JitState* jit)
+{
+    (void)jit;
+}
+
+
+int RunJit(MachineState* CPU, JitState* jit, unsigned long long budget, int verify)
+{
+    (void)jit;
+    (void)verify;
+    return RunBlocks(CPU, NULL, budget);
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * jit.h: Declares the x86-64 JIT that compiles hot LC4 basic blocks
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include "LC4.h"
+
+// Times a block has to be interpreted before it is compiled
+#define JIT_HOT_THRESHOLD 16
+
+typedef struct JitState JitState;
+
+
+/*
+ * Allocate the code cache. Returns NULL if the host cannot run generated code
+ * (not x86-64, or executable memory is unavailable).
+ */
+JitState* JitCreate(void);
+
+
+/*
+ * Release the code cache.
+ */
+void JitFree(JitState* jit);
+
+
+/*
+ * Run untraced until the PC reaches 0x80FF or budget instructions have run
+ * (budget 0 = no limit). Hot blocks run as native code, everything else in the
+ * interpreter. With verify set, an interpreter copy of the machine runs in
+ * lockstep and the two are compared after every compiled block.
+ * Returns 1 on halt, 0 if the budget ran out, -1 on a verify mismatch.
+ */
+int RunJit(MachineState* CPU, JitState* jit, unsigned long long budget, int verify);
+
+#endif
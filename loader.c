@@ -2,51 +2,210 @@
  * loader.c : Defines loader functions for opening and loading object files
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "loader.h"
 
-// memory array location
-unsigned short memoryAddress;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Section headers of an LC4 object file (all fields big-endian 16-bit words)
+#define SECTION_CODE 0xCADE // address, n, n words of code
+#define SECTION_DATA 0xDADA // address, n, n words of data
+#define SECTION_SYMBOL 0xC3B7 // address, n, n bytes of label
+#define SECTION_FILE 0xF17E // n, n bytes of file name
+#define SECTION_LINE 0x715E // address, line, file index
+
+
+/*
+ * Read the big-endian word at offset (the caller checks it is in bounds).
+ */
+static unsigned short ReadWord(const unsigned char* bytes, size_t offset)
+{
+    return (unsigned short)((bytes[offset] << 8) | bytes[offset + 1]);
+}
+
+
+/*
+ * Copy count big-endian words from bytes into memory at address, swapping to
+ * host order eight words at a time where SSE2 is available.
+ */
+static void CopyWords(MachineState* CPU, unsigned short address, const unsigned char* bytes, int count)
+{
+    unsigned short* out = &CPU -> memory[address];
+    int i = 0; // word being copied
+
+#ifdef __SSE2__
+    __m128i words; // eight words
+
+    for (; i + 8 <= count; i += 8) {
+        words = _mm_loadu_si128((const __m128i*)(bytes + 2 * i));
+        words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8)); // swap the bytes of each word
+        _mm_storeu_si128((__m128i*)(out + i), words);
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = ReadWord(bytes, 2 * i);
+    }
+
+    InvalidateWords(CPU, address, count);
+}
+
+
+/*
+ * Append the length-byte label at bytes, naming address, to table.
+ */
+static int AddSymbol(SymbolTable* table, unsigned short address, const unsigned char* bytes, size_t length)
+{
+    Symbol* grown; // larger array
+    char* name;
+
+    if (table -> count == table -> capacity) {
+        grown = realloc(table -> symbols, (table -> capacity ? 2 * table -> capacity : 64) * sizeof(Symbol));
+        if (grown == NULL) {
+            return -1;
+        }
+        table -> symbols = grown;
+        table -> capacity = table -> capacity ? 2 * table -> capacity : 64;
+    }
+
+    name = malloc(length + 1);
+    if (name == NULL) {
+        return -1;
+    }
+    memcpy(name, bytes, length);
+    name[length] = '\0';
+
+    table -> symbols[table -> count].address = address;
+    table -> symbols[table -> count].name = name;
+    table -> count++;
+    return 0;
+}
+
+
+/*
+ * Release the labels held by table.
+ */
+void FreeSymbols(SymbolTable* table)
+{
+    int i = 0;
+
+    for (i = 0; i < table -> count; i++) {
+        free(table -> symbols[i].name);
+    }
+    free(table -> symbols);
+    table -> symbols = NULL;
+    table -> count = 0;
+    table -> capacity = 0;
+}
+
+
+/*
+ * Load every code and data section of the mapped file, and the labels of the
+ * symbol sections when CPU -> symbols is set, skipping the others by their
+ * length. Returns 0, or -1 after reporting where the file is malformed.
+ */
+static int LoadSections(MachineState* CPU, const char* filename, const unsigned char* bytes, size_t size)
+{
+    size_t offset = 0; // start of the current section
+    unsigned short type; // section header
+    unsigned short address; // load address of a code/data section
+    size_t length; // payload length in bytes
+    size_t fields; // header fields after the type word
+    int first = 0; // words that fit before address wraps past xFFFF
+
+    while (offset < size) {
+        if (size - offset < 2) {
+            fprintf(stderr, "error: %s: stray byte at offset %zu\n", filename, offset);
+            return -1;
+        }
+        type = ReadWord(bytes, offset);
+
+        fields = (type == SECTION_FILE) ? 1 : (type == SECTION_LINE) ? 3 : 2;
+        if (type != SECTION_CODE && type != SECTION_DATA && type != SECTION_SYMBOL &&
+            type != SECTION_FILE && type != SECTION_LINE) {
+            fprintf(stderr, "error: %s: unknown section header 0x%04X at offset %zu\n", filename, type, offset);
+            return -1;
+        }
+        if (size - offset < 2 + 2 * fields) {
+            fprintf(stderr, "error: %s: section 0x%04X at offset %zu has a truncated header\n", filename, type, offset);
+            return -1;
+        }
+
+        if (type == SECTION_CODE || type == SECTION_DATA) {
+            length = 2 * (size_t)ReadWord(bytes, offset + 4); // n words
+        } else if (type == SECTION_SYMBOL) {
+            length = ReadWord(bytes, offset + 4); // n bytes
+        } else if (type == SECTION_FILE) {
+            length = ReadWord(bytes, offset + 2); // n bytes
+        } else {
+            length = 0;
+        }
+
+        offset += 2 + 2 * fields;
+        if (size - offset < length) {
+            fprintf(stderr, "error: %s: section 0x%04X at offset %zu needs %zu bytes, only %zu left\n",
+                    filename, type, offset - 2 - 2 * fields, length, size - offset);
+            return -1;
+        }
+
+        if (type == SECTION_CODE || type == SECTION_DATA) {
+            address = ReadWord(bytes, offset - 4);
+            first = 65536 - address;
+            if ((size_t)first >= length / 2) {
+                CopyWords(CPU, address, bytes + offset, (int)(length / 2));
+            } else { // addresses wrap around to x0000
+                CopyWords(CPU, address, bytes + offset, first);
+                CopyWords(CPU, 0, bytes + offset + 2 * first, (int)(length / 2) - first);
+            }
+        } else if (type == SECTION_SYMBOL && CPU -> symbols != NULL) {
+            if (AddSymbol(CPU -> symbols, ReadWord(bytes, offset - 4), bytes + offset, length) != 0) {
+                fprintf(stderr, "error: %s: out of memory for labels\n", filename);
+                return -1;
+            }
+        }
+        offset += length;
+    }
+
+    return 0;
+}
+
 
 /*
  * Read an object file and modify the machine state as described in the writeup
  */
 int ReadObjectFile(char* filename, MachineState* CPU) {
-    FILE* file;
-    unsigned short word; // Current word we are looking at
-    unsigned short numContents; // Number of contents in a header
-    int i; // For loop counter
-    
-    file = fopen(filename, "rb"); // Open in read binary form
-    if (file == NULL) { // Error opening object file
+    const unsigned char* bytes; // mapped file
+    struct stat info;
+    int fd; // open file
+    int status = 0;
+
+    fd = open(filename, O_RDONLY); // Open in read binary form
+    if (fd < 0 || fstat(fd, &info) != 0) { // Error opening object file
         fprintf(stderr, "error2: ReadObjectFile() failed\n");
-        fclose(file); // Close file
+        if (fd >= 0) {
+            close(fd);
+        }
         return -1; // Failure to Read
-    } else {
-        // Store info in file into memoryAddress
-        while (feof(file) == 0) {
-            if (ferror(file) != 0) { // Error during getc()
-                fprintf(stderr, "error2: ReadObjectFile() failed\n");
-                fclose(file); // Close file
-                return -1; // Failure to read
-            }
-            
-            word = (fgetc(file) << 8) | fgetc(file); // Creates the word
-            
-            if (word == 51934 || word == 56026) { // word = CADE or DADA
-                memoryAddress = (fgetc(file) << 8) | fgetc(file); // Get address
-                numContents = (fgetc(file) << 8) | fgetc(file); // Get num of contents
-                
-                for (int i = 0; i < numContents; i++) {
-                    CPU -> memory[memoryAddress] = (fgetc(file) << 8) | fgetc(file); // Store instruction
-                    memoryAddress++; // Increment to next address line
-                }
-            } else { // word != CADE or DADA
-                continue;
-            }
+    }
 
-        }
-        
-        fclose(file); // Close file
-        return 0; // Successful Read
+    if (info.st_size == 0) { // Nothing to load
+        close(fd);
+        return 0;
+    }
+
+    bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // Mapping stays valid
+    if (bytes == MAP_FAILED) {
+        fprintf(stderr, "error2: ReadObjectFile() failed\n");
+        return -1; // Failure to read
     }
+
+    status = LoadSections(CPU, filename, bytes, info.st_size);
+
+    munmap((void*)bytes, info.st_size);
+    return status; // 0 = Successful Read
 }
@@ -2,8 +2,29 @@
  * loader.h: Declares loader functions for opening and loading object files
  */
 
+#ifndef LOADER_H
+#define LOADER_H
+
 #include <stdio.h>
 #include "LC4.h"
 
 // Read an object file and modify the machine state as described in the writeup
-int ReadObjectFile(char* filename, MachineState* CPU);
\ No newline at end of file
+int ReadObjectFile(char* filename, MachineState* CPU);
+
+// Label from the symbol section of an object file
+typedef struct {
+    unsigned short address; // address the label names
+    char* name; // NUL-terminated copy of the label
+} Symbol;
+
+// Labels ReadObjectFile collects while CPU -> symbols is set
+typedef struct SymbolTable {
+    Symbol* symbols; // in the order they were read
+    int count; // labels held
+    int capacity; // labels allocated
+} SymbolTable;
+
+// Release the labels held by table (the table itself belongs to the caller)
+void FreeSymbols(SymbolTable* table);
+
+#endif
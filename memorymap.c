@@ -0,0 +1,105 @@
+/*
+ * memorymap.c: Loads a memory map (page permissions) from a file
+ */
+
+#include "memorymap.h"
+
+
+/*
+ * Parse an address: hex with an x or 0x prefix, or decimal.
+ */
+static int ParseAddress(const char* text, long* address)
+{
+    char* end;
+
+    if (text[0] == 'x' || text[0] == 'X') {
+        *address = strtol(text + 1, &end, 16);
+    } else {
+        *address = strtol(text, &end, 0);
+    }
+    return (end != text && *end == '\0' && *address >= 0 && *address <= 0xFFFF) ? 0 : -1;
+}
+
+
+/*
+ * Parse permissions (any of r, w and x, or -) into PERM_* bits.
+ */
+static int ParsePermissions(const char* text, int* bits)
+{
+    *bits = 0;
+    if (strcmp(text, "-") == 0) {
+        return 0;
+    }
+    for (; *text != '\0'; text++) {
+        if (*text == 'r') {
+            *bits |= PERM_READ;
+        } else if (*text == 'w') {
+            *bits |= PERM_WRITE;
+        } else if (*text == 'x') {
+            *bits |= PERM_EXEC;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Read and install a memory map.
+ */
+int LoadMemoryMap(MachineState* CPU, const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    unsigned char pages[256];
+    char line[256];
+    char* field[5];
+    long start = 0;
+    long end = 0;
+    int user = 0;
+    int os = 0;
+    int count = 0; // fields on the line
+    int number = 0; // line number
+    int page = 0;
+
+    if (file == NULL) {
+        fprintf(stderr, "error: memory map %s could not be open\n", filename);
+        return -1;
+    }
+
+    memset(pages, 0, sizeof(pages)); // pages not listed have no access
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        line[strcspn(line, "#")] = '\0';
+        for (count = 0; count < 5; count++) { // a fifth field is an error
+            field[count] = strtok((count == 0) ? line : NULL, " \t\r\n");
+            if (field[count] == NULL) {
+                break;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        if (count != 4 || ParseAddress(field[0], &start) != 0 ||
+            ParseAddress(field[1], &end) != 0 || ParsePermissions(field[2], &user) != 0 ||
+            ParsePermissions(field[3], &os) != 0) {
+            fprintf(stderr, "error: %s:%d: expected <start> <end> <user rwx> <os rwx>\n", filename, number);
+            fclose(file);
+            return -1;
+        }
+        if ((start & 0xFF) != 0 || (end & 0xFF) != 0xFF || start > end) {
+            fprintf(stderr, "error: %s:%d: range must cover whole 256-word pages (xNN00 to xMMFF)\n", filename, number);
+            fclose(file);
+            return -1;
+        }
+
+        for (page = start >> 8; page <= end >> 8; page++) {
+            pages[page] = (unsigned char)(user | (os << PERM_OS_SHIFT));
+        }
+    }
+
+    fclose(file);
+    SetMemoryMap(CPU, pages);
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * memorymap.h: Declares loading a memory map (page permissions) from a file
+ *
+ * Each line gives a page-aligned address range and its permissions in user
+ * and OS mode, as any of r, w and x, or - for none:
+ *
+ *     # start  end    user  os
+ *     x0000    x1FFF  x     x
+ *     x2000    x7FFF  rw    rw
+ *
+ * Pages not covered by any line cannot be accessed at all; a later line
+ * overrides an earlier one. Text after # is a comment.
+ */
+
+#ifndef MEMORYMAP_H
+#define MEMORYMAP_H
+
+#include "LC4.h"
+
+
+/*
+ * Read the memory map in filename and install it on CPU. Returns 0, or -1
+ * (after reporting the line) if the file could not be read or parsed.
+ */
+int LoadMemoryMap(MachineState* CPU, const char* filename);
+
+#endif
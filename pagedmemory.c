@@ -0,0 +1,96 @@
+/*
+ * pagedmemory.c: Copy-on-write paged memory shared by many instances
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "pagedmemory.h"
+
+#define IMAGE_BYTES (PAGE_COUNT * PAGE_WORDS * sizeof(unsigned short))
+
+
+/*
+ * Share image between count instances.
+ */
+PagedMemory* PagedCreate(const unsigned short* image, int count)
+{
+    PagedMemory* memory = calloc(1, sizeof(PagedMemory));
+    size_t entry = 0; // page table entry
+
+    if (memory == NULL) {
+        return NULL;
+    }
+    memory -> count = count;
+
+    memory -> image = mmap(NULL, IMAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory -> image == MAP_FAILED) {
+        free(memory);
+        return NULL;
+    }
+    memcpy(memory -> image, image, IMAGE_BYTES);
+    mprotect(memory -> image, IMAGE_BYTES, PROT_READ); // a stray write into a shared page faults
+
+    memory -> table = malloc((size_t)count * PAGE_COUNT * sizeof(unsigned short*));
+    if (memory -> table == NULL) {
+        PagedFree(memory);
+        return NULL;
+    }
+    for (entry = 0; entry < (size_t)count * PAGE_COUNT; entry++) {
+        memory -> table[entry] = memory -> image + (entry % PAGE_COUNT) * PAGE_WORDS;
+    }
+
+    memory -> chunkUsed = PAGE_CHUNK; // first copy allocates a chunk
+    return memory;
+}
+
+
+/*
+ * Release everything.
+ */
+void PagedFree(PagedMemory* memory)
+{
+    PageChunk* chunk;
+
+    if (memory == NULL) {
+        return;
+    }
+    while (memory -> chunks != NULL) {
+        chunk = memory -> chunks;
+        memory -> chunks = chunk -> next;
+        free(chunk);
+    }
+    free(memory -> table);
+    if (memory -> image != NULL) {
+        munmap(memory -> image, IMAGE_BYTES);
+    }
+    free(memory);
+}
+
+
+/*
+ * Give instance a private copy of the page holding address.
+ */
+int PagedCopy(PagedMemory* memory, int instance, unsigned short address)
+{
+    unsigned short** entry = &memory -> table[(size_t)instance * PAGE_COUNT + (address >> 8)];
+    PageChunk* chunk;
+    unsigned short* page; // the private copy
+
+    if (memory -> chunkUsed == PAGE_CHUNK) {
+        chunk = malloc(sizeof(PageChunk));
+        if (chunk == NULL) {
+            return -1;
+        }
+        chunk -> next = memory -> chunks;
+        memory -> chunks = chunk;
+        memory -> chunkUsed = 0;
+    }
+
+    page = memory -> chunks -> words[memory -> chunkUsed++];
+    memcpy(page, *entry, PAGE_WORDS * sizeof(unsigned short));
+    *entry = page;
+    memory -> privatePages++;
+    return 0;
+}
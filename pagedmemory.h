@@ -0,0 +1,82 @@
+/*
+ * pagedmemory.h: Declares copy-on-write paged memory for many instances of one image
+ *
+ * Every instance sees the 64K-word image through its own table of 256-word
+ * pages. All entries start out pointing at one read-only copy of the image;
+ * the first store into a page gives that instance a private copy of it, so
+ * each instance costs its page table plus the pages it has written.
+ */
+
+#ifndef PAGEDMEMORY_H
+#define PAGEDMEMORY_H
+
+#include <stddef.h>
+
+#define PAGE_WORDS 256 // words per page
+#define PAGE_COUNT 256 // pages per instance
+#define PAGE_CHUNK 64 // private pages allocated at a time
+
+typedef struct PageChunk PageChunk;
+
+struct PageChunk {
+    PageChunk* next; // chunks allocated before this one
+    unsigned short words[PAGE_CHUNK][PAGE_WORDS];
+};
+
+typedef struct {
+    int count; // instances
+    unsigned short* image; // shared copy of the image, mapped read-only
+    unsigned short** table; // table[instance * PAGE_COUNT + page] = words of that page
+
+    PageChunk* chunks; // storage for private pages
+    int chunkUsed; // pages taken from the newest chunk
+    unsigned long long privatePages; // pages copied so far
+} PagedMemory;
+
+
+/*
+ * Share the 65536 words of image between count instances. Returns NULL on failure.
+ */
+PagedMemory* PagedCreate(const unsigned short* image, int count);
+
+
+/*
+ * Release the page tables, the private pages and the shared image.
+ */
+void PagedFree(PagedMemory* memory);
+
+
+/*
+ * Give instance its own copy of the page holding address (called on the first
+ * store into a shared page). Returns -1 if no memory is left.
+ */
+int PagedCopy(PagedMemory* memory, int instance, unsigned short address);
+
+
+/*
+ * Read the word at address as instance sees it.
+ */
+static inline unsigned short PagedRead(const PagedMemory* memory, int instance, unsigned short address)
+{
+    return memory -> table[(size_t)instance * PAGE_COUNT + (address >> 8)][address & 0xFF];
+}
+
+
+/*
+ * Store value at address for instance only. Returns -1 if the page could not be copied.
+ */
+static inline int PagedWrite(PagedMemory* memory, int instance, unsigned short address, unsigned short value)
+{
+    unsigned short* page = memory -> table[(size_t)instance * PAGE_COUNT + (address >> 8)];
+
+    if (page == memory -> image + (address & 0xFF00)) { // still the shared page
+        if (PagedCopy(memory, instance, address) != 0) {
+            return -1;
+        }
+        page = memory -> table[(size_t)instance * PAGE_COUNT + (address >> 8)];
+    }
+    page[address & 0xFF] = value;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,364 @@
+/*
+ * profile.c: Guest program profiler: call edges, symbol attribution and the JSON report
+ */
+
+#include "profile.h"
+#include "loader.h"
+
+// Opcode groups of the per-opcode counts
+static const char* const groupNames[] = {
+    "BR", "ARITH", "CMP", "JSR", "LOGIC", "LDR", "STR", "RTI", "CONST", "SHIFT/MOD", "JMP", "HICONST", "TRAP", "invalid"
+};
+#define GROUP_COUNT (int)(sizeof(groupNames) / sizeof(groupNames[0]))
+
+// Sub-op name and opcode group of each handler
+static const struct {
+    const char* name;
+    int group; // index into groupNames
+} handlerInfo[H_COUNT] = {
+    [H_UNDECODED] = {"undecoded", 13},
+    [H_NOP] = {"NOP", 0}, [H_BRP] = {"BRp", 0}, [H_BRZ] = {"BRz", 0}, [H_BRZP] = {"BRzp", 0},
+    [H_BRN] = {"BRn", 0}, [H_BRNP] = {"BRnp", 0}, [H_BRNZ] = {"BRnz", 0}, [H_BRNZP] = {"BRnzp", 0},
+    [H_ADD] = {"ADD", 1}, [H_MUL] = {"MUL", 1}, [H_SUB] = {"SUB", 1}, [H_DIV] = {"DIV", 1}, [H_ADDI] = {"ADDI", 1},
+    [H_CMP] = {"CMP", 2}, [H_CMPU] = {"CMPU", 2}, [H_CMPI] = {"CMPI", 2}, [H_CMPIU] = {"CMPIU", 2},
+    [H_JSRR] = {"JSRR", 3}, [H_JSR] = {"JSR", 3},
+    [H_AND] = {"AND", 4}, [H_NOT] = {"NOT", 4}, [H_OR] = {"OR", 4}, [H_XOR] = {"XOR", 4},
+    [H_ANDI] = {"ANDI", 4}, [H_LOGIC_NONE] = {"LOGIC (no sub-op)", 4},
+    [H_LDR] = {"LDR", 5}, [H_STR] = {"STR", 6}, [H_RTI] = {"RTI", 7}, [H_CONST] = {"CONST", 8},
+    [H_SLL] = {"SLL", 9}, [H_SRA] = {"SRA", 9}, [H_SRL] = {"SRL", 9}, [H_MOD] = {"MOD", 9},
+    [H_JMPR] = {"JMPR", 10}, [H_JMP] = {"JMP", 10}, [H_HICONST] = {"HICONST", 11}, [H_TRAP] = {"TRAP", 12},
+    [H_INVALID] = {"invalid", 13}, [H_DATA_FETCH] = {"data fetch", 13}, [H_BREAK] = {"breakpoint", 13}
+};
+
+// One line of a sorted table
+typedef struct {
+    unsigned int key; // what is counted (address, label, handler, edge)
+    unsigned long long count;
+} ProfileRow;
+
+// Attribution of every address, built by ProfileWrite
+typedef struct {
+    const SymbolTable* symbols; // sorted by address
+    int label[65536]; // nearest label at or before each address in its region (-1 = none)
+    unsigned short function[65536]; // entry (call target or region start) each address belongs to
+} ProfileNames;
+
+
+/*
+ * Create an empty profile.
+ */
+Profile* ProfileCreate(void)
+{
+    Profile* profile = calloc(1, sizeof(Profile));
+
+    if (profile == NULL) {
+        fprintf(stderr, "error: out of memory for the profile\n");
+    }
+    return profile;
+}
+
+
+/*
+ * Count a call from the instruction at from to address to.
+ */
+void ProfileCall(Profile* profile, unsigned short from, unsigned short to)
+{
+    unsigned int slot = ((unsigned int)from * 40503u + to) & (PROFILE_EDGES - 1); // first probe
+    ProfileEdge* edge;
+    int probes = 0;
+
+    for (probes = 0; probes < PROFILE_EDGES; probes++) {
+        edge = &profile -> edges[slot];
+        if (edge -> count == 0) {
+            edge -> from = from;
+            edge -> to = to;
+            edge -> count = 1;
+            return;
+        }
+        if (edge -> from == from && edge -> to == to) {
+            edge -> count++;
+            return;
+        }
+        slot = (slot + 1) & (PROFILE_EDGES - 1);
+    }
+    profile -> droppedCalls++;
+}
+
+
+/*
+ * Order symbols by address, then by name so the choice between labels at one address is stable.
+ */
+static int BySymbolAddress(const void* a, const void* b)
+{
+    const Symbol* left = a;
+    const Symbol* right = b;
+
+    if (left -> address != right -> address) {
+        return (left -> address < right -> address) ? -1 : 1;
+    }
+    return strcmp(left -> name, right -> name);
+}
+
+
+/*
+ * Order rows by count, highest first, then by key.
+ */
+static int ByCount(const void* a, const void* b)
+{
+    const ProfileRow* left = a;
+    const ProfileRow* right = b;
+
+    if (left -> count != right -> count) {
+        return (left -> count > right -> count) ? -1 : 1;
+    }
+    return (left -> key > right -> key) - (left -> key < right -> key);
+}
+
+
+/*
+ * Work out the label and function of every address. Labels do not reach
+ * across the x2000/x8000/xA000 region boundaries, so a data label never
+ * names OS code.
+ */
+static void ProfileAttribute(Profile* profile, SymbolTable* symbols, ProfileNames* names)
+{
+    static const SymbolTable empty = {NULL, 0, 0};
+    unsigned char* entry = calloc(65536, 1); // function entries
+    int next = 0; // next symbol in address order
+    int label = -1; // current label
+    unsigned short function = 0; // current function
+    int address = 0;
+    int i = 0;
+
+    names -> symbols = (symbols != NULL) ? symbols : &empty;
+    if (symbols != NULL && symbols -> count > 1) {
+        qsort(symbols -> symbols, symbols -> count, sizeof(Symbol), BySymbolAddress);
+    }
+
+    for (i = 0; i < PROFILE_EDGES && entry != NULL; i++) {
+        if (profile -> edges[i].count != 0) {
+            entry[profile -> edges[i].to] = 1;
+        }
+    }
+
+    for (address = 0; address < 65536; address++) {
+        if (address == 0x0000 || address == 0x2000 || address == 0x8000 || address == 0xA000) {
+            label = -1;
+            function = address;
+        }
+        if (entry != NULL && entry[address]) {
+            function = address;
+        }
+        while (next < names -> symbols -> count && names -> symbols -> symbols[next].address == address) {
+            if (label < 0 || names -> symbols -> symbols[label].address != address) { // first label at address
+                label = next;
+            }
+            next++;
+        }
+        names -> label[address] = label;
+        names -> function[address] = function;
+    }
+    free(entry);
+}
+
+
+/*
+ * Write the name of address: its label, the nearest label before it plus an
+ * offset, or the address itself.
+ */
+static void PrintName(FILE* output, const ProfileNames* names, unsigned short address)
+{
+    const Symbol* symbol;
+    const char* c;
+
+    if (names -> label[address] < 0) {
+        fprintf(output, "\"x%04X\"", address);
+        return;
+    }
+
+    symbol = &names -> symbols -> symbols[names -> label[address]];
+    fputc('"', output);
+    for (c = symbol -> name; *c != '\0'; c++) { // labels are identifiers, but escape anyway
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', output);
+        }
+        if ((unsigned char)*c >= 0x20) {
+            fputc(*c, output);
+        }
+    }
+    if (symbol -> address != address) {
+        fprintf(output, "+%d", address - symbol -> address);
+    }
+    fputc('"', output);
+}
+
+
+/*
+ * Write the flat profile, branch counts and call graph as JSON.
+ */
+int ProfileWrite(Profile* profile, struct SymbolTable* symbols, const char* filename)
+{
+    ProfileNames* names = malloc(sizeof(ProfileNames));
+    ProfileRow* rows = malloc(65536 * sizeof(ProfileRow)); // reused by every table
+    unsigned long long* sums = calloc(65536, sizeof(unsigned long long)); // per function or label
+    unsigned long long groups[GROUP_COUNT] = {0};
+    unsigned long long total = 0; // instructions counted
+    FILE* output = NULL;
+    int count = 0; // rows in use
+    int address = 0;
+    int i = 0;
+    int j = 0;
+
+    if (names == NULL || rows == NULL || sums == NULL || (output = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "error: could not write the profile to %s\n", filename);
+        free(names);
+        free(rows);
+        free(sums);
+        return -1;
+    }
+    ProfileAttribute(profile, symbols, names);
+
+    for (address = 0; address < 65536; address++) {
+        total += profile -> count[address];
+    }
+    fprintf(output, "{\n  \"instructions\": %llu,\n  \"droppedCalls\": %llu,\n", total, profile -> droppedCalls);
+
+    // Flat profile by function (self counts)
+    for (address = 0; address < 65536; address++) {
+        sums[names -> function[address]] += profile -> count[address];
+    }
+    for (address = 0, count = 0; address < 65536; address++) {
+        if (sums[address] != 0) {
+            rows[count].key = address;
+            rows[count++].count = sums[address];
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), ByCount);
+    fprintf(output, "  \"functions\": [");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "%s\n    {\"name\": ", i ? "," : "");
+        PrintName(output, names, rows[i].key);
+        fprintf(output, ", \"address\": \"x%04X\", \"self\": %llu, \"percent\": %.2f}",
+                rows[i].key, rows[i].count, 100.0 * rows[i].count / (total ? total : 1));
+    }
+    fprintf(output, "\n  ],\n");
+
+    // Flat profile by label
+    memset(sums, 0, 65536 * sizeof(unsigned long long));
+    for (address = 0; address < 65536; address++) {
+        if (names -> label[address] >= 0) {
+            sums[names -> symbols -> symbols[names -> label[address]].address] += profile -> count[address];
+        } else {
+            sums[address] += profile -> count[address]; // unlabelled code stands for itself
+        }
+    }
+    for (address = 0, count = 0; address < 65536; address++) {
+        if (sums[address] != 0) {
+            rows[count].key = address;
+            rows[count++].count = sums[address];
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), ByCount);
+    fprintf(output, "  \"labels\": [");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "%s\n    {\"name\": ", i ? "," : "");
+        PrintName(output, names, rows[i].key);
+        fprintf(output, ", \"address\": \"x%04X\", \"self\": %llu, \"percent\": %.2f}",
+                rows[i].key, rows[i].count, 100.0 * rows[i].count / (total ? total : 1));
+    }
+    fprintf(output, "\n  ],\n");
+
+    // Per opcode, then per sub-op
+    for (i = 0; i < H_COUNT; i++) {
+        groups[handlerInfo[i].group] += profile -> handlers[i];
+    }
+    for (i = 0, count = 0; i < GROUP_COUNT; i++) {
+        if (groups[i] != 0) {
+            rows[count].key = i;
+            rows[count++].count = groups[i];
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), ByCount);
+    fprintf(output, "  \"opcodes\": [");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "%s\n    {\"opcode\": \"%s\", \"count\": %llu}", i ? "," : "", groupNames[rows[i].key], rows[i].count);
+    }
+    fprintf(output, "\n  ],\n");
+
+    for (i = 0, count = 0; i < H_COUNT; i++) {
+        if (profile -> handlers[i] != 0) {
+            rows[count].key = i;
+            rows[count++].count = profile -> handlers[i];
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), ByCount);
+    fprintf(output, "  \"subops\": [");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "%s\n    {\"op\": \"%s\", \"opcode\": \"%s\", \"count\": %llu}", i ? "," : "",
+                handlerInfo[rows[i].key].name, groupNames[handlerInfo[rows[i].key].group], rows[i].count);
+    }
+    fprintf(output, "\n  ],\n");
+
+    // Conditional branches, most executed first
+    for (address = 0, count = 0; address < 65536; address++) {
+        if (profile -> branches[address] != 0) {
+            rows[count].key = address;
+            rows[count++].count = profile -> branches[address];
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), ByCount);
+    fprintf(output, "  \"branches\": [");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "%s\n    {\"pc\": \"x%04X\", \"name\": ", i ? "," : "", rows[i].key);
+        PrintName(output, names, rows[i].key);
+        fprintf(output, ", \"taken\": %llu, \"notTaken\": %llu}",
+                profile -> taken[rows[i].key], rows[i].count - profile -> taken[rows[i].key]);
+    }
+    fprintf(output, "\n  ],\n");
+
+    // Call graph: edges merged by calling function and callee
+    for (i = 0, count = 0; i < PROFILE_EDGES; i++) {
+        if (profile -> edges[i].count == 0) {
+            continue;
+        }
+        rows[count].key = ((unsigned int)names -> function[profile -> edges[i].from] << 16) | profile -> edges[i].to;
+        rows[count].count = profile -> edges[i].count;
+        for (j = 0; j < count && rows[j].key != rows[count].key; j++);
+        if (j < count) {
+            rows[j].count += rows[count].count;
+        } else {
+            count++;
+        }
+    }
+    qsort(rows, count, sizeof(ProfileRow), ByCount);
+    fprintf(output, "  \"callGraph\": [");
+    for (i = 0; i < count; i++) {
+        fprintf(output, "%s\n    {\"caller\": ", i ? "," : "");
+        PrintName(output, names, rows[i].key >> 16);
+        fprintf(output, ", \"callee\": ");
+        PrintName(output, names, rows[i].key & 0xFFFF);
+        fprintf(output, ", \"calls\": %llu}", rows[i].count);
+    }
+    fprintf(output, "\n  ],\n");
+
+    // Every executed PC in address order
+    fprintf(output, "  \"pcs\": [");
+    for (address = 0, i = 0; address < 65536; address++) {
+        if (profile -> count[address] != 0) {
+            fprintf(output, "%s\n    {\"pc\": \"x%04X\", \"name\": ", i++ ? "," : "", address);
+            PrintName(output, names, address);
+            fprintf(output, ", \"op\": \"%s\", \"count\": %llu}",
+                    handlerInfo[profile -> last[address]].name, profile -> count[address]);
+        }
+    }
+    fprintf(output, "\n  ]\n}\n");
+
+    free(names);
+    free(rows);
+    free(sums);
+    if (fclose(output) != 0) {
+        fprintf(stderr, "error: could not write the profile to %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * profile.h: Declares the guest program profiler (--profile)
+ *
+ * The step engine counts every instruction it executes by PC and by handler
+ * (sub-op), how often the BR at each PC ran and was taken, and the
+ * JSR/JSRR/TRAP call edges. Counting as the instructions run keeps the
+ * per-opcode counts right when a writable code page (--memory-map) is
+ * stored over, and each PC is listed with the last instruction run there.
+ * At exit the counts are written as JSON, with PCs attributed to the
+ * labels of the object files' symbol sections.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "LC4.h"
+
+#define PROFILE_EDGES 4096 // distinct call edges kept (power of two)
+
+// One call site and the address it called
+typedef struct {
+    unsigned short from; // PC of the JSR/JSRR/TRAP
+    unsigned short to; // address called
+    unsigned long long count; // 0 = free entry
+} ProfileEdge;
+
+typedef struct Profile {
+    unsigned long long count[65536]; // executions of the instruction at each PC
+    unsigned long long branches[65536]; // times a BR ran at each PC
+    unsigned long long taken[65536]; // times the BR at each PC was taken
+    unsigned long long handlers[H_COUNT]; // executions of each handler
+    unsigned char last[65536]; // handler last run at each PC
+    ProfileEdge edges[PROFILE_EDGES]; // open addressing on (from, to)
+    unsigned long long droppedCalls; // calls not counted because the edge table was full
+} Profile;
+
+struct SymbolTable;
+
+
+/*
+ * Create an empty profile. Returns NULL if out of memory.
+ */
+Profile* ProfileCreate(void);
+
+
+/*
+ * Count a call from the instruction at from to address to.
+ */
+void ProfileCall(Profile* profile, unsigned short from, unsigned short to);
+
+
+/*
+ * Write the flat profile (per PC, label, opcode and sub-op), branch counts
+ * and call graph of the profiled run to filename as JSON, naming addresses
+ * after symbols (which get sorted; NULL = no labels). Returns 0, or -1 if the
+ * file could not be written.
+ */
+int ProfileWrite(Profile* profile, struct SymbolTable* symbols, const char* filename);
+
+#endif
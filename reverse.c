@@ -0,0 +1,230 @@
+/*
+ * reverse.c: Reverse execution: an undo log with checkpoints (--reverse)
+ */
+
+#include "reverse.h"
+#include "debug.h"
+
+
+/*
+ * Create an empty undo log.
+ */
+Reverse* ReverseCreate(void)
+{
+    Reverse* reverse = calloc(1, sizeof(Reverse));
+
+    if (reverse == NULL) {
+        return NULL;
+    }
+    reverse -> log = malloc(REVERSE_LOG_ENTRIES * sizeof(UndoEntry));
+    reverse -> checkpoints = malloc(REVERSE_CHECKPOINTS * sizeof(ReverseCheckpoint));
+    if (reverse -> log == NULL || reverse -> checkpoints == NULL) {
+        ReverseFree(reverse);
+        return NULL;
+    }
+    return reverse;
+}
+
+
+/*
+ * Free the log and its checkpoints.
+ */
+void ReverseFree(Reverse* reverse)
+{
+    if (reverse == NULL) {
+        return;
+    }
+    free(reverse -> log);
+    free(reverse -> checkpoints);
+    free(reverse);
+}
+
+
+/*
+ * The i-th oldest checkpoint.
+ */
+static ReverseCheckpoint* Checkpoint(Reverse* reverse, int i)
+{
+    return &reverse -> checkpoints[(reverse -> checkpointFirst + i) % REVERSE_CHECKPOINTS];
+}
+
+
+/*
+ * Keep a checkpoint of CPU as it is now, dropping the oldest if all are in use.
+ */
+static void TakeCheckpoint(Reverse* reverse, MachineState* CPU)
+{
+    ReverseCheckpoint* checkpoint;
+
+    if (reverse -> checkpointCount == REVERSE_CHECKPOINTS) {
+        reverse -> checkpointFirst = (reverse -> checkpointFirst + 1) % REVERSE_CHECKPOINTS;
+        reverse -> checkpointCount--;
+    }
+    checkpoint = Checkpoint(reverse, reverse -> checkpointCount++);
+    checkpoint -> instructions = CPU -> instructions;
+    checkpoint -> PC = CPU -> PC;
+    checkpoint -> PSR = CPU -> PSR;
+    memcpy(checkpoint -> R, CPU -> R, sizeof(checkpoint -> R));
+    checkpoint -> NZPVal = CPU -> NZPVal;
+    memcpy(checkpoint -> memory, CPU -> memory, sizeof(checkpoint -> memory));
+}
+
+
+/*
+ * Put CPU back to a checkpoint. Only words that differ are written, so
+ * predecoded instructions and cached blocks elsewhere stay valid.
+ */
+static void RestoreCheckpoint(MachineState* CPU, const ReverseCheckpoint* checkpoint)
+{
+    int address = 0;
+
+    for (address = 0; address < 65536; address++) {
+        if (CPU -> memory[address] != checkpoint -> memory[address]) {
+            StoreWord(CPU, address, checkpoint -> memory[address]);
+        }
+    }
+    CPU -> instructions = checkpoint -> instructions;
+    CPU -> PC = checkpoint -> PC;
+    CPU -> PSR = checkpoint -> PSR;
+    memcpy(CPU -> R, checkpoint -> R, sizeof(CPU -> R));
+    CPU -> NZPVal = checkpoint -> NZPVal;
+}
+
+
+/*
+ * Drop the checkpoints taken after the given point of the run: what happens
+ * from there on may differ.
+ */
+static void DropCheckpointsAfter(Reverse* reverse, unsigned long long instructions)
+{
+    while (reverse -> checkpointCount > 0 &&
+           Checkpoint(reverse, reverse -> checkpointCount - 1) -> instructions > instructions) {
+        reverse -> checkpointCount--;
+    }
+}
+
+
+/*
+ * The register an instruction writes, UNDO_NO_REG if none. Taken from the
+ * decoded instruction: regInputVal does not name it for every instruction
+ * (SHIFT/MOD leave the result there, JSR does not set it).
+ */
+static unsigned char WrittenRegister(const DecodedInsn* insn)
+{
+    switch (insn -> handler) {
+    case H_ADD: case H_MUL: case H_SUB: case H_DIV: case H_ADDI:
+    case H_AND: case H_NOT: case H_OR: case H_XOR: case H_ANDI: case H_LOGIC_NONE:
+    case H_LDR: case H_CONST: case H_HICONST:
+    case H_SLL: case H_SRA: case H_SRL: case H_MOD:
+        return insn -> rd;
+    case H_JSR: case H_JSRR: case H_TRAP: // return address
+        return 7;
+    default:
+        return UNDO_NO_REG;
+    }
+}
+
+
+/*
+ * Run and record one instruction.
+ */
+int ReverseRecordStep(MachineState* CPU, FILE* output)
+{
+    Reverse* reverse = CPU -> reverse;
+    DecodedInsn* insn;
+    DecodedInsn plain;
+    UndoEntry entry;
+    unsigned long long before = CPU -> instructions;
+    int status = 0;
+
+    if (CPU -> PC == 0x80FF) { // halted: nothing runs
+        return UpdateMachineState(CPU, output);
+    }
+    if (reverse -> checkpointCount == 0 ||
+        CPU -> instructions - Checkpoint(reverse, reverse -> checkpointCount - 1) -> instructions >= REVERSE_LOG_ENTRIES) {
+        TakeCheckpoint(reverse, CPU);
+    }
+
+    entry.pc = CPU -> PC;
+    entry.psr = CPU -> PSR;
+    entry.flags = CPU -> NZPVal & UNDO_NZP_MASK;
+    entry.address = 0;
+    entry.memoryValue = 0;
+    insn = FetchDecoded(CPU);
+    if (insn -> handler == H_BREAK) { // the instruction under a breakpoint
+        DecodeInsn(CPU -> PC, CPU -> memory[CPU -> PC], &plain);
+        insn = &plain;
+    }
+    if (insn -> handler == H_STR && // the only instruction writing memory
+        PAGE_ALLOWS(CPU, CPU -> PSR, (unsigned short)(CPU -> R[insn -> rs] + insn -> imm), PERM_WRITE)) {
+        entry.address = CPU -> R[insn -> rs] + insn -> imm;
+        entry.memoryValue = CPU -> memory[entry.address];
+        entry.flags |= UNDO_STORED;
+    }
+    entry.reg = WrittenRegister(insn);
+    entry.regValue = (entry.reg != UNDO_NO_REG) ? CPU -> R[entry.reg] : 0;
+
+    status = UpdateMachineState(CPU, output);
+    if (CPU -> instructions == before) { // a breakpoint kept it from running
+        return status;
+    }
+
+    reverse -> log[reverse -> logNext] = entry;
+    reverse -> logNext = (reverse -> logNext + 1) % REVERSE_LOG_ENTRIES;
+    if (reverse -> logCount < REVERSE_LOG_ENTRIES) {
+        reverse -> logCount++;
+    }
+    return status;
+}
+
+
+/*
+ * Undo the last instruction run.
+ */
+int ReverseStep(MachineState* CPU, UndoEntry* undone)
+{
+    Reverse* reverse = CPU -> reverse;
+    unsigned long long until = CPU -> instructions; // where the replay has to come back to
+    UndoEntry* entry;
+
+    if (reverse -> logCount == 0) { // refill the log from the newest checkpoint before this point
+        if (CPU -> instructions == 0) {
+            return -1;
+        }
+        DropCheckpointsAfter(reverse, until - 1);
+        if (reverse -> checkpointCount == 0) {
+            return -1; // older than the oldest checkpoint
+        }
+        RestoreCheckpoint(CPU, Checkpoint(reverse, reverse -> checkpointCount - 1));
+        if (CPU -> debugger != NULL) { // the replay runs through breakpoints and watchpoints
+            CPU -> debugger -> suspended = 1;
+        }
+        while (CPU -> instructions < until && ReverseRecordStep(CPU, NULL) == 0);
+        if (CPU -> debugger != NULL) {
+            CPU -> debugger -> suspended = 0;
+        }
+        if (reverse -> logCount == 0) {
+            return -1;
+        }
+    }
+
+    reverse -> logNext = (reverse -> logNext + REVERSE_LOG_ENTRIES - 1) % REVERSE_LOG_ENTRIES;
+    reverse -> logCount--;
+    entry = &reverse -> log[reverse -> logNext];
+    if (entry -> flags & UNDO_STORED) {
+        StoreWord(CPU, entry -> address, entry -> memoryValue);
+    }
+    if (entry -> reg != UNDO_NO_REG) {
+        CPU -> R[entry -> reg] = entry -> regValue;
+    }
+    CPU -> PC = entry -> pc;
+    CPU -> PSR = entry -> psr;
+    CPU -> NZPVal = entry -> flags & UNDO_NZP_MASK;
+    CPU -> instructions--;
+    DropCheckpointsAfter(reverse, CPU -> instructions);
+
+    if (undone != NULL) {
+        *undone = *entry;
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * reverse.h: Declares reverse execution: an undo log with checkpoints (--reverse)
+ *
+ * While CPU -> reverse is set, the step engine runs each instruction through
+ * ReverseRecordStep, which logs what the instruction is about to overwrite:
+ * PC, PSR and NZPVal, the register the decoded instruction writes (RD, or R7
+ * for JSR, JSRR and TRAP) and the word an STR stores to. The log is a ring
+ * of REVERSE_LOG_ENTRIES entries, so stepping back N instructions undoes N
+ * entries. Every REVERSE_LOG_ENTRIES instructions a full checkpoint (registers
+ * and memory) is kept as well, up to REVERSE_CHECKPOINTS of them; stepping
+ * back past the start of the ring restores the newest checkpoint before the
+ * target and replays forward from it, refilling the ring (straight through
+ * any breakpoints and watchpoints, see debug.h).
+ *
+ * Only machine state is restored: console output, keys read and frames
+ * written stay as they were, so reverse execution is not combined with the
+ * devices or --hle.
+ */
+
+#ifndef REVERSE_H
+#define REVERSE_H
+
+#include "LC4.h"
+
+#define REVERSE_LOG_ENTRIES (1 << 20) // instructions the undo log reaches back (also the checkpoint interval)
+#define REVERSE_CHECKPOINTS 16 // checkpoints kept (128 KB of memory each)
+
+// UndoEntry.reg when no register was written
+#define UNDO_NO_REG 0xFF
+
+// UndoEntry.flags
+#define UNDO_NZP_MASK 0x7 // NZPVal before the instruction
+#define UNDO_STORED 0x8 // address was stored to
+
+// What one instruction overwrote
+typedef struct {
+    unsigned short pc; // PC before the instruction
+    unsigned short psr; // PSR before it
+    unsigned short regValue; // old value of register reg
+    unsigned short address; // word stored to (UNDO_STORED)
+    unsigned short memoryValue; // its old value
+    unsigned char reg; // register written, UNDO_NO_REG if none
+    unsigned char flags; // UNDO_* bits
+} UndoEntry;
+
+// Full machine state at one point of the run
+typedef struct {
+    unsigned long long instructions; // CPU -> instructions when it was taken
+    unsigned short PC;
+    unsigned short PSR;
+    unsigned short R[8];
+    unsigned short NZPVal;
+    unsigned short memory[65536];
+} ReverseCheckpoint;
+
+typedef struct Reverse {
+    UndoEntry* log; // ring of REVERSE_LOG_ENTRIES
+    size_t logNext; // where the next entry goes
+    size_t logCount; // entries held: the instructions just before CPU -> instructions
+    ReverseCheckpoint* checkpoints; // ring of REVERSE_CHECKPOINTS, oldest first from checkpointFirst
+    int checkpointFirst;
+    int checkpointCount;
+} Reverse;
+
+
+/*
+ * Create an empty undo log. Returns NULL if out of memory.
+ */
+Reverse* ReverseCreate(void);
+
+
+/*
+ * Free the log and its checkpoints.
+ */
+void ReverseFree(Reverse* reverse);
+
+
+/*
+ * Run one instruction with UpdateMachineState (same output and return value),
+ * recording it in CPU -> reverse.
+ */
+int ReverseRecordStep(MachineState* CPU, FILE* output);
+
+
+/*
+ * Undo the last instruction run, copying its log entry to undone (when not
+ * NULL). Returns 0, or -1 if the history does not reach back that far.
+ */
+int ReverseStep(MachineState* CPU, UndoEntry* undone);
+
+#endif
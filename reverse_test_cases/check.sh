@@ -0,0 +1,78 @@
+#!/bin/bash
+# Rewind programs whose last instructions write registers that regInputVal
+# does not name (SLL, MOD, JSR, JSRR) and check the machine comes back as
+# Reset left it. boot.obj: x8200 CONST R7,#0; RTI into the program at x0000.
+#
+#   shift.obj  CONST R1,#5; SLL R3,R1,#1; TRAP xFF
+#   mod.obj    CONST R1,#5; CONST R2,#3; MOD R3,R1,R2; TRAP xFF
+#   jsr.obj    CONST R1,#2; ADD R1,R1,#0; JSR x0010 (x0010: TRAP xFF)
+#   jsrr.obj   CONST R1,#2; CONST R5,#16; ADD R1,R1,#0; JSRR R5 (x0010: TRAP xFF)
+#
+# breakpoints.obj runs ADD and JMP under breakpoints, then loops for more
+# instructions than the undo log holds, so going back to them replays from
+# the first checkpoint straight through the breakpoints (driven over --gdb).
+#
+#   breakpoints.obj  CONST R2,#5; CONST R3,#7; ADD R1,R2,R3; JMP x0005;
+#                    TRAP xFF; x0005: count down 9 x 65536; TRAP xFF
+
+trace=${1:-./trace}
+dir=$(dirname "$0")
+reset="R0: 0x0000 R1: 0x0000 R2: 0x0000 R3: 0x0000 R4: 0x0000 R5: 0x0000 R6: 0x0000 R7: 0x0000 PSR: 0x0000 instructions: 0"
+failed=0
+
+for program in shift mod jsr jsrr; do
+    count=$("$trace" --no-trace --dump-final-state "$dir/boot.obj" "$dir/$program.obj" | sed -n 's/instructions: //p')
+    state=$("$trace" --no-trace --dump-final-state --reverse --rewind "$count" "$dir/boot.obj" "$dir/$program.obj" | tr '\n' ' ')
+    if [ "$state" != "$reset " ]; then
+        echo "FAIL $program: rewinding $count instructions left $state"
+        failed=1
+    fi
+done
+
+for program in jsr jsrr; do # back over the TRAP and the call: R7 as the boot code left it
+    r7=$("$trace" --no-trace --dump-final-state --reverse --rewind 2 "$dir/boot.obj" "$dir/$program.obj" | sed -n 's/R7: //p')
+    if [ "$r7" != "0x0000" ]; then
+        echo "FAIL $program: R7 is $r7 before the call"
+        failed=1
+    fi
+done
+
+port=${GDB_PORT:-4141}
+packet() { # send $1 with its checksum, and print the reply
+    local sum=0 i reply
+    for ((i = 0; i < ${#1}; i++)); do
+        sum=$(( (sum + $(printf '%d' "'${1:i:1}")) & 255 ))
+    done
+    printf '$%s#%02x' "$1" $sum >&3
+    read -r -d '#' -u 3 reply
+    read -r -n 2 -u 3
+    echo "${reply##*\$}"
+}
+"$trace" --no-trace --reverse --gdb $port "$dir/boot.obj" "$dir/breakpoints.obj" 2> /dev/null &
+for i in $(seq 50); do
+    { exec 3<>/dev/tcp/127.0.0.1/$port; } 2> /dev/null && break
+    sleep 0.1
+done
+if ! { true >&3; } 2> /dev/null; then
+    echo "FAIL breakpoints: no debugger on port $port"
+    exit 1
+fi
+packet QStartNoAckMode > /dev/null
+printf '+' >&3
+packet Z0,b,2 > /dev/null
+packet c > /dev/null # to the TRAP at the end
+packet Z0,2,2 > /dev/null
+packet Z0,3,2 > /dev/null
+stop=$(packet bc) # back to the JMP, replaying the start of the run
+registers=$(packet g)
+packet k > /dev/null
+exec 3>&-
+wait
+# R1 = 12 from the ADD, PC = x0003, PSR P
+if [ "$stop" != "T05" ] || [ "$registers" != "0000000c00050007000000000000000000030001" ]; then
+    echo "FAIL breakpoints: stopped with $stop, registers $registers"
+    failed=1
+fi
+
+[ $failed = 0 ] && echo "reverse checks passed"
+exit $failed
@@ -0,0 +1,165 @@
+/*
+ * snapshot.c: Saves and restores a MachineState to a snapshot file
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+
+/*
+ * Whether a page holds any non-zero word.
+ */
+static int PageUsed(const unsigned short* page)
+{
+    int i = 0; // word in page
+
+    for (i = 0; i < SNAPSHOT_PAGE_WORDS; i++) {
+        if (page[i] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Write the machine state to filename.
+ */
+int SaveSnapshot(MachineState* CPU, const char* filename, unsigned long long instructions)
+{
+    static unsigned char padding[SNAPSHOT_DATA_OFFSET]; // zeros after the header
+    SnapshotHeader header;
+    FILE* file;
+    int page = 0; // page number
+    int status = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.instructions = instructions;
+
+    header.PC = CPU -> PC;
+    header.PSR = CPU -> PSR;
+    memcpy(header.R, CPU -> R, sizeof(header.R));
+    header.rsMux_CTL = CPU -> rsMux_CTL;
+    header.rtMux_CTL = CPU -> rtMux_CTL;
+    header.rdMux_CTL = CPU -> rdMux_CTL;
+    header.regFile_WE = CPU -> regFile_WE;
+    header.NZP_WE = CPU -> NZP_WE;
+    header.DATA_WE = CPU -> DATA_WE;
+    header.regInputVal = CPU -> regInputVal;
+    header.NZPVal = CPU -> NZPVal;
+    header.dmemAddr = CPU -> dmemAddr;
+    header.dmemValue = CPU -> dmemValue;
+
+    for (page = 0; page < SNAPSHOT_PAGES; page++) {
+        header.present[page] = PageUsed(&CPU -> memory[page * SNAPSHOT_PAGE_WORDS]);
+        header.pageCount += header.present[page];
+    }
+
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "error: snapshot %s could not be open\n", filename);
+        return -1;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(padding, SNAPSHOT_DATA_OFFSET - sizeof(header), 1, file) != 1) {
+        status = -1;
+    }
+    for (page = 0; page < SNAPSHOT_PAGES && status == 0; page++) {
+        if (header.present[page] &&
+            fwrite(&CPU -> memory[page * SNAPSHOT_PAGE_WORDS], SNAPSHOT_PAGE_WORDS * 2, 1, file) != 1) {
+            status = -1;
+        }
+    }
+
+    if (fclose(file) != 0 || status != 0) {
+        fprintf(stderr, "error: could not write snapshot %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Replace the machine state with the snapshot in filename.
+ */
+int LoadSnapshot(MachineState* CPU, const char* filename, unsigned long long* instructions)
+{
+    const SnapshotHeader* header;
+    const unsigned char* data; // mapped file
+    const unsigned char* stored; // next stored page
+    struct stat info;
+    int fd = 0;
+    int page = 0; // page number
+    int count = 0; // pages marked present
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "error: snapshot %s could not be open\n", filename);
+        return -1;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size < SNAPSHOT_DATA_OFFSET) {
+        fprintf(stderr, "error: %s is not a snapshot\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "error: snapshot %s could not be mapped\n", filename);
+        return -1;
+    }
+    header = (const SnapshotHeader*)data;
+
+    for (page = 0; page < SNAPSHOT_PAGES; page++) {
+        count += (header -> present[page] != 0);
+    }
+    if (memcmp(header -> magic, SNAPSHOT_MAGIC, 4) != 0 || header -> version != SNAPSHOT_VERSION ||
+        header -> byteOrder != SNAPSHOT_BYTE_ORDER || count != header -> pageCount ||
+        info.st_size != SNAPSHOT_DATA_OFFSET + (off_t)count * SNAPSHOT_PAGE_WORDS * 2) {
+        fprintf(stderr, "error: %s is not a snapshot this simulator can read\n", filename);
+        munmap((void*)data, info.st_size);
+        return -1;
+    }
+
+    CPU -> PC = header -> PC;
+    CPU -> PSR = header -> PSR;
+    memcpy(CPU -> R, header -> R, sizeof(CPU -> R));
+    CPU -> rsMux_CTL = header -> rsMux_CTL;
+    CPU -> rtMux_CTL = header -> rtMux_CTL;
+    CPU -> rdMux_CTL = header -> rdMux_CTL;
+    CPU -> regFile_WE = header -> regFile_WE;
+    CPU -> NZP_WE = header -> NZP_WE;
+    CPU -> DATA_WE = header -> DATA_WE;
+    CPU -> regInputVal = header -> regInputVal;
+    CPU -> NZPVal = header -> NZPVal;
+    CPU -> dmemAddr = header -> dmemAddr;
+    CPU -> dmemValue = header -> dmemValue;
+    *instructions = header -> instructions;
+
+    stored = data + SNAPSHOT_DATA_OFFSET;
+    for (page = 0; page < SNAPSHOT_PAGES; page++) {
+        if (header -> present[page]) {
+            memcpy(&CPU -> memory[page * SNAPSHOT_PAGE_WORDS], stored, SNAPSHOT_PAGE_WORDS * 2);
+            stored += SNAPSHOT_PAGE_WORDS * 2;
+        } else {
+            memset(&CPU -> memory[page * SNAPSHOT_PAGE_WORDS], 0, SNAPSHOT_PAGE_WORDS * 2);
+        }
+    }
+
+    // Everything derived from the old memory is stale
+    memset(CPU -> decoded, 0, sizeof(CPU -> decoded));
+    memset(CPU -> blockLength, 0, sizeof(CPU -> blockLength));
+    memset(CPU -> blockPage, 0, sizeof(CPU -> blockPage));
+    CPU -> blockFlushes++;
+
+    munmap((void*)data, info.st_size);
+    return 0;
+}
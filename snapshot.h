@@ -0,0 +1,62 @@
+/*
+ * snapshot.h: Declares saving and restoring a MachineState to a snapshot file
+ *
+ * File layout: a SnapshotHeader, zero padded to SNAPSHOT_DATA_OFFSET, then
+ * each page marked in present[] (SNAPSHOT_PAGE_WORDS words, host byte order)
+ * in address order. Pages of all zeros are not stored. The page data is page
+ * aligned so the file can be mapped and read in place.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "LC4.h"
+
+#define SNAPSHOT_MAGIC "LC4S"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x0102 // written in the writer's byte order
+#define SNAPSHOT_PAGE_WORDS 256 // words per stored page
+#define SNAPSHOT_PAGES (65536 / SNAPSHOT_PAGE_WORDS)
+#define SNAPSHOT_DATA_OFFSET 4096 // file offset of the first stored page
+
+typedef struct {
+    char magic[4]; // SNAPSHOT_MAGIC
+    unsigned short version; // SNAPSHOT_VERSION
+    unsigned short byteOrder; // SNAPSHOT_BYTE_ORDER
+    unsigned long long instructions; // instructions executed since Reset
+
+    unsigned short PC;
+    unsigned short PSR;
+    unsigned short R[8];
+
+    unsigned char rsMux_CTL;
+    unsigned char rtMux_CTL;
+    unsigned char rdMux_CTL;
+    unsigned char regFile_WE;
+    unsigned char NZP_WE;
+    unsigned char DATA_WE;
+    unsigned short regInputVal;
+    unsigned short NZPVal;
+    unsigned short dmemAddr;
+    unsigned short dmemValue;
+
+    unsigned short pageCount; // pages stored after the header
+    unsigned char present[SNAPSHOT_PAGES]; // 1 for every stored page
+} SnapshotHeader;
+
+
+/*
+ * Write the machine state to filename, recording the instruction count.
+ * Returns 0 on success, -1 on failure.
+ */
+int SaveSnapshot(MachineState* CPU, const char* filename, unsigned long long instructions);
+
+
+/*
+ * Replace the machine state with the snapshot in filename (predecoded
+ * instructions and cached blocks are dropped). Stores the snapshot's
+ * instruction count in *instructions. Returns 0 on success, -1 on failure.
+ */
+int LoadSnapshot(MachineState* CPU, const char* filename, unsigned long long* instructions);
+
+#endif
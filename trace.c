@@ -3,49 +3,426 @@
  */
 
 #include "loader.h"
+#include "jit.h"
+#include "tracewriter.h"
+#include "snapshot.h"
+#include "imagecache.h"
+#include "batch.h"
+#include "memorymap.h"
+#include "devices.h"
+#include "profile.h"
+#include "reverse.h"
+#include "gdbstub.h"
+
+#define EXPECT_SLICE 1000000 // instructions run between checks of the trace with --expect
 
 // Global variable defining the current state of the machine
 MachineState* CPU;
 
+
+/*
+ * Run the selected engine for budget instructions (0 = until halt), untraced
+ * when output is NULL. Returns 1 once PC = 0x80FF, 0 if the budget ran out,
+ * 2 on a breakpoint or watchpoint stop (--gdb), -1 on a JIT verify mismatch.
+ */
+static int Run(char* engine, JitState* jitState, int jit, FILE* output, unsigned long long budget)
+{
+    unsigned long long n = 0; // instructions stepped
+    int status = 0;
+
+    if (jit) { // Native code runs untraced (only taken with --no-trace)
+        if (jitState == NULL) {
+            return RunUntraced(CPU, budget);
+        }
+        return RunJit(CPU, jitState, budget, jit == 2);
+    } else if (output == NULL && CPU -> profile == NULL && CPU -> reverse == NULL) { // --no-trace: lean loop whatever the engine
+        return RunUntraced(CPU, budget);
+    } else if (strcmp(engine, "threaded") == 0) {
+        return RunUntilHalt(CPU, output, budget);
+    } else if (strcmp(engine, "blocks") == 0) {
+        return RunBlocks(CPU, output, budget);
+    }
+
+    for (n = 0; budget == 0 || n < budget; n++) {
+        status = (CPU -> reverse != NULL) ? ReverseRecordStep(CPU, output) : UpdateMachineState(CPU, output);
+        if (status != 0) {
+            return status;
+        }
+    }
+    return (CPU -> PC == 0x80FF);
+}
+
+
+/*
+ * Print the final registers, PSR and instruction count (--dump-final-state).
+ */
+static void DumpFinalState(FILE* output)
+{
+    int i = 0;
+
+    for (i = 0; i < 8; i++) {
+        fprintf(output, "R%d: 0x%04X\n", i, CPU -> R[i]);
+    }
+    fprintf(output, "PSR: 0x%04X\n", CPU -> PSR);
+    fprintf(output, "instructions: %llu\n", CPU -> instructions);
+}
+
+
+/*
+ * Step back to just before the last store to address and report it (--last-write).
+ */
+static int FindLastWrite(unsigned short address)
+{
+    UndoEntry undone;
+    unsigned short value = CPU -> memory[address]; // what that store left there
+
+    while (ReverseStep(CPU, &undone) == 0) {
+        if ((undone.flags & UNDO_STORED) && undone.address == address) {
+            printf("x%04X was last written by the instruction at x%04X (instruction %llu): x%04X replaced x%04X\n",
+                   address, undone.pc, CPU -> instructions + 1, value, undone.memoryValue);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: no store to x%04X within the recorded history\n", address);
+    return -1;
+}
+
+
+/*
+ * Release the output file and the machine after an error.
+ */
+static int Fail(FILE* output)
+{
+    if (output != NULL) {
+        fclose(output);
+    }
+    DevicesClose(CPU);
+    free(CPU -> profile);
+    ReverseFree(CPU -> reverse);
+    free(CPU);
+    return -1;
+}
+
+
 int main(int argc, char** argv)
 {
-    FILE* output_file; // Output file
     int i = 1; // Counter for arguments
     int state = 0; // Machine State
+    char* engine = "step"; // Run loop: step, threaded or blocks
+    int first = 1; // Index of the output file argument
+    int jit = 0; // 1 = --jit, 2 = --jit-verify
+    JitState* jitState = NULL; // Code cache for --jit
+    int format = TRACE_FORMAT_TEXT; // --trace-format
+    int async = 0; // --trace-async: format and write on a second thread
+    unsigned long long snapshotAt = 0; // --snapshot-at N: save <filename.txt>.snap after N instructions
+    char* resumeFrom = NULL; // --resume-from file: start from a snapshot instead of .obj files
+    char* snapshotName = NULL; // <filename.txt>.snap
+    unsigned long long executed = 0; // instructions executed since Reset
+    char* imageCache = NULL; // --image-cache DIR: reuse loaded memory images
+    char* seeds = NULL; // --batch SEEDS: run one instance per seed line in lockstep
+    Batch* batch = NULL; // Instances for --batch
+    int noTrace = 0; // --no-trace: no <filename.txt>, run on the untraced loop
+    int dumpFinalState = 0; // --dump-final-state: print registers, PSR and instruction count at the end
+    int objects = 0; // Index of the first .obj argument
+    char* expect = NULL; // --expect golden.txt: compare the trace with golden.txt instead of writing it
+    int expectContext = TRACE_EXPECT_CONTEXT; // --expect-context N: matching lines shown before a divergence
+    char* profileName = NULL; // --profile out.json: count executions on the step engine, write them at exit
+    SymbolTable symbols = {NULL, 0, 0}; // Labels of the object files, for --profile
+    char* memoryMap = NULL; // --memory-map FILE: page permissions instead of the standard LC4 map
+    int devices = 0; // --devices: console on stdin/stdout, timer and framebuffer at xC000-xFE0C
+    char* frames = NULL; // --frames PREFIX: also write changed frames to PREFIXNNNNNN.ppm
+    int hle = 0; // --hle: run the known OS TRAP routines natively (see hle.h)
+    int reverse = 0; // --reverse: record an undo log on the step engine (see reverse.h)
+    unsigned long long rewind = 0; // --rewind N: step back N instructions at the end
+    long lastWrite = -1; // --last-write ADDR: step back to the last store to ADDR at the end
+    int warp = 0; // --time-warp: instruction-driven timer, polling loops skipped (1), and noted in the trace (2)
+    char* gdb = NULL; // --gdb PORT|PATH: serve a GDB remote debugger before running on (see gdbstub.h)
+    GdbStub* stub = NULL; // The debugger connection for --gdb
+    unsigned long long budget = 0; // instructions the debugger lets run
+    int action = GDB_RUN; // what the debugger asked for last
+    FILE* output_file = NULL; // Output file (NULL with --no-trace, the expected trace with --expect)
+
+    // Options come before <filename.txt>
+    while (first < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strncmp(argv[first], "--engine=", 9) == 0) {
+            engine = argv[first] + 9;
+            if (strcmp(engine, "step") != 0 && strcmp(engine, "threaded") != 0 && strcmp(engine, "blocks") != 0) {
+                fprintf(stderr, "Error: unknown engine %s\n", engine);
+                return -1;
+            }
+        } else if (strcmp(argv[first], "--trace-format=text") == 0) {
+            format = TRACE_FORMAT_TEXT;
+        } else if (strcmp(argv[first], "--trace-format=bin") == 0) {
+            format = TRACE_FORMAT_BIN;
+        } else if (strcmp(argv[first], "--trace-format=delta") == 0) {
+            format = TRACE_FORMAT_DELTA;
+        } else if (strcmp(argv[first], "--trace-async") == 0) {
+            async = 1;
+        } else if (strcmp(argv[first], "--snapshot-at") == 0 && first + 1 < argc) {
+            snapshotAt = strtoull(argv[++first], NULL, 0);
+        } else if (strcmp(argv[first], "--resume-from") == 0 && first + 1 < argc) {
+            resumeFrom = argv[++first];
+        } else if (strcmp(argv[first], "--image-cache") == 0 && first + 1 < argc) {
+            imageCache = argv[++first];
+        } else if (strcmp(argv[first], "--batch") == 0 && first + 1 < argc) {
+            seeds = argv[++first];
+        } else if (strcmp(argv[first], "--no-trace") == 0) {
+            noTrace = 1;
+        } else if (strcmp(argv[first], "--expect") == 0 && first + 1 < argc) {
+            expect = argv[++first];
+        } else if (strcmp(argv[first], "--expect-context") == 0 && first + 1 < argc) {
+            expectContext = atoi(argv[++first]);
+        } else if (strcmp(argv[first], "--profile") == 0 && first + 1 < argc) {
+            profileName = argv[++first];
+        } else if (strcmp(argv[first], "--memory-map") == 0 && first + 1 < argc) {
+            memoryMap = argv[++first];
+        } else if (strcmp(argv[first], "--devices") == 0) {
+            devices = 1;
+        } else if (strcmp(argv[first], "--frames") == 0 && first + 1 < argc) {
+            frames = argv[++first];
+            devices = 1;
+        } else if (strcmp(argv[first], "--time-warp") == 0) {
+            warp = (warp > 1) ? warp : 1;
+            devices = 1;
+        } else if (strcmp(argv[first], "--trace-elided") == 0) {
+            warp = 2;
+            devices = 1;
+        } else if (strcmp(argv[first], "--reverse") == 0) {
+            reverse = 1;
+        } else if (strcmp(argv[first], "--rewind") == 0 && first + 1 < argc) {
+            rewind = strtoull(argv[++first], NULL, 0);
+            reverse = 1;
+        } else if (strcmp(argv[first], "--last-write") == 0 && first + 1 < argc) {
+            first++;
+            lastWrite = strtol(argv[first] + (argv[first][0] == 'x'), NULL, (argv[first][0] == 'x') ? 16 : 0) & 0xFFFF;
+            reverse = 1;
+        } else if (strcmp(argv[first], "--hle") == 0) {
+            hle = 1;
+        } else if (strcmp(argv[first], "--gdb") == 0 && first + 1 < argc) {
+            gdb = argv[++first];
+        } else if (strcmp(argv[first], "--dump-final-state") == 0) {
+            dumpFinalState = 1;
+        } else if (strcmp(argv[first], "--jit") == 0) {
+            jit = 1;
+        } else if (strcmp(argv[first], "--jit-verify") == 0) {
+            jit = 2;
+        } else {
+            fprintf(stderr, "Error: unknown option %s\n", argv[first]);
+            return -1;
+        }
+        first++;
+    }
+
+    if ((noTrace || expect != NULL) && snapshotAt != 0) {
+        fprintf(stderr, "Error: --snapshot-at writes <filename.txt>.snap, which --no-trace and --expect do not take\n");
+        return -1;
+    }
+    if (jit && !noTrace) {
+        fprintf(stderr, "Error: --jit and --jit-verify run untraced, they need --no-trace\n");
+        return -1;
+    }
+    if (expect != NULL && (noTrace || jit || seeds != NULL || format != TRACE_FORMAT_TEXT)) {
+        fprintf(stderr, "Error: --expect checks a text trace, it cannot be combined with --no-trace, --jit, --batch or --trace-format\n");
+        return -1;
+    }
+    if (profileName != NULL && (strcmp(engine, "step") != 0 || jit || seeds != NULL)) {
+        fprintf(stderr, "Error: --profile counts on the step engine, it cannot be combined with --engine, --jit or --batch\n");
+        return -1;
+    }
+    if (devices && seeds != NULL) {
+        fprintf(stderr, "Error: --devices, --frames and --time-warp need a single machine, they cannot be combined with --batch\n");
+        return -1;
+    }
+    if (warp == 2 && (noTrace || expect != NULL || async || format != TRACE_FORMAT_TEXT)) {
+        fprintf(stderr, "Error: --trace-elided adds lines to a text trace, it cannot be combined with --no-trace, --expect, --trace-async or --trace-format\n");
+        return -1;
+    }
+    if (reverse && (strcmp(engine, "step") != 0 || jit || seeds != NULL || devices || hle || profileName != NULL)) {
+        fprintf(stderr, "Error: --reverse records on the step engine and cannot undo device I/O, it cannot be combined with --engine, --jit, --batch, --devices, --hle or --profile\n");
+        return -1;
+    }
+    if (hle && (expect != NULL || profileName != NULL || seeds != NULL)) {
+        fprintf(stderr, "Error: --hle leaves the OS routines out of the trace, it cannot be combined with --expect, --profile or --batch\n");
+        return -1;
+    }
+    if (gdb != NULL && (jit || seeds != NULL || hle || expect != NULL)) {
+        fprintf(stderr, "Error: --gdb stops the interpreters at breakpoints and watchpoints, it cannot be combined with --jit, --batch, --hle or --expect\n");
+        return -1;
+    }
+    objects = (noTrace || expect != NULL) ? first : first + 1;
+
     CPU = malloc(sizeof(MachineState)); // Allocate memory for CPU
     memset(CPU, 0, sizeof(MachineState)); // Set memory contents to zero
-    
-    if (argc < 3) { // Filename and an obj not written
-        fprintf(stderr, "Error: <filename.txt> and <first.obj> not written\n");
-        free(CPU);
-        return -1;
+
+    if (profileName != NULL) {
+        CPU -> profile = ProfileCreate();
+        if (CPU -> profile == NULL) {
+            return Fail(NULL);
+        }
+        CPU -> symbols = &symbols;
+        imageCache = NULL; // the labels come from reading the objects themselves
+    }
+    if (reverse) {
+        CPU -> reverse = ReverseCreate();
+        if (CPU -> reverse == NULL) {
+            fprintf(stderr, "Error: out of memory for the undo log\n");
+            return Fail(NULL);
+        }
+    }
+
+    if (argc - objects < ((resumeFrom != NULL) ? 0 : 1)) { // Filename and an obj not written
+        fprintf(stderr, (objects == first) ? "Error: <first.obj> not written\n" : "Error: <filename.txt> and <first.obj> not written\n");
+        return Fail(NULL);
     } else { // Something written as argument
-        output_file = fopen(argv[1], "w");
-        if (output_file == NULL) { // Check if successful open
-            fprintf(stderr, "Error: <filename.txt> could not be open\n");
+        if (expect != NULL) {
+            output_file = fopen(expect, "rb");
+            if (output_file == NULL) {
+                fprintf(stderr, "Error: %s could not be open\n", expect);
+                return Fail(NULL);
+            }
+        } else if (!noTrace) {
+            output_file = fopen(argv[first], (format == TRACE_FORMAT_TEXT) ? "w" : "wb");
+            if (output_file == NULL) { // Check if successful open
+                fprintf(stderr, "Error: <filename.txt> could not be open\n");
+                return Fail(NULL);
+            }
+        }
+
+        if (imageCache != NULL && resumeFrom == NULL) { // Whole memory image from the cache when possible
+            if (LoadImageCached(CPU, imageCache, argv + objects, argc - objects) != 0) {
+                return Fail(output_file);
+            }
+        }
+
+        for (i = objects; i < argc && resumeFrom == NULL && imageCache == NULL; i++) { // Write all data into memory
+            if (ReadObjectFile(argv[i], CPU) != 0) {
+                return Fail(output_file); // Error during ReadObjectFile()
+            }
+        }
+
+    }
+
+    if (resumeFrom != NULL) { // Machine state, memory included, comes from the snapshot
+        if (LoadSnapshot(CPU, resumeFrom, &executed) != 0) {
+            return Fail(output_file);
+        }
+        CPU -> instructions = executed;
+        DefaultMemoryMap(CPU); // snapshots do not record the map
+    } else {
+        Reset(CPU);
+        ClearSignals(CPU);
+    }
+
+    if (memoryMap != NULL && LoadMemoryMap(CPU, memoryMap) != 0) {
+        return Fail(output_file);
+    }
+
+    if (devices) { // LDR/STR on the device pages go through the devices from here on
+        CPU -> devices = DevicesCreate(stdin, stdout, frames);
+        if (CPU -> devices == NULL) {
+            return Fail(output_file);
+        }
+        DevicesAttach(CPU, CPU -> devices);
+        CPU -> devices -> warp = (warp != 0);
+        CPU -> devices -> noteElided = (warp == 2);
+    }
+    CPU -> hle = (unsigned char)hle;
+
+    if (seeds != NULL) { // Untraced; <filename.txt> (stdout with --no-trace) gets the final state of each instance
+        batch = BatchLoad(CPU, seeds);
+        if (batch == NULL) {
+            return Fail(output_file);
+        }
+        BatchRun(batch, 0); // Runs until every PC = 0x80FF
+        BatchWriteOut(batch, noTrace ? stdout : output_file);
+        BatchFree(batch);
+        if (output_file != NULL) {
             fclose(output_file);
-            free(CPU);
-            return -1;
         }
-        
-        for (i = 2; i < argc; i++) { // Write all data into memory
-            if (ReadObjectFile(argv[i], CPU) == 1) {
-                free(CPU);
-                return -1; // Error during ReadObjectFile()
-            } 
+        free(CPU);
+        return 0;
+    }
+
+    if (!noTrace) {
+        // Buffered text, or packed records (see trace2txt), or text compared against --expect
+        CPU -> trace = TraceOpen(output_file, (expect != NULL) ? TRACE_FORMAT_EXPECT : format, async);
+        if (CPU -> trace == NULL) {
+            return Fail(output_file);
         }
-        
+        CPU -> trace -> context = expectContext;
     }
-    
-    Reset(CPU);
-    ClearSignals(CPU);
-    
-    while (UpdateMachineState(CPU, output_file) == 0) {
-        continue;
+
+    if (jit) {
+        jitState = JitCreate();
+        if (jitState == NULL) {
+            fprintf(stderr, "Warning: JIT unavailable on this host, interpreting\n");
+        }
+    }
+
+    if (snapshotAt > CPU -> instructions) { // Run up to the snapshot point first
+        state = Run(engine, jitState, jit, output_file, snapshotAt - CPU -> instructions);
+        if (state == 0) {
+            snapshotName = malloc(strlen(argv[first]) + 6);
+            sprintf(snapshotName, "%s.snap", argv[first]);
+            if (SaveSnapshot(CPU, snapshotName, snapshotAt) != 0) {
+                state = -1;
+            }
+            free(snapshotName);
+        }
     }
 
+    if (state == 0 && gdb != NULL) { // The debugger drives the run until it detaches
+        stub = GdbOpen(CPU, gdb);
+        if (stub == NULL) {
+            state = -1;
+        }
+        while (state >= 0 && (action = GdbNext(stub, &budget)) == GDB_RUN) {
+            state = Run(engine, jitState, jit, output_file, budget);
+            GdbStopped(stub, state);
+        }
+        GdbClose(stub);
+        if (state >= 0) {
+            state = (action == GDB_DETACH) ? 0 : 1; // killed: the run ends here
+        }
+    }
+    if (state == 0 && expect == NULL) {
+        state = Run(engine, jitState, jit, output_file, 0); // Runs until PC = 0x80FF
+    }
+    while (state == 0 && expect != NULL) { // In slices, so a divergence stops the run soon after it happens
+        state = Run(engine, jitState, jit, output_file, EXPECT_SLICE);
+        if (TraceFlush(CPU -> trace) != 0) {
+            state = -1;
+        }
+    }
+    JitFree(jitState);
 
-    fclose(output_file); // Close file 
+    if (DevicesClose(CPU) != 0) { // Console output and the last frame
+        state = -1;
+    }
+    if (CPU -> trace != NULL && TraceClose(CPU -> trace) != 0) {
+        state = -1;
+    }
+    for (; state >= 0 && rewind != 0; rewind--) { // back from the end of the run
+        if (ReverseStep(CPU, NULL) != 0) {
+            fprintf(stderr, "Error: the recorded history ends %llu instructions short\n", rewind);
+            state = -1;
+        }
+    }
+    if (state >= 0 && lastWrite >= 0 && FindLastWrite((unsigned short)lastWrite) != 0) {
+        state = -1;
+    }
+    if (dumpFinalState) {
+        DumpFinalState(stdout);
+    }
+    if (CPU -> profile != NULL && ProfileWrite(CPU -> profile, &symbols, profileName) != 0) {
+        state = -1;
+    }
+    free(CPU -> profile);
+    ReverseFree(CPU -> reverse);
+    FreeSymbols(&symbols);
+    if (output_file != NULL) {
+        fclose(output_file); // Close file
+    }
     free(CPU); // Free up memory
-    return 0;
-}
\ No newline at end of file
+    return (state < 0) ? -1 : 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * trace2txt.c: Renders a binary or compressed trace (trace --trace-format=bin|delta) as the text trace
+ */
+
+#include <stdlib.h>
+#include "tracewriter.h"
+#include "tracedelta.h"
+
+#define RECORDS_PER_READ 4096 // records pulled in by each fread
+
+int main(int argc, char** argv)
+{
+    FILE* input; // Binary trace
+    FILE* output = stdout; // Text trace
+    TraceWriter* writer; // Buffered text formatting into output
+    TraceDelta* delta = NULL; // Decoder state for compressed traces
+    TraceRecord record; // Record decoded from a compressed trace
+    int encoding = 0; // TRACE_ENCODING_* of the input
+    int decoded = 0; // TraceDeltaDecode result
+    static TraceRecord records[RECORDS_PER_READ]; // Records read so far
+    size_t count = 0; // Records in the last read
+    size_t i = 0; // Counter for records
+    int status = 0;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: trace2txt <trace.bin> [<filename.txt>]\n");
+        return -1;
+    }
+
+    input = fopen(argv[1], "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error: %s could not be open\n", argv[1]);
+        return -1;
+    }
+    encoding = TraceReadHeader(input);
+    if (encoding < 0) {
+        fclose(input);
+        return -1;
+    }
+
+    if (argc == 3) {
+        output = fopen(argv[2], "w");
+        if (output == NULL) {
+            fprintf(stderr, "Error: %s could not be open\n", argv[2]);
+            fclose(input);
+            return -1;
+        }
+    }
+
+    writer = TraceOpen(output, TRACE_FORMAT_TEXT, 0);
+    if (writer == NULL) {
+        status = -1;
+    }
+
+    if (writer != NULL && encoding == TRACE_ENCODING_DELTA) {
+        delta = TraceDeltaCreate();
+        if (delta == NULL) {
+            status = -1;
+        }
+        while (delta != NULL && (decoded = TraceDeltaDecode(delta, input, &record)) == 1) {
+            TraceAppend(writer, &record);
+        }
+        if (decoded < 0) {
+            status = -1;
+        }
+        free(delta);
+    }
+
+    while (writer != NULL && encoding == TRACE_ENCODING_RAW && (count = fread(records, sizeof(TraceRecord), RECORDS_PER_READ, input)) > 0) {
+        for (i = 0; i < count; i++) {
+            TraceAppend(writer, &records[i]);
+        }
+    }
+
+    if (ferror(input)) {
+        fprintf(stderr, "error: could not read %s\n", argv[1]);
+        status = -1;
+    }
+
+    if (TraceClose(writer) != 0) {
+        status = -1;
+    }
+    fclose(input);
+    if (output != stdout) {
+        fclose(output);
+    }
+    return status;
+}
@@ -0,0 +1,302 @@
+/*
+ * tracedelta.c: Loop-aware delta/run-length trace codec
+ */
+
+#include <stdlib.h>
+#include "tracedelta.h"
+
+#define FIELD_PC 0x01
+#define FIELD_INSN 0x02
+#define FIELD_REG 0x04
+#define FIELD_REG_VALUE 0x08
+#define FIELD_DMEM_ADDR 0x10
+#define FIELD_DMEM_VALUE 0x20
+#define FIELD_FLAGS 0x40
+#define TOKEN_RECORD 0x80
+
+#define MAX_SHORT_RUN 0x7F // longest run that fits in the token byte
+
+
+/*
+ * Allocate codec state.
+ */
+TraceDelta* TraceDeltaCreate(void)
+{
+    TraceDelta* delta = calloc(1, sizeof(TraceDelta));
+
+    if (delta == NULL) {
+        fprintf(stderr, "error: out of memory for trace compression\n");
+    }
+    return delta;
+}
+
+
+/*
+ * The record expected next if the program repeats what it did last time.
+ */
+static void Predict(const TraceDelta* delta, TraceRecord* predicted)
+{
+    unsigned short pc = delta -> nextPc[delta -> prevPc]; // expected PC
+
+    *predicted = delta -> last[pc];
+    predicted -> pc = pc;
+    predicted -> regValue += delta -> regStride[pc];
+    predicted -> dmemAddr += delta -> addrStride[pc];
+    predicted -> dmemValue += delta -> valueStride[pc];
+}
+
+
+/*
+ * Learn from the record just coded.
+ */
+static void Update(TraceDelta* delta, const TraceRecord* record)
+{
+    TraceRecord* last = &delta -> last[record -> pc];
+
+    delta -> regStride[record -> pc] = record -> regValue - last -> regValue;
+    delta -> addrStride[record -> pc] = record -> dmemAddr - last -> dmemAddr;
+    delta -> valueStride[record -> pc] = record -> dmemValue - last -> dmemValue;
+    *last = *record;
+    last -> reserved = 0;
+
+    delta -> nextPc[delta -> prevPc] = record -> pc;
+    delta -> prevPc = record -> pc;
+}
+
+
+static unsigned char* PutVarint(unsigned char* out, unsigned long long value)
+{
+    while (value >= 0x80) {
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+
+// Difference actual - predicted as a zigzag varint (small steps either way stay one byte)
+static unsigned char* PutDifference(unsigned char* out, unsigned short actual, unsigned short predicted)
+{
+    short difference = (short)(actual - predicted);
+
+    return PutVarint(out, (unsigned short)((difference << 1) ^ (difference >> 15)));
+}
+
+
+static unsigned char* PutShort(unsigned char* out, unsigned short value)
+{
+    out[0] = value & 0xFF;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+
+/*
+ * Write the pending run of predicted records.
+ */
+static unsigned char* PutRun(TraceDelta* delta, unsigned char* out)
+{
+    if (delta -> run == 0) {
+        return out;
+    }
+
+    if (delta -> run <= MAX_SHORT_RUN) {
+        *out++ = (unsigned char)delta -> run;
+    } else {
+        *out++ = 0;
+        out = PutVarint(out, delta -> run);
+    }
+    delta -> run = 0;
+    return out;
+}
+
+
+/*
+ * Encode one record.
+ */
+size_t TraceDeltaEncode(TraceDelta* delta, const TraceRecord* record, unsigned char* out)
+{
+    TraceRecord predicted;
+    unsigned char* start = out;
+    unsigned char* token; // mask byte of the record token
+    int mask = 0; // fields that differ from the prediction
+
+    Predict(delta, &predicted);
+    if (record -> pc != predicted.pc) {
+        mask |= FIELD_PC;
+        predicted = delta -> last[record -> pc]; // fields still predicted from the actual PC
+        predicted.pc = record -> pc;
+        predicted.regValue += delta -> regStride[record -> pc];
+        predicted.dmemAddr += delta -> addrStride[record -> pc];
+        predicted.dmemValue += delta -> valueStride[record -> pc];
+    }
+    mask |= (record -> insn != predicted.insn) ? FIELD_INSN : 0;
+    mask |= (record -> reg != predicted.reg) ? FIELD_REG : 0;
+    mask |= (record -> regValue != predicted.regValue) ? FIELD_REG_VALUE : 0;
+    mask |= (record -> dmemAddr != predicted.dmemAddr) ? FIELD_DMEM_ADDR : 0;
+    mask |= (record -> dmemValue != predicted.dmemValue) ? FIELD_DMEM_VALUE : 0;
+    mask |= (record -> nzp != predicted.nzp || record -> flags != predicted.flags) ? FIELD_FLAGS : 0;
+
+    if (mask == 0) { // extend the run, nothing to write yet
+        delta -> run++;
+        Update(delta, record);
+        return 0;
+    }
+
+    out = PutRun(delta, out);
+    token = out++;
+    *token = TOKEN_RECORD | mask;
+    if (mask & FIELD_PC) {
+        out = PutShort(out, record -> pc);
+    }
+    if (mask & FIELD_INSN) {
+        out = PutShort(out, record -> insn);
+    }
+    if (mask & FIELD_REG) {
+        out = PutVarint(out, record -> reg);
+    }
+    if (mask & FIELD_REG_VALUE) {
+        out = PutDifference(out, record -> regValue, predicted.regValue);
+    }
+    if (mask & FIELD_DMEM_ADDR) {
+        out = PutDifference(out, record -> dmemAddr, predicted.dmemAddr);
+    }
+    if (mask & FIELD_DMEM_VALUE) {
+        out = PutDifference(out, record -> dmemValue, predicted.dmemValue);
+    }
+    if (mask & FIELD_FLAGS) {
+        *out++ = (unsigned char)((record -> nzp << 3) | record -> flags);
+    }
+
+    Update(delta, record);
+    return out - start;
+}
+
+
+/*
+ * Write the pending run at the end of the stream.
+ */
+size_t TraceDeltaFinish(TraceDelta* delta, unsigned char* out)
+{
+    return PutRun(delta, out) - out;
+}
+
+
+static int GetVarint(FILE* input, unsigned long long* value)
+{
+    int byte = 0;
+    int shift = 0;
+
+    *value = 0;
+    do {
+        byte = getc(input);
+        if (byte == EOF || shift > 63) {
+            return -1;
+        }
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+
+static int GetShort(FILE* input, unsigned short* value)
+{
+    int low = getc(input);
+    int high = getc(input);
+
+    if (low == EOF || high == EOF) {
+        return -1;
+    }
+    *value = (unsigned short)(low | (high << 8));
+    return 0;
+}
+
+
+static int GetDifference(FILE* input, unsigned short* value)
+{
+    unsigned long long zigzag = 0;
+
+    if (GetVarint(input, &zigzag) != 0) {
+        return -1;
+    }
+    *value += (unsigned short)((zigzag >> 1) ^ -(zigzag & 1)); // added to the prediction
+    return 0;
+}
+
+
+/*
+ * Decode the next record.
+ */
+int TraceDeltaDecode(TraceDelta* delta, FILE* input, TraceRecord* record)
+{
+    unsigned long long value = 0;
+    unsigned short pc = 0; // PC given explicitly
+    int token = 0;
+    int mask = 0;
+    int bad = 0; // a field was cut short
+
+    if (delta -> run == 0) {
+        token = getc(input);
+        if (token == EOF) {
+            return 0;
+        }
+
+        if (token == 0) {
+            if (GetVarint(input, &delta -> run) != 0 || delta -> run == 0) {
+                fprintf(stderr, "error: corrupt compressed trace\n");
+                return -1;
+            }
+        } else if (token < TOKEN_RECORD) {
+            delta -> run = token;
+        } else {
+            mask = token & ~TOKEN_RECORD;
+            Predict(delta, record);
+            if (mask & FIELD_PC) {
+                bad |= GetShort(input, &pc);
+                *record = delta -> last[pc];
+                record -> pc = pc;
+                record -> regValue += delta -> regStride[record -> pc];
+                record -> dmemAddr += delta -> addrStride[record -> pc];
+                record -> dmemValue += delta -> valueStride[record -> pc];
+            }
+            if (mask & FIELD_INSN) {
+                bad |= GetShort(input, &record -> insn);
+            }
+            if (mask & FIELD_REG) {
+                bad |= GetVarint(input, &value);
+                record -> reg = (unsigned short)value;
+            }
+            if (mask & FIELD_REG_VALUE) {
+                bad |= GetDifference(input, &record -> regValue);
+            }
+            if (mask & FIELD_DMEM_ADDR) {
+                bad |= GetDifference(input, &record -> dmemAddr);
+            }
+            if (mask & FIELD_DMEM_VALUE) {
+                bad |= GetDifference(input, &record -> dmemValue);
+            }
+            if (mask & FIELD_FLAGS) {
+                value = getc(input);
+                bad |= (value == (unsigned long long)EOF) ? -1 : 0;
+                record -> nzp = (unsigned char)(value >> 3) & 0x1F;
+                record -> flags = (unsigned char)value & 0x7;
+            }
+            if (bad) {
+                fprintf(stderr, "error: corrupt compressed trace\n");
+                return -1;
+            }
+
+            record -> reserved = 0;
+            Update(delta, record);
+            return 1;
+        }
+    }
+
+    Predict(delta, record); // next record of a run
+    record -> reserved = 0;
+    delta -> run--;
+    Update(delta, record);
+    return 1;
+}
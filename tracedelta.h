@@ -0,0 +1,66 @@
+/*
+ * tracedelta.h: Declares the loop-aware delta/run-length trace codec
+ *
+ * Every record is predicted from the machine's own history: the PC from the
+ * PC that followed the previous instruction last time, and the other fields
+ * from the last record seen at that PC (register value and data address/value
+ * extrapolated by their last stride). The stream is a sequence of tokens:
+ *
+ *   0x01-0x7F          that many records equal to their prediction
+ *   0x00 <varint n>    n records equal to their prediction
+ *   0x80 | mask ...    one record; mask bits say which fields follow:
+ *                        0x01 PC (2 bytes), 0x02 insn (2 bytes),
+ *                        0x04 reg (varint), 0x08 regValue, 0x10 dmemAddr,
+ *                        0x20 dmemValue (zigzag varint of the difference from
+ *                        the prediction), 0x40 nzp << 3 | flags (1 byte)
+ *
+ * Varints are little-endian base 128. Loops whose counters move by a constant
+ * step turn into long runs of predicted records.
+ */
+
+#ifndef TRACEDELTA_H
+#define TRACEDELTA_H
+
+#include <stdio.h>
+#include "tracewriter.h"
+
+#define TRACE_DELTA_MAX_TOKEN 32 // most bytes one TraceDeltaEncode/TraceDeltaFinish call writes
+
+// Codec state, identical on the encoding and decoding side
+typedef struct TraceDelta {
+    TraceRecord last[65536]; // last record seen at each PC
+    unsigned short regStride[65536]; // last change of regValue at each PC
+    unsigned short addrStride[65536]; // last change of dmemAddr at each PC
+    unsigned short valueStride[65536]; // last change of dmemValue at each PC
+    unsigned short nextPc[65536]; // PC that followed each PC last time
+    unsigned short prevPc; // PC of the previous record
+    unsigned long long run; // predicted records not yet written (encoder) or still to produce (decoder)
+} TraceDelta;
+
+
+/*
+ * Allocate codec state. Returns NULL if out of memory.
+ */
+TraceDelta* TraceDeltaCreate(void);
+
+
+/*
+ * Encode one record into out (at least TRACE_DELTA_MAX_TOKEN bytes).
+ * Returns the number of bytes written, 0 while a run is being counted.
+ */
+size_t TraceDeltaEncode(TraceDelta* delta, const TraceRecord* record, unsigned char* out);
+
+
+/*
+ * Write the pending run, if any, at the end of the stream. Returns bytes written.
+ */
+size_t TraceDeltaFinish(TraceDelta* delta, unsigned char* out);
+
+
+/*
+ * Decode the next record from input. Returns 1 for a record, 0 at the end of
+ * the stream, -1 (with a message on stderr) for a corrupt stream.
+ */
+int TraceDeltaDecode(TraceDelta* delta, FILE* input, TraceRecord* record);
+
+#endif
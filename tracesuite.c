@@ -0,0 +1,267 @@
+/*
+ * tracesuite.c: Runs every <name>.obj / <name>.txt pair in the given test
+ * directories on a thread pool and checks the output against the golden file
+ *
+ * A golden file starting with "address:" is a loader dump (project 1) and is
+ * compared with the loaded memory; anything else is a trace (project 2) and is
+ * compared with the trace of the program run to completion. A program that
+ * does not match on its own is tried again with the directory's os.obj loaded
+ * first, for tests whose expected output includes the OS.
+ */
+
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "loader.h"
+#include "tracewriter.h"
+
+#define SUITE_BUDGET 100000000ULL // instructions before a program counts as hung
+#define SUITE_MAX_TESTS 1024
+
+typedef struct {
+    char object[512]; // <name>.obj
+    char golden[512]; // <name>.txt
+    char os[512]; // os.obj of the same directory ("" if none)
+
+    int passed; // output matched
+    int withOS; // matched with os.obj loaded
+    int hung; // ran out of SUITE_BUDGET
+    double milliseconds; // time spent on this test
+} SuiteTest;
+
+static SuiteTest tests[SUITE_MAX_TESTS];
+static int testCount = 0;
+static atomic_int nextTest; // next test a worker picks up
+
+
+static double Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+/*
+ * Read a whole file into a malloc'd buffer. Returns NULL on failure.
+ */
+static char* ReadAll(const char* filename, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    char* contents = NULL;
+    long length = 0;
+
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        contents = malloc(length + 1);
+        if (contents != NULL && fread(contents, 1, length, file) != (size_t)length) {
+            free(contents);
+            contents = NULL;
+        }
+    }
+    fclose(file);
+
+    *size = length;
+    return contents;
+}
+
+
+/*
+ * Produce the output to compare for one program: the loader dump or the trace.
+ * Returns a malloc'd buffer (NULL if the program could not be loaded).
+ */
+static char* RunProgram(SuiteTest* test, int withOS, int dump, size_t* size)
+{
+    MachineState* CPU = calloc(1, sizeof(MachineState));
+    FILE* output;
+    char* contents = NULL;
+    int address = 0;
+    int loaded = 0;
+
+    if (CPU == NULL) {
+        return NULL;
+    }
+    output = open_memstream(&contents, size);
+    if (output == NULL) {
+        free(CPU);
+        return NULL;
+    }
+
+    loaded = (!withOS || ReadObjectFile(test -> os, CPU) == 0) && ReadObjectFile(test -> object, CPU) == 0;
+    if (loaded && dump) {
+        for (address = 0; address < 65536; address++) {
+            if (CPU -> memory[address] != 0) {
+                fprintf(output, "address: %05d contents: 0x%04X\n", address, CPU -> memory[address]);
+            }
+        }
+    } else if (loaded) {
+        Reset(CPU);
+        ClearSignals(CPU);
+        CPU -> trace = TraceOpen(output, TRACE_FORMAT_TEXT, 0);
+        if (CPU -> trace != NULL) {
+            test -> hung = (RunBlocks(CPU, output, SUITE_BUDGET) == 0);
+            TraceClose(CPU -> trace);
+        }
+    }
+
+    fclose(output);
+    free(CPU);
+    if (!loaded) {
+        free(contents);
+        return NULL;
+    }
+    return contents;
+}
+
+
+/*
+ * Run one test, comparing in memory.
+ */
+static void RunTest(SuiteTest* test)
+{
+    double start = Now();
+    size_t goldenSize = 0;
+    size_t size = 0;
+    char* golden = ReadAll(test -> golden, &goldenSize);
+    char* output = NULL;
+    int dump = 0; // golden is a loader dump
+    int withOS = 0;
+
+    if (golden == NULL) {
+        test -> milliseconds = Now() - start;
+        return;
+    }
+    dump = (goldenSize >= 8 && strncmp(golden, "address:", 8) == 0);
+
+    for (withOS = 0; withOS <= (test -> os[0] != '\0') && !test -> passed; withOS++) {
+        test -> hung = 0;
+        output = RunProgram(test, withOS, dump, &size);
+        if (output != NULL && size == goldenSize && memcmp(output, golden, size) == 0) {
+            test -> passed = 1;
+            test -> withOS = withOS;
+        }
+        free(output);
+    }
+
+    free(golden);
+    test -> milliseconds = Now() - start;
+}
+
+
+static void* Worker(void* argument)
+{
+    int index = 0;
+
+    (void)argument;
+    while ((index = atomic_fetch_add(&nextTest, 1)) < testCount) {
+        RunTest(&tests[index]);
+    }
+    return NULL;
+}
+
+
+/*
+ * Add every <name>.obj in dir that has a <name>.txt.
+ */
+static void Discover(const char* dir)
+{
+    DIR* directory = opendir(dir);
+    struct dirent* entry;
+    char os[512];
+    size_t length = 0;
+    FILE* probe;
+
+    if (directory == NULL) {
+        fprintf(stderr, "Error: %s could not be open\n", dir);
+        return;
+    }
+
+    snprintf(os, sizeof(os), "%s/os.obj", dir);
+    if (access(os, R_OK) != 0) {
+        os[0] = '\0';
+    }
+
+    while ((entry = readdir(directory)) != NULL && testCount < SUITE_MAX_TESTS) {
+        length = strlen(entry -> d_name);
+        if (length < 5 || strcmp(entry -> d_name + length - 4, ".obj") != 0 || strcmp(entry -> d_name, "os.obj") == 0) {
+            continue;
+        }
+
+        snprintf(tests[testCount].object, sizeof(tests[testCount].object), "%s/%s", dir, entry -> d_name);
+        snprintf(tests[testCount].golden, sizeof(tests[testCount].golden), "%s/%.*s.txt", dir, (int)(length - 4), entry -> d_name);
+        probe = fopen(tests[testCount].golden, "r");
+        if (probe == NULL) { // no expected output
+            continue;
+        }
+        fclose(probe);
+        strcpy(tests[testCount].os, os);
+        testCount++;
+    }
+    closedir(directory);
+}
+
+
+static int CompareTests(const void* a, const void* b)
+{
+    return strcmp(((const SuiteTest*)a) -> object, ((const SuiteTest*)b) -> object);
+}
+
+
+int main(int argc, char** argv)
+{
+    pthread_t* threads;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN); // one per core
+    double start = 0;
+    double slowest = 0;
+    int passed = 0;
+    int i = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: tracesuite <test directory>...\n");
+        return -1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        Discover(argv[i]);
+    }
+    qsort(tests, testCount, sizeof(SuiteTest), CompareTests);
+
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > testCount) {
+        workers = (testCount > 0) ? testCount : 1;
+    }
+    threads = malloc(workers * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+        return -1;
+    }
+
+    start = Now();
+    for (i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, Worker, NULL);
+    }
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < testCount; i++) {
+        printf("%s %-50s %8.2f ms%s%s\n", tests[i].passed ? "PASS" : "FAIL", tests[i].object, tests[i].milliseconds,
+               tests[i].withOS ? " (with os.obj)" : "", tests[i].hung ? " (hung)" : "");
+        passed += tests[i].passed;
+        if (tests[i].milliseconds > slowest) {
+            slowest = tests[i].milliseconds;
+        }
+    }
+    printf("%d/%d passed in %.2f ms on %ld threads (slowest test %.2f ms)\n",
+           passed, testCount, Now() - start, workers, slowest);
+
+    free(threads);
+    return (passed == testCount) ? 0 : 1;
+}
@@ -0,0 +1,592 @@
+/*
+ * tracewriter.c: Buffered trace sink, binary trace records and their text rendering
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tracewriter.h"
+#include "tracedelta.h"
+
+// Lookup tables for TraceFormatText, filled by TraceInitTables
+static char binaryDigits[256][8]; // byte -> "01010101"
+static char hexDigits[65536][4]; // word -> "%04X"
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT; // writers may be opened from several threads
+
+
+/*
+ * Build the formatting tables (run once through tablesOnce).
+ */
+static void TraceInitTables(void)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    int value = 0; // table index
+    int bit = 0; // counter for bits
+
+    for (value = 0; value < 256; value++) {
+        for (bit = 0; bit < 8; bit++) {
+            binaryDigits[value][bit] = '0' + ((value >> (7 - bit)) & 0x1);
+        }
+    }
+    for (value = 0; value < 65536; value++) {
+        hexDigits[value][0] = hex[(value >> 12) & 0xF];
+        hexDigits[value][1] = hex[(value >> 8) & 0xF];
+        hexDigits[value][2] = hex[(value >> 4) & 0xF];
+        hexDigits[value][3] = hex[value & 0xF];
+    }
+}
+
+
+/*
+ * Wait a little for the other side of the ring (yield first, then sleep so a
+ * single core is left to the thread that can make progress).
+ */
+static void TraceBackoff(int* spins)
+{
+    struct timespec pause = {0, 50000}; // 50us
+
+    if ((*spins)++ < 64) {
+        sched_yield();
+    } else {
+        nanosleep(&pause, NULL);
+    }
+}
+
+
+/*
+ * Format (text), compress (delta) or copy (binary) one slot of records to the
+ * output. Runs on the writer thread.
+ */
+static void TraceWriteSlot(TraceWriter* writer, const unsigned char* slot, size_t used)
+{
+    size_t offset = 0; // record being formatted
+    size_t length = 0; // text bytes waiting
+
+    if (writer -> format == TRACE_FORMAT_BIN) {
+        if (fwrite(slot, 1, used, writer -> output) != used) {
+            atomic_store(&writer -> error, 1);
+        }
+        return;
+    }
+
+    for (offset = 0; offset < used; offset += sizeof(TraceRecord)) {
+        if (writer -> format == TRACE_FORMAT_DELTA) {
+            length += TraceDeltaEncode(writer -> delta, (const TraceRecord*)(slot + offset), writer -> text + length);
+        } else {
+            length += TraceFormatText((const TraceRecord*)(slot + offset), (char*)writer -> text + length);
+        }
+        if (length + TRACE_MAX_LINE > TRACE_BUFFER_SIZE || offset + sizeof(TraceRecord) >= used) {
+            if (fwrite(writer -> text, 1, length, writer -> output) != length) {
+                atomic_store(&writer -> error, 1);
+            }
+            length = 0;
+        }
+    }
+}
+
+
+/*
+ * Writer thread: drain published slots until the writer is closed and the ring is empty.
+ */
+static void* TraceThread(void* argument)
+{
+    TraceWriter* writer = argument;
+    unsigned long tail = 0; // next slot to write
+    unsigned long head = 0; // slots published so far
+    size_t length = 0; // bytes of the final compressed token
+    int spins = 0;
+
+    for (;;) {
+        head = atomic_load_explicit(&writer -> head, memory_order_acquire);
+        if (tail == head) {
+            // closing is set after the last publish, so head is final once it is seen
+            if (atomic_load(&writer -> closing) && tail == atomic_load_explicit(&writer -> head, memory_order_acquire)) {
+                break;
+            }
+            TraceBackoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        TraceWriteSlot(writer, writer -> ring + (tail % TRACE_RING_SLOTS) * TRACE_CHUNK_SIZE,
+                       writer -> slotUsed[tail % TRACE_RING_SLOTS]);
+        tail++;
+        atomic_store_explicit(&writer -> tail, tail, memory_order_release);
+    }
+
+    if (writer -> format == TRACE_FORMAT_DELTA) { // the run still being counted
+        length = TraceDeltaFinish(writer -> delta, writer -> text);
+        if (fwrite(writer -> text, 1, length, writer -> output) != length) {
+            atomic_store(&writer -> error, 1);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Release a writer's buffers and the writer.
+ */
+static void TraceFree(TraceWriter* writer)
+{
+    if (writer -> ring == NULL) { // async writers point buffer into the ring
+        free(writer -> buffer);
+    }
+    free(writer -> ring);
+    free(writer -> text);
+    free(writer -> delta);
+    if (writer -> expectedSize != 0) {
+        munmap((void*)writer -> expected, writer -> expectedSize);
+    }
+    free(writer);
+}
+
+
+/*
+ * Map the expected trace of a TRACE_FORMAT_EXPECT writer.
+ */
+static int TraceMapExpected(TraceWriter* writer, FILE* input)
+{
+    struct stat info;
+    void* mapping;
+
+    writer -> expected = ""; // an empty file cannot be mapped
+    writer -> context = TRACE_EXPECT_CONTEXT;
+    if (fstat(fileno(input), &info) != 0) {
+        fprintf(stderr, "error: could not read the expected trace\n");
+        return -1;
+    }
+    if (info.st_size == 0) {
+        return 0;
+    }
+
+    mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "error: could not map the expected trace\n");
+        return -1;
+    }
+    madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+    writer -> expected = mapping;
+    writer -> expectedSize = info.st_size;
+    return 0;
+}
+
+
+/*
+ * Create a writer for output, writing the header for binary traces.
+ */
+TraceWriter* TraceOpen(FILE* output, int format, int async)
+{
+    TraceWriter* writer = calloc(1, sizeof(TraceWriter));
+    TraceHeader header;
+
+    if (writer == NULL) {
+        fprintf(stderr, "error: out of memory for trace buffer\n");
+        return NULL;
+    }
+    pthread_once(&tablesOnce, TraceInitTables);
+    if (format == TRACE_FORMAT_EXPECT) {
+        async = 0; // comparing is cheaper than handing the records over
+        if (TraceMapExpected(writer, output) != 0) {
+            TraceFree(writer);
+            return NULL;
+        }
+    }
+    writer -> output = output;
+    writer -> format = format;
+    writer -> packed = (format == TRACE_FORMAT_BIN) || async;
+
+    if (format == TRACE_FORMAT_DELTA) {
+        writer -> delta = TraceDeltaCreate();
+        if (writer -> delta == NULL) {
+            TraceFree(writer);
+            return NULL;
+        }
+    }
+
+    if (format == TRACE_FORMAT_BIN || format == TRACE_FORMAT_DELTA) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, 4);
+        header.version = TRACE_VERSION;
+        header.recordSize = sizeof(TraceRecord);
+        header.byteOrder = TRACE_BYTE_ORDER;
+        header.encoding = (format == TRACE_FORMAT_DELTA) ? TRACE_ENCODING_DELTA : TRACE_ENCODING_RAW;
+
+        if (fwrite(&header, sizeof(header), 1, output) != 1) {
+            fprintf(stderr, "error: could not write trace header\n");
+            TraceFree(writer);
+            return NULL;
+        }
+    }
+
+    if (async) {
+        writer -> ring = malloc((size_t)TRACE_RING_SLOTS * TRACE_CHUNK_SIZE);
+        writer -> text = malloc(TRACE_BUFFER_SIZE);
+        if (writer -> ring == NULL || writer -> text == NULL) {
+            fprintf(stderr, "error: out of memory for trace buffer\n");
+            TraceFree(writer);
+            return NULL;
+        }
+        writer -> buffer = writer -> ring; // slot 0
+        writer -> capacity = TRACE_CHUNK_SIZE - TRACE_CHUNK_SIZE % sizeof(TraceRecord);
+
+        if (pthread_create(&writer -> thread, NULL, TraceThread, writer) != 0) {
+            fprintf(stderr, "error: could not start trace writer thread\n");
+            TraceFree(writer);
+            return NULL;
+        }
+        writer -> async = 1;
+    } else {
+        writer -> buffer = malloc(TRACE_BUFFER_SIZE);
+        writer -> capacity = TRACE_BUFFER_SIZE;
+        if (writer -> buffer == NULL) {
+            fprintf(stderr, "error: out of memory for trace buffer\n");
+            TraceFree(writer);
+            return NULL;
+        }
+    }
+
+    return writer;
+}
+
+
+/*
+ * Hand the current slot to the writer thread and move on to the next free one.
+ */
+static int TracePublish(TraceWriter* writer)
+{
+    unsigned long head = atomic_load_explicit(&writer -> head, memory_order_relaxed); // only this thread writes it
+    int spins = 0;
+
+    if (writer -> used != 0) {
+        writer -> slotUsed[head % TRACE_RING_SLOTS] = writer -> used;
+        head++;
+        atomic_store_explicit(&writer -> head, head, memory_order_release);
+
+        // Back-pressure: the next slot is free once the writer thread has written it out
+        while (head - atomic_load_explicit(&writer -> tail, memory_order_acquire) >= TRACE_RING_SLOTS) {
+            TraceBackoff(&spins);
+        }
+        writer -> buffer = writer -> ring + (head % TRACE_RING_SLOTS) * TRACE_CHUNK_SIZE;
+        writer -> used = 0;
+    }
+
+    return atomic_load(&writer -> error) ? -1 : 0;
+}
+
+
+/*
+ * Count the lines in the first length bytes of text.
+ */
+static unsigned long long TraceCountLines(const char* text, size_t length)
+{
+    const char* end = text + length;
+    unsigned long long lines = 0;
+
+    while (text < end && (text = memchr(text, '\n', end - text)) != NULL) {
+        lines++;
+        text++;
+    }
+    return lines;
+}
+
+
+/*
+ * Print label and the line starting at text (which ends at a newline or at end).
+ */
+static void TracePrintLine(const char* label, const char* text, const char* end)
+{
+    const char* newline = (text < end) ? memchr(text, '\n', end - text) : NULL;
+
+    if (text >= end) {
+        fprintf(stderr, "%s(end of trace)\n", label);
+        return;
+    }
+    fprintf(stderr, "%s%.*s\n", label, (int)(((newline != NULL) ? newline : end) - text), text);
+}
+
+
+/*
+ * Print the fields that differ between an expected and an actual text line.
+ */
+static void TracePrintFields(const char* expected, const char* expectedEnd, const char* actual, const char* actualEnd)
+{
+    static const char* const names[] = {"PC", "instruction", "regFile_WE", "register", "register value",
+                                        "NZP_WE", "NZP", "DATA_WE", "data address", "data value"};
+    size_t expectedLength = 0; // length of the current field
+    size_t actualLength = 0;
+    int field = 0;
+
+    for (field = 0; field < 10; field++) {
+        while (expected < expectedEnd && *expected == ' ') expected++;
+        while (actual < actualEnd && *actual == ' ') actual++;
+        for (expectedLength = 0; expected + expectedLength < expectedEnd &&
+             expected[expectedLength] != ' ' && expected[expectedLength] != '\n'; expectedLength++);
+        for (actualLength = 0; actual + actualLength < actualEnd &&
+             actual[actualLength] != ' ' && actual[actualLength] != '\n'; actualLength++);
+
+        if (expectedLength != actualLength || memcmp(expected, actual, actualLength) != 0) {
+            fprintf(stderr, "  %s: expected %.*s, got %.*s\n", names[field],
+                    (int)expectedLength, expected, (int)actualLength, actual);
+        }
+        expected += expectedLength;
+        actual += actualLength;
+    }
+}
+
+
+/*
+ * Report a divergence at offset in the expected trace: the matching lines
+ * before it, then the expected line against actual (NULL when the run ended
+ * before the expected trace did).
+ */
+static void TraceReportDivergence(TraceWriter* writer, size_t offset, const char* actual, const char* actualEnd)
+{
+    const char* expected = writer -> expected;
+    const char* first = expected + offset; // first context line
+    int lines = 0; // context lines
+
+    while (first > expected && lines < writer -> context) {
+        first--; // newline ending the line before
+        while (first > expected && first[-1] != '\n') {
+            first--;
+        }
+        lines++;
+    }
+
+    if (actual != NULL) {
+        fprintf(stderr, "error: trace diverges at instruction %llu (PC %.4s)\n",
+                TraceCountLines(expected, offset) + 1, actual);
+    } else {
+        fprintf(stderr, "error: run ended after %llu instructions, before the expected trace\n",
+                TraceCountLines(expected, offset));
+    }
+    if (lines > 0) {
+        fprintf(stderr, "last %d matching lines:\n", lines);
+    }
+    while (first < expected + offset) {
+        TracePrintLine("  ", first, expected + offset);
+        first = (const char*)memchr(first, '\n', expected + offset - first) + 1;
+    }
+    TracePrintLine("expected: ", expected + offset, expected + writer -> expectedSize);
+    if (actual != NULL) {
+        TracePrintLine("actual:   ", actual, actualEnd);
+    }
+    if (actual != NULL && offset < writer -> expectedSize) {
+        TracePrintFields(expected + offset, expected + writer -> expectedSize, actual, actualEnd);
+    }
+}
+
+
+/*
+ * Compare the buffered lines with the next bytes of the expected trace.
+ */
+static int TraceCompare(TraceWriter* writer)
+{
+    const char* actual = (const char*)writer -> buffer;
+    const char* expected = writer -> expected + writer -> matched;
+    size_t used = writer -> used; // bytes to compare
+    size_t left = writer -> expectedSize - writer -> matched; // expected bytes not matched yet
+    size_t same = 0; // leading bytes that match
+    size_t line = 0; // start of the diverging line in the buffer
+
+    writer -> used = 0;
+    if (atomic_load(&writer -> error)) { // reported already
+        return -1;
+    }
+    if (used <= left && memcmp(expected, actual, used) == 0) {
+        writer -> matched += used;
+        return 0;
+    }
+
+    while (same < used && same < left && actual[same] == expected[same]) {
+        same++;
+    }
+    for (line = same; line > 0 && actual[line - 1] != '\n'; line--);
+    TraceReportDivergence(writer, writer -> matched + line, actual + line, actual + used);
+    atomic_store(&writer -> error, 1);
+    return -1;
+}
+
+
+/*
+ * Write out everything buffered.
+ */
+int TraceFlush(TraceWriter* writer)
+{
+    size_t used = writer -> used; // bytes to write
+
+    if (writer -> format == TRACE_FORMAT_EXPECT) {
+        return TraceCompare(writer);
+    }
+    if (writer -> async) {
+        return TracePublish(writer);
+    }
+
+    writer -> used = 0;
+    if (used != 0 && fwrite(writer -> buffer, 1, used, writer -> output) != used) {
+        if (!atomic_exchange(&writer -> error, 1)) { // report once, not per buffer
+            fprintf(stderr, "error: trace write failed\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Queue a line that is not an instruction.
+ */
+void TraceNote(TraceWriter* writer, const char* line)
+{
+    size_t length = strlen(line);
+
+    if (writer -> packed || writer -> format != TRACE_FORMAT_TEXT) { // records have no room for it
+        return;
+    }
+    if (writer -> used + length > writer -> capacity) {
+        TraceFlush(writer);
+    }
+    memcpy(writer -> buffer + writer -> used, line, length);
+    writer -> used += length;
+}
+
+
+/*
+ * Flush, stop the writer thread and free the writer.
+ */
+int TraceClose(TraceWriter* writer)
+{
+    int status = 0;
+
+    if (writer == NULL) {
+        return 0;
+    }
+
+    if (writer -> delta != NULL && !writer -> async) { // the run still being counted
+        writer -> used += TraceDeltaFinish(writer -> delta, writer -> buffer + writer -> used);
+    }
+
+    status = TraceFlush(writer);
+    if (writer -> format == TRACE_FORMAT_EXPECT && status == 0 && writer -> matched != writer -> expectedSize) {
+        TraceReportDivergence(writer, writer -> matched, NULL, NULL);
+        status = -1;
+    }
+    if (writer -> async) {
+        atomic_store(&writer -> closing, 1);
+        pthread_join(writer -> thread, NULL);
+        if (atomic_load(&writer -> error)) {
+            fprintf(stderr, "error: trace write failed\n");
+            status = -1;
+        }
+    }
+
+    TraceFree(writer);
+    return status;
+}
+
+
+/*
+ * Write value in decimal ("%d"), returning the end of the digits.
+ */
+static char* Decimal(char* out, unsigned int value)
+{
+    char digits[5]; // an unsigned short has at most 5
+    int count = 0;
+
+    if (value < 10) { // register numbers and NZP: the common case
+        *out++ = '0' + value;
+        return out;
+    }
+
+    while (value != 0) {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    }
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+
+/*
+ * Format one record exactly as WriteOut prints the line.
+ */
+size_t TraceFormatText(const TraceRecord* record, char* line)
+{
+    char* out = line; // next character
+
+    memcpy(out, hexDigits[record -> pc], 4);
+    out[4] = ' ';
+    out += 5;
+
+    memcpy(out, binaryDigits[record -> insn >> 8], 8);
+    memcpy(out + 8, binaryDigits[record -> insn & 0xFF], 8);
+    out[16] = ' ';
+    out += 17;
+
+    *out++ = (record -> flags & TRACE_REG_WE) ? '1' : '0';
+    *out++ = ' ';
+    out = Decimal(out, record -> reg);
+    *out++ = ' ';
+    memcpy(out, hexDigits[record -> regValue], 4);
+    out[4] = ' ';
+    out += 5;
+
+    *out++ = (record -> flags & TRACE_NZP_WE) ? '1' : '0';
+    *out++ = ' ';
+    out = Decimal(out, record -> nzp);
+    *out++ = ' ';
+
+    *out++ = (record -> flags & TRACE_DATA_WE) ? '1' : '0';
+    *out++ = ' ';
+    memcpy(out, hexDigits[record -> dmemAddr], 4);
+    out[4] = ' ';
+    memcpy(out + 5, hexDigits[record -> dmemValue], 4);
+    out[9] = '\n';
+    out += 10;
+
+    return out - line;
+}
+
+
+/*
+ * Compress one record into the buffer.
+ */
+void TraceAppendDelta(TraceWriter* writer, const TraceRecord* record)
+{
+    if (writer -> used + 2 * TRACE_DELTA_MAX_TOKEN > writer -> capacity) { // room for this token and the final run
+        TraceFlush(writer);
+    }
+    writer -> used += TraceDeltaEncode(writer -> delta, record, writer -> buffer + writer -> used);
+}
+
+
+/*
+ * Read and check a binary trace header.
+ */
+int TraceReadHeader(FILE* input)
+{
+    TraceHeader header;
+
+    if (fread(&header, sizeof(header), 1, input) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0) {
+        fprintf(stderr, "error: not a binary LC4 trace\n");
+        return -1;
+    }
+    if (header.byteOrder != TRACE_BYTE_ORDER) {
+        fprintf(stderr, "error: trace was written on a host with a different byte order\n");
+        return -1;
+    }
+    if (header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord)) {
+        fprintf(stderr, "error: unsupported trace version %d (record size %d)\n", header.version, header.recordSize);
+        return -1;
+    }
+    if (header.encoding != TRACE_ENCODING_RAW && header.encoding != TRACE_ENCODING_DELTA) {
+        fprintf(stderr, "error: unknown trace encoding %d\n", header.encoding);
+        return -1;
+    }
+    return header.encoding;
+}
@@ -0,0 +1,173 @@
+/*
+ * tracewriter.h: Declares the buffered trace sink and the binary trace formats
+ */
+
+#ifndef TRACEWRITER_H
+#define TRACEWRITER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define TRACE_FORMAT_TEXT 0 // one ASCII line per instruction (the classic format)
+#define TRACE_FORMAT_BIN 1 // TraceHeader followed by one TraceRecord per instruction
+#define TRACE_FORMAT_DELTA 2 // TraceHeader followed by the compressed stream of tracedelta.h
+#define TRACE_FORMAT_EXPECT 3 // text lines compared against the expected trace in output instead of written
+
+// TraceHeader.encoding
+#define TRACE_ENCODING_RAW 0 // TraceRecords
+#define TRACE_ENCODING_DELTA 1 // tracedelta.h stream
+
+#define TRACE_MAGIC "LC4T" // first four bytes of a binary trace
+#define TRACE_VERSION 1 // bump whenever TraceRecord changes
+#define TRACE_BYTE_ORDER 0x0102 // written in the writer's byte order
+
+#define TRACE_BUFFER_SIZE (4 << 20) // bytes collected before each fwrite
+#define TRACE_MAX_LINE 64 // longest text line TraceFormatText can produce
+
+#define TRACE_CHUNK_SIZE (1 << 20) // bytes of records in each ring slot handed to the writer thread
+#define TRACE_RING_SLOTS 8 // ring slots; the simulation waits when all are full
+
+#define TRACE_EXPECT_CONTEXT 5 // matching lines shown before a divergence
+
+// Flag bits of TraceRecord.flags (the *_WE signals, which are only ever 0 or 1)
+#define TRACE_REG_WE 0x1
+#define TRACE_NZP_WE 0x2
+#define TRACE_DATA_WE 0x4
+
+// Binary trace header
+typedef struct {
+    char magic[4]; // TRACE_MAGIC
+    unsigned short version; // TRACE_VERSION
+    unsigned short recordSize; // sizeof(TraceRecord)
+    unsigned short byteOrder; // TRACE_BYTE_ORDER
+    unsigned short encoding; // TRACE_ENCODING_*
+    unsigned short reserved[2]; // zero
+} TraceHeader;
+
+// One executed instruction, holding exactly what a text trace line shows
+typedef struct {
+    unsigned short pc; // PC of the instruction
+    unsigned short insn; // instruction word
+    unsigned short reg; // register number printed (0 unless TRACE_REG_WE)
+    unsigned short regValue; // value printed for that register
+    unsigned short dmemAddr; // data memory address
+    unsigned short dmemValue; // data memory value loaded/stored
+    unsigned char nzp; // NZP value printed (0 unless TRACE_NZP_WE)
+    unsigned char flags; // TRACE_*_WE bits
+    unsigned short reserved; // zero, keeps records 16 bytes
+} TraceRecord;
+
+// Trace sink a MachineState writes through instead of fprintf-ing each line
+typedef struct TraceWriter {
+    FILE* output; // destination file (not owned)
+    int format; // TRACE_FORMAT_*
+    int packed; // buffer holds TraceRecords (binary or async) rather than text
+    unsigned char* buffer; // where TraceAppend writes: own storage or the current ring slot
+    size_t capacity; // size of buffer
+    size_t used; // bytes waiting in buffer
+
+    // Async writers: the simulation thread fills ring slots with records and
+    // publishes them through head; the writer thread formats, writes and
+    // releases them through tail. Single producer, single consumer, no locks.
+    int async; // writer thread running
+    pthread_t thread;
+    unsigned char* ring; // TRACE_RING_SLOTS slots of TRACE_CHUNK_SIZE bytes
+    size_t slotUsed[TRACE_RING_SLOTS]; // bytes in each published slot
+    atomic_ulong head; // slots published
+    atomic_ulong tail; // slots written out
+    atomic_int closing; // no more slots will be published
+    atomic_int error; // a write failed
+    unsigned char* text; // writer thread's text formatting/compression buffer
+
+    struct TraceDelta* delta; // compression state for TRACE_FORMAT_DELTA
+
+    // TRACE_FORMAT_EXPECT: output is mapped and each buffer is compared with
+    // the next bytes of it; after the first divergence every flush fails
+    const char* expected; // the expected text trace (NULL when empty)
+    size_t expectedSize; // bytes in it
+    size_t matched; // bytes matched so far
+    int context; // matching lines reported before a divergence
+} TraceWriter;
+
+
+/*
+ * Create a writer for output, writing the header for binary traces. With async
+ * set, formatting and writing happen on a separate writer thread.
+ * TRACE_FORMAT_EXPECT takes output opened for reading on a text trace, and is
+ * never async. Returns NULL on failure.
+ */
+TraceWriter* TraceOpen(FILE* output, int format, int async);
+
+
+/*
+ * Write out everything buffered (async writers hand the buffer to the writer
+ * thread, waiting while the ring is full; expect writers compare it, reporting
+ * the first divergence on stderr). Returns 0 on success, -1 on a write error
+ * or once the trace has diverged.
+ */
+int TraceFlush(TraceWriter* writer);
+
+
+/*
+ * Queue line (newline included) as is, between the instruction lines of a
+ * synchronous text trace. Other writers drop it.
+ */
+void TraceNote(TraceWriter* writer, const char* line);
+
+
+/*
+ * Flush, stop the writer thread once it has written everything, and free the
+ * writer (output itself stays open). Returns 0 or -1 like TraceFlush; expect
+ * writers also fail if the expected trace goes on past the run.
+ */
+int TraceClose(TraceWriter* writer);
+
+
+/*
+ * Format one record as a text trace line (byte-identical to WriteOut) into
+ * line, which needs TRACE_MAX_LINE bytes. Returns the line length. The lookup
+ * tables it uses are built by TraceOpen.
+ */
+size_t TraceFormatText(const TraceRecord* record, char* line);
+
+
+/*
+ * Compress one record into the buffer (TRACE_FORMAT_DELTA, see TraceAppend).
+ */
+void TraceAppendDelta(TraceWriter* writer, const TraceRecord* record);
+
+
+/*
+ * Read and check a binary trace header. Returns its TRACE_ENCODING_* if input
+ * holds a trace this build can read, -1 (with a message on stderr) otherwise.
+ */
+int TraceReadHeader(FILE* input);
+
+
+/*
+ * Queue one record, formatting it into the buffer for text writers.
+ */
+static inline void TraceAppend(TraceWriter* writer, const TraceRecord* record)
+{
+    if (!writer -> packed) {
+        if (writer -> format == TRACE_FORMAT_DELTA) {
+            TraceAppendDelta(writer, record);
+            return;
+        }
+        if (writer -> used + TRACE_MAX_LINE > writer -> capacity) {
+            TraceFlush(writer);
+        }
+        writer -> used += TraceFormatText(record, (char*)writer -> buffer + writer -> used);
+        return;
+    }
+
+    if (writer -> used + sizeof(TraceRecord) > writer -> capacity) {
+        TraceFlush(writer);
+    }
+    memcpy(writer -> buffer + writer -> used, record, sizeof(TraceRecord));
+    writer -> used += sizeof(TraceRecord);
+}
+
+#endif